@@ -0,0 +1,31 @@
+TEMPLATE = app 
+TARGET = build_index
+
+CONFIG += console
+
+OBJECTS_DIR = bin
+
+INCLUDEPATH += ../segment_tree
+INCLUDEPATH += ../visualization/headers 
+
+QMAKE_CXXFLAGS = -std=c++0x -Wall
+
+macx {
+    QMAKE_CXXFLAGS += -stdlib=libc++  
+}
+
+CONFIG += precompile_header
+PRECOMPILED_HEADER = ../segment_tree/stdafx.h
+
+HEADERS += \
+	../segment_tree/flat_range_tree.h \
+	../segment_tree/index_file.h \
+	../segment_tree/parallel.h \
+	../segment_tree/segment_tree.h \
+	../segment_tree/segment_windowing.h
+
+
+SOURCES += \ 
+	main.cpp
+
+LIBS += -L../visualization -lvisualization
@@ -0,0 +1,68 @@
+#include "stdafx.h"
+#include "primitives.h"
+#include "segment_windowing.h"
+
+#include <fstream>
+
+// Builds the index file of windowing_t for a set of segments, for a process to map instead of building.
+// The segments are read as text, one "x0 y0 x1 y1" per line.
+
+namespace
+{
+    vector<segment_t> read_segments(const string &path)
+    {
+        std::ifstream in(path.c_str());
+        if (!in)
+            throw std::runtime_error("can't open " + path);
+
+        vector<segment_t> segments;
+        coord_t x0, y0, x1, y1;
+        while (in >> x0 >> y0 >> x1 >> y1)
+            segments.push_back(segment_t(point_t(x0, y0), point_t(x1, y1)));
+
+        if (!in.eof())
+            throw std::runtime_error(path + ": a line is not four numbers");
+
+        return segments;
+    }
+
+    double seconds_since(const pt::ptime &start)
+    {
+        return (pt::microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        cout << "usage: build_index <segments file> <index file>" << endl;
+        return 1;
+    }
+
+    try
+    {
+        const vector<segment_t> segments = read_segments(argv[1]);
+        if (segments.empty())
+            throw std::runtime_error("no segments");
+
+        pt::ptime start = pt::microsec_clock::universal_time();
+        const windowing_t windowing(segments);
+        cout << segments.size() << " segments indexed in " << seconds_since(start) << "s" << endl;
+
+        start = pt::microsec_clock::universal_time();
+        windowing.save(argv[2]);
+
+        // the file is read back, checksum and all, before anyone relies on it
+        const windowing_t check(argv[2]);
+        MY_ASSERT(check.size() == segments.size());
+        cout << argv[2] << " written and checked in " << seconds_since(start) << "s" << endl;
+    }
+    catch (std::exception &e)
+    {
+        cout << "build_index: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include "primitives.h"
+#include "parallel.h"
+#include "succinct.h"
+
+// flat_range_tree_t in a fraction of the memory, the same queries and the same implicit tree.
+// A level of flat_range_tree_t is n x ranks and n cascade offsets, 64 bits per point. Here a level is one bit per
+// point, whether it goes to the right child, with rank support (a wavelet tree): the offsets into the children
+// are counts of zeros and ones, so the ranks aren't needed at all for the search. The coordinates and the point
+// index of every x rank are packed into as many bits as their ranges need.
+// count costs about the same as in flat_range_tree_t, a cascade step reads one line of bits instead of one word.
+// Reporting needs the point at every position, so every sample_rate-th level (counting from the leaves, where the
+// position is the x rank) keeps its point indices too, packed: a canonical node's subtree is walked down to the
+// nearest such level and read there in order. A higher rate is less memory and slower reporting.
+struct compact_range_tree_t
+{
+    typedef vector<point_t> points_t;
+
+    static const size_t default_sample_rate = 4;
+
+    compact_range_tree_t(const points_t &points, size_t sample_rate = default_sample_rate)
+        : size_(points.size())
+        , levels_(count_levels(points.size()))
+        , sample_rate_(sample_rate)
+        , x_min_(0)
+        , y_min_(0)
+    {
+        MY_ASSERT(sample_rate_ > 0);
+        MY_ASSERT(size_ < (uint64_t(1) << 32));
+        build(points);
+        MY_ASSERT(ok());
+    }
+
+    vector<size_t> query(const range_t &x_range, const range_t &y_range) const
+    {
+        vector<size_t> result;
+        query(x_range, y_range, [&result](size_t i) { result.push_back(i); });
+        return result;
+    }
+
+    // calls f(point index) for every point in the range
+    template<typename F>
+    void query(const range_t &x_range, const range_t &y_range, F f) const
+    {
+        visit_subsets(x_range, y_range, [this, &f](size_t level, size_t lo, size_t hi, size_t first, size_t last)
+        {
+            report(level, lo, hi, first, last, f);
+        });
+    }
+
+    size_t count(const range_t &x_range, const range_t &y_range) const
+    {
+        size_t result = 0;
+        visit_subsets(x_range, y_range, [&result](size_t, size_t, size_t, size_t first, size_t last)
+        {
+            result += last - first;
+        });
+        return result;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    size_t memory_size() const
+    {
+        size_t result = xs_.memory_size() + ys_.memory_size() + by_x_.memory_size();
+        BOOST_FOREACH(const rank_bitvector_t &bits, bits_)
+            result += bits.memory_size();
+        BOOST_FOREACH(const packed_array_t &sampled, sampled_points_)
+            result += sampled.memory_size();
+        return result;
+    }
+
+private:
+    static size_t count_levels(size_t n)
+    {
+        size_t levels = 1;
+        for (size_t size = n; size > 1; size = (size + 1) / 2)
+            ++levels;
+        return levels;
+    }
+
+    bool is_sampled(size_t level) const
+    {
+        return (levels_ - 1 - level) % sample_rate_ == 0;
+    }
+
+    // (coordinate, index) as one integer, ordered by the coordinate
+    static uint64_t sort_key(coord_t c, uint32_t i)
+    {
+        return (uint64_t(uint32_t(c) ^ 0x80000000u) << 32) | i;
+    }
+
+    static coord_t key_coord(uint64_t key)
+    {
+        return coord_t(uint32_t(key >> 32) ^ 0x80000000u);
+    }
+
+    // level by level from the root, with the x ranks of one level and of the next only
+    void build(const points_t &points)
+    {
+        if (size_ == 0)
+            return;
+
+        const size_t depth = parallel_depth();
+
+        vector<uint64_t> keys(size_);
+        for (size_t i = 0; i < size_; ++i)
+            keys[i] = sort_key(points[i].x, uint32_t(i));
+        parallel_sort(keys.begin(), keys.end(), std::less<uint64_t>(), depth);
+
+        x_min_ = key_coord(keys.front());
+        xs_ = packed_array_t(size_, bits_for(uint64_t(int64_t(key_coord(keys.back())) - x_min_)));
+        by_x_ = packed_array_t(size_, bits_for(size_ - 1));
+        vector<uint32_t> by_x(size_);
+        for (size_t i = 0; i < size_; ++i)
+        {
+            by_x[i] = uint32_t(keys[i]);
+            xs_.set(i, uint64_t(int64_t(key_coord(keys[i])) - x_min_));
+            by_x_.set(i, by_x[i]);
+        }
+
+        // the root is the ranks in y order
+        for (size_t i = 0; i < size_; ++i)
+            keys[i] = sort_key(points[by_x[i]].y, uint32_t(i));
+        parallel_sort(keys.begin(), keys.end(), std::less<uint64_t>(), depth);
+
+        y_min_ = key_coord(keys.front());
+        ys_ = packed_array_t(size_, bits_for(uint64_t(int64_t(key_coord(keys.back())) - y_min_)));
+        vector<uint32_t> ranks(size_);
+        for (size_t i = 0; i < size_; ++i)
+        {
+            ranks[i] = uint32_t(keys[i]);
+            ys_.set(i, uint64_t(int64_t(key_coord(keys[i])) - y_min_));
+        }
+        vector<uint64_t>().swap(keys);
+
+        // the nodes of the level by where they start, and the ranks split into the next level
+        vector<uint32_t> starts(1, 0), next_starts;
+        vector<uint32_t> next(size_);
+        // a byte per point, so the nodes can be split in parallel
+        vector<uint8_t> right(size_);
+
+        bits_.resize(levels_ - 1);
+        sampled_points_.resize(levels_);
+        for (size_t level = 0; level + 1 < levels_; ++level)
+        {
+            if (is_sampled(level))
+            {
+                sampled_points_[level] = packed_array_t(size_, bits_for(size_ - 1));
+                for (size_t i = 0; i < size_; ++i)
+                    sampled_points_[level].set(i, by_x[ranks[i]]);
+            }
+
+            starts.push_back(uint32_t(size_));
+            parallel_for(0, starts.size() - 1, 1 << 10, [&starts, &ranks, &next, &right](size_t begin, size_t end)
+            {
+                for (size_t node = begin; node < end; ++node)
+                {
+                    const size_t lo = starts[node], hi = starts[node + 1];
+                    if (hi - lo <= 1)
+                    {
+                        // a leaf stays where it is, it never goes right
+                        for (size_t i = lo; i < hi; ++i)
+                        {
+                            next[i] = ranks[i];
+                            right[i] = 0;
+                        }
+                        continue;
+                    }
+
+                    const size_t mid = lo + (hi - lo) / 2;
+                    size_t l = lo, r = mid;
+                    for (size_t i = lo; i < hi; ++i)
+                    {
+                        right[i] = ranks[i] >= mid;
+                        if (ranks[i] < mid)
+                            next[l++] = ranks[i];
+                        else
+                            next[r++] = ranks[i];
+                    }
+                    MY_ASSERT(l == mid && r == hi);
+                }
+            }, depth);
+
+            bits_[level] = rank_bitvector_t(size_, [&right](size_t i) { return right[i] != 0; }, depth);
+
+            next_starts.clear();
+            for (size_t node = 0; node + 1 < starts.size(); ++node)
+            {
+                const uint32_t lo = starts[node], hi = starts[node + 1];
+                next_starts.push_back(lo);
+                if (hi - lo > 1)
+                    next_starts.push_back(lo + (hi - lo) / 2);
+            }
+
+            starts.swap(next_starts);
+            ranks.swap(next);
+        }
+    }
+
+    static uint64_t key(coord_t c, coord_t min)
+    {
+        return c <= min ? 0 : uint64_t(int64_t(c) - min);
+    }
+
+    // the four lower bounds in lockstep, see flat_range_tree_t::search
+    void search(const range_t &x_range, const range_t &y_range, size_t &x_first, size_t &x_last,
+                size_t &first, size_t &last) const
+    {
+        const uint64_t x_inf = key(x_range.inf, x_min_), x_sup = key(x_range.sup, x_min_);
+        const uint64_t y_inf = key(y_range.inf, y_min_), y_sup = key(y_range.sup, y_min_);
+
+        x_first = x_last = first = last = 0;
+        for (size_t n = size_; n > 1; n -= n / 2)
+        {
+            const size_t half = n / 2;
+            x_first += xs_[x_first + half] < x_inf ? half : 0;
+            x_last  += xs_[x_last  + half] < x_sup ? half : 0;
+            first   += ys_[first   + half] < y_inf ? half : 0;
+            last    += ys_[last    + half] < y_sup ? half : 0;
+        }
+
+        x_first += xs_[x_first] < x_inf;
+        x_last  += xs_[x_last ] < x_sup;
+        first   += ys_[first  ] < y_inf;
+        last    += ys_[last   ] < y_sup;
+    }
+
+    // calls f(level, lo, hi, first, last) for every canonical node [lo, hi) of the level, [first, last) are the
+    // positions of its points on the level
+    template<typename F>
+    void visit_subsets(const range_t &x_range, const range_t &y_range, F f) const
+    {
+        if (size_ == 0)
+            return;
+
+        size_t x_first, x_last, first, last;
+        search(x_range, y_range, x_first, x_last, first, last);
+        if (x_first >= x_last || first >= last)
+            return;
+
+        visit_node(0, 0, size_, first, last, x_first, x_last, f);
+    }
+
+    template<typename F>
+    void visit_node(size_t level, size_t lo, size_t hi, size_t first, size_t last,
+                    size_t x_first, size_t x_last, F &f) const
+    {
+        if (first == last || hi <= x_first || x_last <= lo)
+            return;
+
+        if (x_first <= lo && hi <= x_last)
+        {
+            f(level, lo, hi, first, last);
+            return;
+        }
+
+        // partly covered, so not a leaf
+        const rank_bitvector_t &bits = bits_[level];
+        const size_t mid = lo + (hi - lo) / 2;
+        const size_t ones_lo = bits.rank1(lo);
+        const size_t r_first = bits.rank1(first) - ones_lo;
+        const size_t r_last  = bits.rank1(last ) - ones_lo;
+
+        visit_node(level + 1, lo , mid, lo + (first - lo - r_first), lo + (last - lo - r_last), x_first, x_last, f);
+        visit_node(level + 1, mid, hi , mid + r_first, mid + r_last, x_first, x_last, f);
+    }
+
+    // calls f(point index) for the positions [first, last) of node [lo, hi), down to a sampled level, or to a leaf,
+    // where the position is the x rank
+    template<typename F>
+    void report(size_t level, size_t lo, size_t hi, size_t first, size_t last, F &f) const
+    {
+        if (first == last)
+            return;
+
+        if (level + 1 == levels_ || hi - lo == 1)
+        {
+            for (size_t i = first; i < last; ++i)
+                f(size_t(by_x_[i]));
+            return;
+        }
+
+        if (is_sampled(level))
+        {
+            const packed_array_t &sampled = sampled_points_[level];
+            for (size_t i = first; i < last; ++i)
+                f(size_t(sampled[i]));
+            return;
+        }
+
+        const rank_bitvector_t &bits = bits_[level];
+        const size_t mid = lo + (hi - lo) / 2;
+        const size_t ones_lo = bits.rank1(lo);
+        const size_t r_first = bits.rank1(first) - ones_lo;
+        const size_t r_last  = bits.rank1(last ) - ones_lo;
+
+        report(level + 1, lo , mid, lo + (first - lo - r_first), lo + (last - lo - r_last), f);
+        report(level + 1, mid, hi , mid + r_first, mid + r_last, f);
+    }
+
+private:
+    // checks
+
+    bool ok() const
+    {
+        MY_ASSERT(xs_.size() == size_ && ys_.size() == size_ && by_x_.size() == size_);
+        MY_ASSERT(size_ == 0 || bits_.size() == levels_ - 1);
+        for (size_t level = 0; level < sampled_points_.size(); ++level)
+            MY_ASSERT(sampled_points_[level].size() == (is_sampled(level) && level + 1 < levels_ ? size_ : 0));
+        for (size_t i = 1; i < size_; ++i)
+            MY_ASSERT(xs_[i - 1] <= xs_[i] && ys_[i - 1] <= ys_[i]);
+        return true;
+    }
+
+private:
+    size_t size_;
+    size_t levels_;
+    size_t sample_rate_;
+
+    // x of the points in x order and y in y order, less the smallest one
+    coord_t x_min_, y_min_;
+    packed_array_t xs_, ys_;
+    // point index by x rank
+    packed_array_t by_x_;
+    // of all the levels but the last, whether the point at the position goes to the right child
+    vector<rank_bitvector_t> bits_;
+    // the point indices of the sampled levels but the last one, empty for the others
+    vector<packed_array_t> sampled_points_;
+};
@@ -0,0 +1,319 @@
+#pragma once
+
+#include "flat_range_tree.h"
+
+// Range queries over points that come and go, by logarithmic rebuilding (Bentley-Saxe) of static trees.
+// The points are kept in flat_range_tree_t's of b * 2^k points, at most one of each size, like the bits of a
+// binary counter: the newest points wait in a buffer of b that is scanned, and a full buffer is merged with the
+// trees of the carry into one new tree. So every point is rebuilt into a tree twice the size at most log n times,
+// O(log^2 n) amortized per insert, and a query asks O(log n / b) trees, none of them tiny.
+// A removed point gets a tombstone and stays in its tree; the removed points also go to a forest of their own,
+// so a count is the count of all the points less the count of the removed ones, and reporting skips the
+// tombstones. Once half the points are dead, everything is rebuilt from the live ones.
+// An id insert returns indexes point() until remove; the rebuild frees the ids of the dead points and insert
+// hands them out again, lowest first, so the memory is O(the most points alive at once), not O(all inserts).
+struct dynamic_range_tree_t
+{
+    typedef vector<point_t> points_t;
+
+    dynamic_range_tree_t()
+        : dead_(0)
+    {}
+
+    // ids 0 .. n - 1, built at once
+    explicit dynamic_range_tree_t(const points_t &points)
+        : points_(points)
+        , alive_(points.size(), true)
+        , dead_(0)
+    {
+        MY_ASSERT(points_.size() < (uint64_t(1) << 32));
+
+        vector<uint32_t> ids(points_.size());
+        for (size_t i = 0; i < ids.size(); ++i)
+            ids[i] = uint32_t(i);
+        all_.assign(ids, points_);
+
+        MY_ASSERT(ok());
+    }
+
+    size_t insert(const point_t &p)
+    {
+        uint32_t id;
+        if (!free_ids_.empty())
+        {
+            id = free_ids_.back();
+            free_ids_.pop_back();
+            points_[id] = p;
+            alive_[id] = true;
+        }
+        else
+        {
+            MY_ASSERT(points_.size() + 1 < (uint64_t(1) << 32));
+
+            id = uint32_t(points_.size());
+            points_.push_back(p);
+            alive_.push_back(true);
+        }
+
+        all_.insert(id, points_);
+        return id;
+    }
+
+    // the id may come back from a later insert, for another point
+    void remove(size_t id)
+    {
+        MY_ASSERT(contains(id));
+
+        alive_[id] = false;
+        ++dead_;
+        removed_.insert(uint32_t(id), points_);
+
+        if (2 * dead_ > all_.size())
+            purge();
+    }
+
+    bool contains(size_t id) const
+    {
+        return id < alive_.size() && alive_[id];
+    }
+
+    const point_t &point(size_t id) const
+    {
+        return points_.at(id);
+    }
+
+    // live points
+    size_t size() const
+    {
+        return all_.size() - dead_;
+    }
+
+    vector<size_t> query(const range_t &x_range, const range_t &y_range) const
+    {
+        vector<size_t> result;
+        query(x_range, y_range, [&result](size_t id) { result.push_back(id); });
+        return result;
+    }
+
+    // calls f(id) for every live point in the range
+    template<typename F>
+    void query(const range_t &x_range, const range_t &y_range, F f) const
+    {
+        const vector<bool> &alive = alive_;
+        all_.query(x_range, y_range, [&alive, &f](size_t id)
+        {
+            if (alive[id])
+                f(id);
+        });
+    }
+
+    size_t count(const range_t &x_range, const range_t &y_range) const
+    {
+        return all_.count(x_range, y_range) - removed_.count(x_range, y_range);
+    }
+
+private:
+    // point ids in the buffer and in static trees, parts_[k] is empty or has buffer_size * 2^k of them
+    struct forest_t
+    {
+        static const size_t buffer_size = 256;
+
+        forest_t()
+            : size_(0)
+        {}
+
+        void insert(uint32_t id, const points_t &points)
+        {
+            ++size_;
+            buffer_.push_back(id);
+            buffer_points_.push_back(points[id]);
+            if (buffer_.size() < buffer_size)
+                return;
+
+            // the carry: the buffer and every full part below the first empty one
+            vector<uint32_t> ids;
+            ids.swap(buffer_);
+            buffer_points_.clear();
+
+            size_t k = 0;
+            for (; k < parts_.size() && parts_[k].tree; ++k)
+            {
+                boost::copy(parts_[k].ids, std::back_inserter(ids));
+                parts_[k] = part_t();
+            }
+
+            if (k == parts_.size())
+                parts_.resize(k + 1);
+
+            build_part(k, ids, points);
+        }
+
+        // replaces everything, a part for every bit of the number of full buffers
+        void assign(const vector<uint32_t> &ids, const points_t &points)
+        {
+            clear();
+
+            const size_t buffers = ids.size() / buffer_size;
+            size_t first = 0;
+            for (size_t k = 0; (size_t(1) << k) <= buffers; ++k)
+            {
+                parts_.push_back(part_t());
+                if (!(buffers & (size_t(1) << k)))
+                    continue;
+
+                const size_t last = first + (buffer_size << k);
+                build_part(k, vector<uint32_t>(ids.begin() + first, ids.begin() + last), points);
+                first = last;
+            }
+
+            for (; first < ids.size(); ++first)
+            {
+                buffer_.push_back(ids[first]);
+                buffer_points_.push_back(points[ids[first]]);
+            }
+
+            size_ = ids.size();
+        }
+
+        void clear()
+        {
+            buffer_.clear();
+            buffer_points_.clear();
+            parts_.clear();
+            size_ = 0;
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+        // calls f(id) for every point in the range
+        template<typename F>
+        void query(const range_t &x_range, const range_t &y_range, F f) const
+        {
+            for (size_t i = 0; i < buffer_.size(); ++i)
+            {
+                if (in_range(buffer_points_[i], x_range, y_range))
+                    f(size_t(buffer_[i]));
+            }
+
+            BOOST_FOREACH(const part_t &part, parts_)
+            {
+                if (!part.tree)
+                    continue;
+
+                const vector<uint32_t> &ids = part.ids;
+                part.tree->query(x_range, y_range, [&ids, &f](size_t i) { f(size_t(ids[i])); });
+            }
+        }
+
+        size_t count(const range_t &x_range, const range_t &y_range) const
+        {
+            size_t result = 0;
+            BOOST_FOREACH(const point_t &p, buffer_points_)
+                result += in_range(p, x_range, y_range);
+
+            BOOST_FOREACH(const part_t &part, parts_)
+            {
+                if (part.tree)
+                    result += part.tree->count(x_range, y_range);
+            }
+            return result;
+        }
+
+    private:
+        struct part_t
+        {
+            vector<uint32_t> ids;
+            shared_ptr<flat_range_tree_t> tree;
+        };
+
+        static bool in_range(const point_t &p, const range_t &x_range, const range_t &y_range)
+        {
+            return p.x >= x_range.inf && p.x < x_range.sup && p.y >= y_range.inf && p.y < y_range.sup;
+        }
+
+        void build_part(size_t k, const vector<uint32_t> &ids, const points_t &points)
+        {
+            MY_ASSERT(ids.size() == (buffer_size << k));
+
+            points_t part_points(ids.size());
+            for (size_t i = 0; i < ids.size(); ++i)
+                part_points[i] = points[ids[i]];
+
+            parts_[k].ids = ids;
+            parts_[k].tree = boost::make_shared<flat_range_tree_t>(part_points);
+        }
+
+    private:
+        // the newest ids, with their points to scan
+        vector<uint32_t> buffer_;
+        points_t buffer_points_;
+        vector<part_t> parts_;
+        size_t size_;
+    };
+
+    // drops the dead points from the trees, their ids are free from then on. The ones past the last live id
+    // are cut off, the rest go to free_ids_, highest first, so insert fills the gaps from the bottom up
+    void purge()
+    {
+        size_t used = alive_.size();
+        while (used != 0 && !alive_[used - 1])
+            --used;
+
+        points_.resize(used);
+        alive_.resize(used);
+        if (points_.capacity() > 2 * used)
+        {
+            points_t(points_).swap(points_);
+            vector<bool>(alive_).swap(alive_);
+        }
+
+        vector<uint32_t> ids;
+        ids.reserve(size());
+        vector<uint32_t> free_ids;
+        free_ids.reserve(used - size());
+        for (size_t id = 0; id < used; ++id)
+        {
+            if (alive_[id])
+                ids.push_back(uint32_t(id));
+            else
+                free_ids.push_back(uint32_t(id));
+        }
+        boost::reverse(free_ids);
+        free_ids_.swap(free_ids);
+
+        all_.assign(ids, points_);
+        removed_.clear();
+        dead_ = 0;
+
+        MY_ASSERT(ok());
+    }
+
+private:
+    // checks
+
+    bool ok() const
+    {
+        MY_ASSERT(alive_.size() == points_.size());
+        // an id is either in the trees or free
+        MY_ASSERT(all_.size() + free_ids_.size() == points_.size());
+        MY_ASSERT(removed_.size() == dead_);
+        MY_ASSERT(all_.size() >= dead_);
+        return true;
+    }
+
+private:
+    // by id, the free ids' entries are left over from their last points
+    points_t points_;
+    vector<bool> alive_;
+    size_t dead_;
+    // purged ids for insert to reuse, highest first
+    vector<uint32_t> free_ids_;
+
+    // the points not purged yet, dead or alive
+    forest_t all_;
+    // the dead ones among them
+    forest_t removed_;
+};
@@ -0,0 +1,485 @@
+#pragma once
+
+#include "primitives.h"
+#include "parallel.h"
+
+// Same queries as range_tree_t over a pointer-free layout.
+// The tree is implicit: a node is a block [lo, hi) of the x-ordered points, its children are [lo, mid) and
+// [mid, hi) with mid = lo + (hi - lo) / 2 (the split of range_tree_t), so the nodes of a level, in level order,
+// tile [0, n). Every level has one array of n entries where the block of each node holds its points in y order,
+// and node [lo, hi) of any level sits at [lo, hi) of the level's array: no node objects, no pointers. An entry is
+// the x rank of its point, so the child it goes to is just rank < mid, and a table maps ranks to point indices.
+// The cascade pointer of an entry is a 32-bit offset, how many of the entries before it in its node go to the
+// left child; the right child's offset follows from it. With the x and y coordinates copied into sorted arrays,
+// a query is two binary searches over coordinates and O(log n) cascade steps, 8 bytes per point per level
+// in all.
+// The build writes every level straight from the one above, nothing is copied per node, and the subtrees are
+// built in parallel (see parallel.h).
+// All of it is one array of 32-bit words with no pointers in it, the image: a tree can be saved by writing the
+// image out and used straight from a mapped file (see index_file.h).
+struct flat_range_tree_t
+{
+    typedef vector<point_t> points_t;
+    // x and y ranges of a batch query
+    typedef pair<range_t, range_t> rect_t;
+
+    flat_range_tree_t(const points_t &points)
+        : size_(points.size())
+        , levels_(count_levels(points.size()))
+        , external_(0)
+    {
+        MY_ASSERT(size_ < (uint64_t(1) << 32));
+        build(points);
+        MY_ASSERT(ok());
+    }
+
+    // over the image() of a tree, used in place, so it has to outlive the tree
+    flat_range_tree_t(const uint32_t *image, size_t words)
+        : size_(words >= header_words ? image[0] : 0)
+        , levels_(count_levels(size_))
+        , external_(image)
+    {
+        if (words < header_words || image[1] != levels_ || words != image_words(size_, levels_))
+            throw std::runtime_error("flat_range_tree_t: not an image of a tree");
+    }
+
+    vector<size_t> query(const range_t &x_range, const range_t &y_range) const
+    {
+        vector<size_t> result;
+        query(x_range, y_range, [&result](size_t i) { result.push_back(i); });
+        return result;
+    }
+
+    // calls f(point index) for every point in the range
+    template<typename F>
+    void query(const range_t &x_range, const range_t &y_range, F f) const
+    {
+        const uint32_t *by_x = this->by_x();
+        visit_subsets(x_range, y_range, [this, by_x, &f](size_t level, size_t first, size_t last)
+        {
+            const uint32_t *ranks = level_ranks(level);
+            for (size_t i = first; i < last; ++i)
+                f(size_t(by_x[ranks[i]]));
+        });
+    }
+
+    size_t count(const range_t &x_range, const range_t &y_range) const
+    {
+        size_t result = 0;
+        visit_subsets(x_range, y_range, [&result](size_t, size_t first, size_t last)
+        {
+            result += last - first;
+        });
+        return result;
+    }
+
+    // the points of every rect, in the order of the rects. Faster than one query after another, see visit_batch
+    vector<vector<size_t>> query_batch(const vector<rect_t> &rects) const
+    {
+        vector<vector<size_t>> result(rects.size());
+        const uint32_t *by_x = this->by_x();
+        visit_batch(rects, [this, by_x, &result](size_t q, size_t level, size_t first, size_t last)
+        {
+            const uint32_t *ranks = level_ranks(level);
+            vector<size_t> &indices = result[q];
+            for (size_t i = first; i < last; ++i)
+                indices.push_back(by_x[ranks[i]]);
+        });
+        return result;
+    }
+
+    vector<size_t> count_batch(const vector<rect_t> &rects) const
+    {
+        vector<size_t> result(rects.size(), 0);
+        visit_batch(rects, [&result](size_t q, size_t, size_t first, size_t last)
+        {
+            result[q] += last - first;
+        });
+        return result;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    // the whole tree, position independent
+    const uint32_t *image() const
+    {
+        return external_ ? external_ : &storage_[0];
+    }
+
+    size_t image_words() const
+    {
+        return image_words(size_, levels_);
+    }
+
+    size_t memory_size() const
+    {
+        return image_words() * sizeof(uint32_t);
+    }
+
+private:
+    // a query in positions: the x ranks [x_first, x_last), and [first, last) of the root in the y range
+    struct search_t
+    {
+        uint32_t x_first, x_last;
+        uint32_t first, last;
+
+        bool empty() const
+        {
+            return x_first >= x_last || first >= last;
+        }
+    };
+
+    // a query on its way down the tree in a batch, [first, last) of the node it is in
+    struct batch_entry_t
+    {
+        uint32_t query;
+        uint32_t first, last;
+    };
+
+    // queries walked down the tree together
+    static const size_t batch_size = 256;
+
+    static size_t count_levels(size_t n)
+    {
+        size_t levels = 1;
+        for (size_t size = n; size > 1; size = (size + 1) / 2)
+            ++levels;
+        return levels;
+    }
+
+    // the image: n and the number of levels, then x of the points in x order, y in y order, the point index
+    // by x rank, levels_ arrays of n x ranks, the cascade offsets of all the levels but the last
+    static const size_t header_words = 2;
+
+    static size_t image_words(size_t n, size_t levels)
+    {
+        return header_words + (2 * levels + 2) * n;
+    }
+
+    const coord_t *xs() const
+    {
+        return reinterpret_cast<const coord_t *>(image() + header_words);
+    }
+
+    const coord_t *ys() const
+    {
+        return xs() + size_;
+    }
+
+    const uint32_t *by_x() const
+    {
+        return image() + header_words + 2 * size_;
+    }
+
+    const uint32_t *level_ranks(size_t level) const
+    {
+        return image() + header_words + (3 + level) * size_;
+    }
+
+    const uint32_t *level_cascade(size_t level) const
+    {
+        return image() + header_words + (3 + levels_ + level) * size_;
+    }
+
+    // the same, to build
+    uint32_t *mutable_image(size_t offset)
+    {
+        return &storage_[header_words + offset * size_];
+    }
+
+    // entries of node [lo, hi) before pos that go to the left child, pos in [lo, hi]
+    size_t left_before(size_t level, size_t lo, size_t mid, size_t hi, size_t pos) const
+    {
+        return pos == hi ? mid - lo : size_t(level_cascade(level)[pos]);
+    }
+
+    // (coordinate, index) as one integer, ordered by the coordinate: the sorts compare keys in registers instead
+    // of going to the points
+    static uint64_t sort_key(coord_t c, uint32_t i)
+    {
+        return (uint64_t(uint32_t(c) ^ 0x80000000u) << 32) | i;
+    }
+
+    static coord_t key_coord(uint64_t key)
+    {
+        return coord_t(uint32_t(key >> 32) ^ 0x80000000u);
+    }
+
+    void build(const points_t &points)
+    {
+        storage_.resize(image_words(size_, levels_));
+        storage_[0] = uint32_t(size_);
+        storage_[1] = uint32_t(levels_);
+
+        if (size_ == 0)
+            return;
+
+        const size_t depth = parallel_depth();
+        coord_t *xs = reinterpret_cast<coord_t *>(mutable_image(0));
+        coord_t *ys = reinterpret_cast<coord_t *>(mutable_image(1));
+        uint32_t *by_x = mutable_image(2);
+        uint32_t *root = mutable_image(3);
+
+        vector<uint64_t> keys(size_);
+        for (size_t i = 0; i < size_; ++i)
+            keys[i] = sort_key(points[i].x, uint32_t(i));
+        parallel_sort(keys.begin(), keys.end(), std::less<uint64_t>(), depth);
+
+        for (size_t i = 0; i < size_; ++i)
+        {
+            by_x[i] = uint32_t(keys[i]);
+            xs[i] = key_coord(keys[i]);
+        }
+
+        // the root is the ranks in y order
+        for (size_t i = 0; i < size_; ++i)
+            keys[i] = sort_key(points[by_x[i]].y, uint32_t(i));
+        parallel_sort(keys.begin(), keys.end(), std::less<uint64_t>(), depth);
+
+        for (size_t i = 0; i < size_; ++i)
+        {
+            root[i] = uint32_t(keys[i]);
+            ys[i] = key_coord(keys[i]);
+        }
+        vector<uint64_t>().swap(keys);
+
+        build_node(0, 0, size_, depth);
+    }
+
+    // splits node [lo, hi) of the level into its children on the next level, keeping the y order, and goes on
+    // down; the children are built in parallel while depth lasts
+    void build_node(size_t level, size_t lo, size_t hi, size_t depth)
+    {
+        // nodes below this size aren't worth a thread
+        const size_t min_fork_size = 1 << 16;
+
+        for (; level + 1 < levels_ && hi - lo <= 1; ++level)
+        {
+            // a leaf stays where it is on the levels below
+            for (size_t i = lo; i < hi; ++i)
+            {
+                mutable_image(3 + level + 1)[i] = mutable_image(3 + level)[i];
+                mutable_image(3 + levels_ + level)[i] = 0;
+            }
+        }
+
+        if (level + 1 == levels_)
+            return;
+
+        const uint32_t *src = mutable_image(3 + level);
+        uint32_t *dst = mutable_image(3 + level + 1);
+        uint32_t *cascade = mutable_image(3 + levels_ + level);
+
+        const size_t mid = lo + (hi - lo) / 2;
+        size_t l = lo, r = mid;
+        for (size_t i = lo; i < hi; ++i)
+        {
+            const uint32_t rank = src[i];
+            cascade[i] = uint32_t(l - lo);
+            if (rank < mid)
+                dst[l++] = rank;
+            else
+                dst[r++] = rank;
+        }
+        MY_ASSERT(l == mid && r == hi);
+
+        const bool fork = depth > 0 && hi - lo >= min_fork_size;
+        const size_t child_depth = fork ? depth - 1 : 0;
+        fork_join(fork, [=]() { build_node(level + 1, lo , mid, child_depth); },
+                        [=]() { build_node(level + 1, mid, hi , child_depth); });
+    }
+
+    // the four lower bounds in lockstep and without branches: xs and ys have the same length, so the four
+    // searches take the same steps, their loads don't wait for each other and the compares become cmovs
+    search_t search(const range_t &x_range, const range_t &y_range) const
+    {
+        const coord_t *xs = this->xs();
+        const coord_t *ys = this->ys();
+        size_t x_first = 0, x_last = 0, first = 0, last = 0;
+        for (size_t n = size_; n > 1; n -= n / 2)
+        {
+            const size_t half = n / 2;
+            x_first += xs[x_first + half] < x_range.inf ? half : 0;
+            x_last  += xs[x_last  + half] < x_range.sup ? half : 0;
+            first   += ys[first   + half] < y_range.inf ? half : 0;
+            last    += ys[last    + half] < y_range.sup ? half : 0;
+        }
+
+        search_t s;
+        s.x_first = uint32_t(x_first + (xs[x_first] < x_range.inf));
+        s.x_last  = uint32_t(x_last  + (xs[x_last ] < x_range.sup));
+        s.first   = uint32_t(first   + (ys[first  ] < y_range.inf));
+        s.last    = uint32_t(last    + (ys[last   ] < y_range.sup));
+        return s;
+    }
+
+    // calls f(level, first, last) for every canonical node, [first, last) are the positions of its points
+    // in the level's array
+    template<typename F>
+    void visit_subsets(const range_t &x_range, const range_t &y_range, F f) const
+    {
+        if (size_ == 0)
+            return;
+
+        const search_t s = search(x_range, y_range);
+        if (s.empty())
+            return;
+
+        visit_node(0, 0, size_, s.first, s.last, s.x_first, s.x_last, f);
+    }
+
+    // node [lo, hi) of the level, [first, last) of it are in the y range
+    template<typename F>
+    void visit_node(size_t level, size_t lo, size_t hi, size_t first, size_t last,
+                    size_t x_first, size_t x_last, F &f) const
+    {
+        if (first == last || hi <= x_first || x_last <= lo)
+            return;
+
+        if (x_first <= lo && hi <= x_last)
+        {
+            f(level, first, last);
+            return;
+        }
+
+        // partly covered, so not a leaf
+        const size_t mid = lo + (hi - lo) / 2;
+        const size_t l_first = left_before(level, lo, mid, hi, first);
+        const size_t l_last  = left_before(level, lo, mid, hi, last);
+
+        visit_node(level + 1, lo , mid, lo + l_first, lo + l_last, x_first, x_last, f);
+        visit_node(level + 1, mid, hi , mid + (first - lo - l_first), mid + (last - lo - l_last), x_first, x_last, f);
+    }
+
+    // calls f(query, level, first, last) for every canonical node of every rect.
+    // The rects are searched, sorted by their x ranks and cut into batches of neighbours; a batch goes down the
+    // tree as one, each node is visited once for all the queries of the batch that reach it, and the queries
+    // next to each other in x touch the same parts of the levels. The batches are spread over threads, so f is
+    // called from several threads, but never for the same query at once.
+    template<typename F>
+    void visit_batch(const vector<rect_t> &rects, F f) const
+    {
+        if (size_ == 0 || rects.empty())
+            return;
+
+        const size_t depth = parallel_depth();
+        const size_t min_piece = 16 * batch_size;
+
+        vector<search_t> searches(rects.size());
+        parallel_for(0, rects.size(), min_piece, [this, &rects, &searches](size_t begin, size_t end)
+        {
+            for (size_t q = begin; q < end; ++q)
+                searches[q] = search(rects[q].first, rects[q].second);
+        }, depth);
+
+        vector<uint32_t> order;
+        order.reserve(rects.size());
+        for (size_t q = 0; q < rects.size(); ++q)
+        {
+            if (!searches[q].empty())
+                order.push_back(uint32_t(q));
+        }
+
+        parallel_sort(order.begin(), order.end(), [&searches](uint32_t q1, uint32_t q2)
+        {
+            const search_t &s1 = searches[q1];
+            const search_t &s2 = searches[q2];
+            if (s1.x_first != s2.x_first)
+                return s1.x_first < s2.x_first;
+            if (s1.x_last != s2.x_last)
+                return s1.x_last < s2.x_last;
+            return s1.first < s2.first;
+        }, depth);
+
+        parallel_for(0, order.size(), min_piece, [this, &order, &searches, &f](size_t begin, size_t end)
+        {
+            // per level, the left and the right children's share of the batch, and the space of the leaves'
+            // children: a node takes the next level's space before it knows whether it splits
+            vector<batch_entry_t> scratch((levels_ + 1) * 2 * batch_size);
+            vector<batch_entry_t> batch;
+
+            for (size_t i = begin; i < end; i += batch_size)
+            {
+                batch.clear();
+                for (size_t j = i; j < std::min(end, i + batch_size); ++j)
+                {
+                    const batch_entry_t e = { order[j], searches[order[j]].first, searches[order[j]].last };
+                    batch.push_back(e);
+                }
+
+                visit_batch_node(0, 0, size_, &batch[0], &batch[0] + batch.size(), searches, scratch, f);
+            }
+        }, depth);
+    }
+
+    // the batch's queries in node [lo, hi) of the level
+    template<typename F>
+    void visit_batch_node(size_t level, size_t lo, size_t hi, const batch_entry_t *begin, const batch_entry_t *end,
+                          const vector<search_t> &searches, vector<batch_entry_t> &scratch, F &f) const
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+
+        // the queries that go on are split into the next level's space, to go down one child and then the other
+        batch_entry_t *left  = &scratch[(level + 1) * 2 * batch_size];
+        batch_entry_t *right = left + batch_size;
+        size_t lefts = 0, rights = 0;
+
+        for (const batch_entry_t *e = begin; e != end; ++e)
+        {
+            const search_t &s = searches[e->query];
+            if (hi <= s.x_first || s.x_last <= lo)
+                continue;
+
+            if (s.x_first <= lo && hi <= s.x_last)
+            {
+                f(size_t(e->query), level, size_t(e->first), size_t(e->last));
+                continue;
+            }
+
+            // partly covered, so not a leaf
+            const size_t l_first = left_before(level, lo, mid, hi, e->first);
+            const size_t l_last  = left_before(level, lo, mid, hi, e->last);
+
+            if (l_first < l_last)
+            {
+                const batch_entry_t l = { e->query, uint32_t(lo + l_first), uint32_t(lo + l_last) };
+                left[lefts++] = l;
+            }
+
+            const size_t r_first = e->first - lo - l_first;
+            const size_t r_last  = e->last  - lo - l_last;
+            if (r_first < r_last)
+            {
+                const batch_entry_t r = { e->query, uint32_t(mid + r_first), uint32_t(mid + r_last) };
+                right[rights++] = r;
+            }
+        }
+
+        if (lefts != 0)
+            visit_batch_node(level + 1, lo, mid, left, left + lefts, searches, scratch, f);
+        if (rights != 0)
+            visit_batch_node(level + 1, mid, hi, right, right + rights, searches, scratch, f);
+    }
+
+private:
+    // checks
+
+    bool ok() const
+    {
+        MY_ASSERT(std::is_sorted(xs(), xs() + size_));
+        MY_ASSERT(std::is_sorted(ys(), ys() + size_));
+        MY_ASSERT(storage_.size() == image_words());
+        return true;
+    }
+
+private:
+    size_t size_;
+    size_t levels_;
+
+    // the image, built here or someone else's
+    vector<uint32_t> storage_;
+    const uint32_t *external_;
+};
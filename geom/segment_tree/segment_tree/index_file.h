@@ -0,0 +1,424 @@
+#pragma once
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <fstream>
+
+// A file of tagged sections, laid out to be used in place: the file is mapped read-only and the sections are
+// handed out as pointers into the mapping, nothing is read or converted. Version 1, in the native byte order
+// (checked on load):
+//   header_t                    magic, version, byte order mark, number of sections, file size, checksum
+//   section_t x sections        tag, offset from the start of the file, size in bytes
+//   the sections' data          every section at a multiple of alignment
+// Offsets are from the start of the file, so the file can be mapped anywhere. The checksum is over everything
+// after the header; checking it reads the whole file, so it can be skipped for a fast start.
+
+struct index_file_error
+    : std::runtime_error
+{
+    index_file_error(const string &msg)
+        : std::runtime_error(msg)
+    { }
+};
+
+namespace index_file
+{
+    const uint32_t version = 1;
+    const size_t alignment = 64;
+
+    struct header_t
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t sections;
+        uint32_t reserved;
+        uint64_t file_size;
+        uint64_t checksum;
+    };
+
+    struct section_t
+    {
+        uint32_t tag;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    inline const char *magic()
+    {
+        return "GEOMIDX";
+    }
+
+    const uint32_t byte_order_mark = 0x01020304;
+
+    // a tag from its four letters, tag("rang")
+    inline uint32_t tag(const char *name)
+    {
+        return uint32_t(uint8_t(name[0])) | uint32_t(uint8_t(name[1])) << 8 | uint32_t(uint8_t(name[2])) << 16
+             | uint32_t(uint8_t(name[3])) << 24;
+    }
+
+    // 64 bits at a time, so checking a file doesn't take much longer than reading it. The data may come in
+    // pieces of any size, the checksum is the same as of all of it at once
+    struct checksum_t
+    {
+        checksum_t()
+            : h_(0xcbf29ce484222325ull)
+            , word_(0)
+            , word_size_(0)
+        {}
+
+        void add(const char *data, size_t size)
+        {
+            for (; size != 0 && word_size_ != 0; ++data, --size)
+                add_byte(*data);
+
+            for (; size >= 8; data += 8, size -= 8)
+            {
+                uint64_t word;
+                memcpy(&word, data, 8);
+                add_word(word);
+            }
+
+            for (; size != 0; ++data, --size)
+                add_byte(*data);
+        }
+
+        uint64_t value() const
+        {
+            return (h_ ^ word_ ^ word_size_) * prime;
+        }
+
+    private:
+        static const uint64_t prime = 0x100000001b3ull;
+
+        void add_word(uint64_t word)
+        {
+            h_ = (h_ ^ word) * prime;
+            h_ ^= h_ >> 29;
+        }
+
+        void add_byte(char c)
+        {
+            word_ |= uint64_t(uint8_t(c)) << (8 * word_size_);
+            if (++word_size_ == 8)
+            {
+                add_word(word_);
+                word_ = 0;
+                word_size_ = 0;
+            }
+        }
+
+    private:
+        uint64_t h_;
+        uint64_t word_;
+        size_t word_size_;
+    };
+
+    inline size_t align(size_t offset)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+}
+
+// sections are added as pointers, the data has to stay until write
+struct index_file_writer_t
+{
+    void add(uint32_t tag, const void *data, size_t size)
+    {
+        BOOST_FOREACH(const section_data_t &s, sections_)
+            MY_ASSERT(s.tag != tag);
+
+        const section_data_t s = { tag, static_cast<const char *>(data), size };
+        sections_.push_back(s);
+    }
+
+    // to a temporary file renamed over path at the end, so a reader never sees half a file
+    void write(const string &path) const
+    {
+        using namespace index_file;
+
+        vector<section_t> table(sections_.size());
+        size_t offset = align(sizeof(header_t) + table.size() * sizeof(section_t));
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            table[i].tag = sections_[i].tag;
+            table[i].reserved = 0;
+            table[i].offset = offset;
+            table[i].size = sections_[i].size;
+            offset = align(offset + sections_[i].size);
+        }
+
+        // the checksum goes over what comes after the header, zero padding included
+        const vector<char> padding(alignment, 0);
+        checksum_t checksum;
+        checksum.add(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(section_t));
+        size_t pos = sizeof(header_t) + table.size() * sizeof(section_t);
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            checksum.add(&padding[0], size_t(table[i].offset) - pos);
+            checksum.add(sections_[i].data, sections_[i].size);
+            pos = size_t(table[i].offset + table[i].size);
+        }
+        checksum.add(&padding[0], offset - pos);
+
+        header_t header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic(), sizeof(header.magic));
+        header.version = version;
+        header.byte_order = byte_order_mark;
+        header.sections = uint32_t(table.size());
+        header.file_size = offset;
+        header.checksum = checksum.value();
+
+        const string tmp_path = path + ".tmp";
+        {
+            std::ofstream out(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+            if (!out)
+                throw index_file_error("can't create " + tmp_path);
+
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            if (!table.empty())
+                out.write(reinterpret_cast<const char *>(&table[0]), table.size() * sizeof(section_t));
+
+            pos = sizeof(header_t) + table.size() * sizeof(section_t);
+            for (size_t i = 0; i < table.size(); ++i)
+            {
+                out.write(&padding[0], size_t(table[i].offset) - pos);
+                out.write(sections_[i].data, sections_[i].size);
+                pos = size_t(table[i].offset + table[i].size);
+            }
+            out.write(&padding[0], offset - pos);
+
+            out.flush();
+            if (!out)
+                throw index_file_error("can't write " + tmp_path);
+        }
+
+#ifdef _WIN32
+        if (!MoveFileExA(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+        if (rename(tmp_path.c_str(), path.c_str()) != 0)
+#endif
+            throw index_file_error("can't rename " + tmp_path + " to " + path);
+    }
+
+private:
+    struct section_data_t
+    {
+        uint32_t tag;
+        const char *data;
+        size_t size;
+    };
+
+    vector<section_data_t> sections_;
+};
+
+// a mapped index file, its sections stay valid as long as it lives
+struct index_file_t
+    : boost::noncopyable
+{
+    explicit index_file_t(const string &path, bool verify_checksum = true)
+        : data_(0)
+        , size_(0)
+#ifdef _WIN32
+        , file_(INVALID_HANDLE_VALUE)
+        , mapping_(0)
+#endif
+    {
+        try
+        {
+            map(path);
+            check(path, verify_checksum);
+        }
+        catch (...)
+        {
+            unmap();
+            throw;
+        }
+    }
+
+    ~index_file_t()
+    {
+        unmap();
+    }
+
+    bool has_section(uint32_t tag) const
+    {
+        return find(tag) != 0;
+    }
+
+    // the section's data, aligned to index_file::alignment
+    const char *section(uint32_t tag, size_t &size) const
+    {
+        const index_file::section_t *s = find(tag);
+        if (!s)
+            throw index_file_error("no section " + tag_name(tag));
+
+        size = size_t(s->size);
+        return data_ + s->offset;
+    }
+
+    // a section of T's
+    template<typename T>
+    const T *section_array(uint32_t tag, size_t &count) const
+    {
+        size_t size;
+        const char *data = section(tag, size);
+        if (size % sizeof(T) != 0)
+            throw index_file_error("section " + tag_name(tag) + " is not an array");
+
+        count = size / sizeof(T);
+        return reinterpret_cast<const T *>(data);
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    static string tag_name(uint32_t tag)
+    {
+        string name(4, ' ');
+        for (size_t i = 0; i < 4; ++i)
+            name[i] = char(tag >> (8 * i));
+        return "'" + name + "'";
+    }
+
+    const index_file::header_t &header() const
+    {
+        return *reinterpret_cast<const index_file::header_t *>(data_);
+    }
+
+    const index_file::section_t *table() const
+    {
+        return reinterpret_cast<const index_file::section_t *>(data_ + sizeof(index_file::header_t));
+    }
+
+    const index_file::section_t *find(uint32_t tag) const
+    {
+        for (size_t i = 0; i < header().sections; ++i)
+        {
+            if (table()[i].tag == tag)
+                return &table()[i];
+        }
+        return 0;
+    }
+
+    void check(const string &path, bool verify_checksum) const
+    {
+        using namespace index_file;
+
+        if (size_ < sizeof(header_t) || memcmp(header().magic, magic(), sizeof(header().magic)) != 0)
+            throw index_file_error(path + " is not an index file");
+        if (header().version != version)
+            throw index_file_error(path + " has an unsupported version");
+        if (header().byte_order != byte_order_mark)
+            throw index_file_error(path + " was written with another byte order");
+        if (header().file_size != size_)
+            throw index_file_error(path + " is truncated");
+
+        const uint64_t table_end = sizeof(header_t) + uint64_t(header().sections) * sizeof(section_t);
+        if (table_end > size_)
+            throw index_file_error(path + " is truncated");
+
+        for (size_t i = 0; i < header().sections; ++i)
+        {
+            const section_t &s = table()[i];
+            if (s.offset % alignment != 0 || s.offset < table_end || s.offset > size_ || s.size > size_ - s.offset)
+                throw index_file_error(path + ": section " + tag_name(s.tag) + " is out of the file");
+        }
+
+        if (verify_checksum)
+        {
+            checksum_t checksum;
+            checksum.add(data_ + sizeof(header_t), size_ - sizeof(header_t));
+            if (checksum.value() != header().checksum)
+                throw index_file_error(path + " is corrupted, the checksum doesn't match");
+        }
+    }
+
+#ifdef _WIN32
+    void map(const string &path)
+    {
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (file_ == INVALID_HANDLE_VALUE)
+            throw index_file_error("can't open " + path);
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size))
+            throw index_file_error("can't get the size of " + path);
+        size_ = size_t(size.QuadPart);
+        if (size_ == 0)
+            throw index_file_error(path + " is empty");
+
+        mapping_ = CreateFileMappingA(file_, 0, PAGE_READONLY, 0, 0, 0);
+        if (!mapping_)
+            throw index_file_error("can't map " + path);
+
+        data_ = static_cast<const char *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        if (!data_)
+            throw index_file_error("can't map " + path);
+    }
+
+    void unmap()
+    {
+        if (data_)
+            UnmapViewOfFile(data_);
+        if (mapping_)
+            CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+
+        data_ = 0;
+        mapping_ = 0;
+        file_ = INVALID_HANDLE_VALUE;
+    }
+#else
+    void map(const string &path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw index_file_error("can't open " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            throw index_file_error("can't map " + path + ", it is empty or unreadable");
+        }
+        size_ = size_t(st.st_size);
+
+        void *data = mmap(0, size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            throw index_file_error("can't map " + path);
+
+        data_ = static_cast<const char *>(data);
+    }
+
+    void unmap()
+    {
+        if (data_)
+            munmap(const_cast<char *>(data_), size_);
+        data_ = 0;
+    }
+#endif
+
+private:
+    const char *data_;
+    size_t size_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#endif
+};
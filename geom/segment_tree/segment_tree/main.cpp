@@ -1,9 +1,39 @@
 #include "stdafx.h"
 #include "primitives.h"
+#include "range_tree.h"
 #include "segment_windowing.h"
+#include "flat_range_tree.h"
+#include "dynamic_range_tree.h"
+#include "compact_range_tree.h"
 #include "visualization/viewer_adapter.h"
 #include "visualization/draw_util.h"
 
+// the flat trees against brute force, for point sets with few distinct coordinates (range_tree_t takes
+// distinct points only)
+void degenerate_range_test(const vector<point_t> &points)
+{
+    const flat_range_tree_t flat_range_tree(points);
+    const compact_range_tree_t compact_range_tree(points);
+
+    for (coord_t x = -3; x <= 3; ++x)
+    {
+        for (coord_t y = -3; y <= 3; ++y)
+        {
+            const range_t x_range(x, x + 2);
+            const range_t y_range(y, y + 3);
+
+            size_t expected = 0;
+            BOOST_FOREACH(const point_t &point, points)
+                expected += point.x >= x_range.inf && point.x < x_range.sup && point.y >= y_range.inf && point.y < y_range.sup;
+
+            MY_ASSERT(flat_range_tree.count(x_range, y_range) == expected);
+            MY_ASSERT(flat_range_tree.query(x_range, y_range).size() == expected);
+            MY_ASSERT(compact_range_tree.count(x_range, y_range) == expected);
+            MY_ASSERT(compact_range_tree.query(x_range, y_range).size() == expected);
+        }
+    }
+}
+
 void range_test()
 {
     vector<point_t> points;
@@ -38,6 +68,8 @@ void range_test()
 
 
     const range_tree_t range_tree(points);
+    const flat_range_tree_t flat_range_tree(points);
+    const compact_range_tree_t compact_range_tree(points);
 
 //    auto ind = range_tree.query(range_t(2, 8), range_t(4, 9));
 
@@ -50,6 +82,12 @@ void range_test()
         range_t y_range = ranges.at(i * 2 + 1);
 
         const auto indices = range_tree.query(x_range, y_range);
+        MY_ASSERT(range_tree.count(x_range, y_range) == indices.size());
+        MY_ASSERT(flat_range_tree.count(x_range, y_range) == indices.size());
+        MY_ASSERT(flat_range_tree.query(x_range, y_range).size() == indices.size());
+        MY_ASSERT(compact_range_tree.count(x_range, y_range) == indices.size());
+        MY_ASSERT(compact_range_tree.query(x_range, y_range).size() == indices.size());
+
         BOOST_FOREACH(const auto index, indices)
         {
             returned.at(index) = true;
@@ -64,6 +102,50 @@ void range_test()
                 MY_ASSERT(point.x < x_range.inf || point.x >= x_range.sup || point.y < y_range.inf || point.y >= y_range.sup);
         }
     }
+
+    vector<flat_range_tree_t::rect_t> rects;
+    for (size_t i = 0; i < ranges.size() / 2; ++i)
+        rects.push_back(flat_range_tree_t::rect_t(ranges.at(i * 2 + 0), ranges.at(i * 2 + 1)));
+
+    const auto counts = flat_range_tree.count_batch(rects);
+    const auto batch = flat_range_tree.query_batch(rects);
+    for (size_t i = 0; i < rects.size(); ++i)
+    {
+        MY_ASSERT(counts.at(i) == range_tree.count(rects.at(i).first, rects.at(i).second));
+        MY_ASSERT(batch.at(i).size() == counts.at(i));
+    }
+
+    // every other point removed, ids are the indices in points
+    dynamic_range_tree_t dynamic_tree;
+    BOOST_FOREACH(const point_t &point, points)
+        dynamic_tree.insert(point);
+    for (size_t i = 0; i < points.size(); i += 2)
+        dynamic_tree.remove(i);
+
+    BOOST_FOREACH(const auto &rect, rects)
+    {
+        const auto indices = dynamic_tree.query(rect.first, rect.second);
+        MY_ASSERT(dynamic_tree.count(rect.first, rect.second) == indices.size());
+
+        size_t odd = 0;
+        BOOST_FOREACH(const size_t index, range_tree.query(rect.first, rect.second))
+            odd += index % 2;
+        MY_ASSERT(indices.size() == odd);
+    }
+
+    // one point, all x equal, all y equal, all the points equal
+    vector<point_t> same_x, same_y, same;
+    for (coord_t i = -2; i <= 2; ++i)
+    {
+        same_x.push_back(point_t(1, i));
+        same_y.push_back(point_t(i, -1));
+        same.push_back(point_t(0, 0));
+    }
+
+    degenerate_range_test(vector<point_t>(1, point_t(0, 0)));
+    degenerate_range_test(same_x);
+    degenerate_range_test(same_y);
+    degenerate_range_test(same);
 }
 
 void segment_test()
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <exception>
+
+// fork/join for the recursive builders: a forked call runs on a thread of its own, no pool needed for a handful
+// of them. depth is how many more times the recursion may fork, so up to 2^depth - 1 threads
+
+// enough to keep every core busy even if the halves are uneven
+inline size_t parallel_depth()
+{
+    size_t depth = 1;
+    for (size_t threads = boost::thread::hardware_concurrency(); threads > 1; threads = (threads + 1) / 2)
+        ++depth;
+    return depth > 1 ? depth : 0;
+}
+
+// f1() and f2(), f1 on another thread if fork; an exception of either is rethrown once both are done
+template<typename F1, typename F2>
+void fork_join(bool fork, F1 f1, F2 f2)
+{
+    if (!fork)
+    {
+        f1();
+        f2();
+        return;
+    }
+
+    std::exception_ptr error1, error2;
+    boost::thread thread([&f1, &error1]()
+    {
+        try
+        {
+            f1();
+        }
+        catch (...)
+        {
+            error1 = std::current_exception();
+        }
+    });
+
+    try
+    {
+        f2();
+    }
+    catch (...)
+    {
+        error2 = std::current_exception();
+    }
+    thread.join();
+
+    if (error1)
+        std::rethrow_exception(error1);
+    if (error2)
+        std::rethrow_exception(error2);
+}
+
+// merge sort of the halves sorted in parallel, std::sort below the fork depth or for small ranges
+template<typename It, typename Comp>
+void parallel_sort(It first, It last, Comp comp, size_t depth)
+{
+    const size_t min_size = 1 << 14;
+    if (depth == 0 || size_t(last - first) < min_size)
+    {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    const It mid = first + (last - first) / 2;
+    fork_join(true, [=]() { parallel_sort(first, mid, comp, depth - 1); },
+                    [=]() { parallel_sort(mid, last, comp, depth - 1); });
+    std::inplace_merge(first, mid, last, comp);
+}
+
+// f(begin, end) over pieces of [first, last), in parallel while depth lasts and the pieces are at least min_size
+template<typename F>
+void parallel_for(size_t first, size_t last, size_t min_size, F f, size_t depth)
+{
+    if (depth == 0 || last - first < 2 * min_size)
+    {
+        f(first, last);
+        return;
+    }
+
+    const size_t mid = first + (last - first) / 2;
+    fork_join(true, [=]() { parallel_for(first, mid, min_size, f, depth - 1); },
+                    [=]() { parallel_for(mid, last, min_size, f, depth - 1); });
+}
@@ -2,6 +2,7 @@
 
 #include "primitives.h"
 #include "tree.h"
+#include "parallel.h"
 
 struct range_tree_t
 {
@@ -17,32 +18,31 @@ struct range_tree_t
 
     vector<size_t> query(const range_t &x_range, const range_t &y_range) const
     {
-        if (!root_)
-            return vector<size_t>();
-        
-        node_t::ptr node = find_split_node(x_range);
-
-        const vector<cascade_index_t> &y_indices = node->value().y_ordered;
-
-        const size_t i1 = boost::lower_bound(y_indices, y_range.inf, comparator2_t(points_, false, true)) - y_indices.begin();
-        const size_t i2 = boost::lower_bound(y_indices, y_range.sup, comparator2_t(points_, false, true)) - y_indices.begin();
-
-        point_indices_t indices;
+        vector<size_t> result;
+        query(x_range, y_range, [&result](size_t i) { result.push_back(i); });
+        return result;
+    }
 
-        if (node->is_leaf())
-        {
-            extract_indices(node, make_pair(i1, i2), indices);
-        }
-        else
+    // calls f(point index) for every point in the range, nothing is collected on the way
+    template<typename F>
+    void query(const range_t &x_range, const range_t &y_range, F f) const
+    {
+        visit_subsets(x_range, y_range, [&f](const node_t::ptr &node, const pair<size_t, size_t> &limits)
         {
-            run_left (node, x_range, i1, i2, OUT_ARG(indices));
-            run_right(node, x_range, i1, i2, OUT_ARG(indices));
-        }
-
-        vector<size_t> result;
-        boost::transform(indices, std::back_inserter(result), 
-            [](const point_index_t &i) { return i.i; });
+            const vector<cascade_index_t> &y_indices = node->value().y_ordered;
+            for (size_t i = limits.first; i < limits.second; ++i)
+                f(y_indices[i].i.i);
+        });
+    }
 
+    // number of points in the range: the sizes of the canonical subsets add up, O(log n) and no allocations
+    size_t count(const range_t &x_range, const range_t &y_range) const
+    {
+        size_t result = 0;
+        visit_subsets(x_range, y_range, [&result](const node_t::ptr &, const pair<size_t, size_t> &limits)
+        {
+            result += limits.second - limits.first;
+        });
         return result;
     }
 
@@ -59,7 +59,6 @@ private:
         {}
         size_t i;
     };
-    typedef vector<point_index_t> point_indices_t;
     
     // structure used for cascading
     struct cascade_index_t
@@ -158,7 +157,7 @@ private:
     node_t::ptr build_tree() const 
     {
         subset_t s(subset_);
-        return build_tree(s);
+        return build_tree(std::move(s), parallel_depth());
     }
 
    
@@ -209,9 +208,12 @@ private:
         return result;
     }
     
-    node_t::ptr build_tree(const subset_t &old_s) const
+    // the subsets are moved down into the nodes, not copied; the subtrees are built in parallel while depth lasts
+    node_t::ptr build_tree(subset_t s, size_t depth) const
     {
-        subset_t s = old_s;
+        // subsets below this size aren't worth a thread
+        const size_t min_fork_size = 1 << 14;
+
         MY_ASSERT(s.x_ordered.size() == s.y_ordered.size());
 
         node_t::ptr l, r;
@@ -219,11 +221,13 @@ private:
         {
             auto split = split_subset(s);
             
-            l = build_tree(split.first );
-            r = build_tree(split.second);
+            const bool fork = depth > 0 && s.x_ordered.size() >= min_fork_size;
+            const size_t child_depth = fork ? depth - 1 : 0;
+            fork_join(fork, [this, &l, &split, child_depth]() { l = build_tree(std::move(split.first ), child_depth); },
+                            [this, &r, &split, child_depth]() { r = build_tree(std::move(split.second), child_depth); });
         }
         
-        return node_t::create(s, l, r);
+        return node_t::create(std::move(s), l, r);
     }
 
     node_t::ptr find_split_node(const range_t &range) const
@@ -275,14 +279,40 @@ private:
         return child_indices;
     }
 
-    static void extract_indices(node_t::ptr node, const pair<size_t, size_t> &limits, point_indices_t &out_indices) 
+    // calls f(node, limits) for every canonical node of the range, limits are the y-ordered positions in the node
+    template<typename F>
+    void visit_subsets(const range_t &x_range, const range_t &y_range, F f) const
     {
-        const auto start_it = node->value().y_ordered.begin();
-        std::copy(start_it + limits.first, start_it + limits.second, std::back_inserter(out_indices));
-    }
+        if (!root_)
+            return;
+
+        node_t::ptr node = find_split_node(x_range);
+
+        const vector<cascade_index_t> &y_indices = node->value().y_ordered;
+
+        const size_t i1 = boost::lower_bound(y_indices, y_range.inf, comparator2_t(points_, false, true)) - y_indices.begin();
+        const size_t i2 = boost::lower_bound(y_indices, y_range.sup, comparator2_t(points_, false, true)) - y_indices.begin();
+
+        // an empty y range
+        if (i2 <= i1)
+            return;
 
+        if (node->is_leaf())
+        {
+            // the search may end up at a leaf that is out of the x range
+            const coord_t x = get_point(node_x(node)).x;
+            if (x >= x_range.inf && x < x_range.sup)
+                f(node, make_pair(i1, i2));
+        }
+        else
+        {
+            run_left (node, x_range, i1, i2, f);
+            run_right(node, x_range, i1, i2, f);
+        }
+    }
 
-    void run_left(node_t::ptr start, const range_t &range, size_t ibegin, size_t iend, point_indices_t &out_indices) const
+    template<typename F>
+    void run_left(node_t::ptr start, const range_t &range, size_t ibegin, size_t iend, F &f) const
     {
         const comparator2_t comp(points_, true, true);
 
@@ -298,7 +328,7 @@ private:
             // x_v >= x
             if (!comp(index, range.inf))
             {
-                extract_indices(node->r(), sublimits(node, limits, false), out_indices);
+                f(node->r(), sublimits(node, limits, false));
 
                 step_left = true;
             }
@@ -311,10 +341,11 @@ private:
         const point_index_t index = node_x(node);
 
         if (!comp(index, range.inf))
-            extract_indices(node, limits, out_indices);
+            f(node, limits);
     }
 
-    void run_right(node_t::ptr start, const range_t &range, size_t ibegin, size_t iend, point_indices_t &out_indices) const
+    template<typename F>
+    void run_right(node_t::ptr start, const range_t &range, size_t ibegin, size_t iend, F &f) const
     {
         const comparator2_t comp(points_, true, true);
 
@@ -330,7 +361,7 @@ private:
             // x_v < x'
             if (comp(index, range.sup))
             {
-                extract_indices(node->l(), sublimits(node, limits, true), out_indices);
+                f(node->l(), sublimits(node, limits, true));
 
                 step_left = false;
             }
@@ -343,7 +374,7 @@ private:
         const point_index_t index = node_x(node);
 
         if (comp(index, range.sup))
-            extract_indices(node, limits, out_indices);
+            f(node, limits);
     }
 
 private:
@@ -19,11 +19,17 @@ PRECOMPILED_HEADER = stdafx.h
 
 HEADERS += \
 	common.h \
+	compact_range_tree.h \
+	dynamic_range_tree.h \
+	flat_range_tree.h \
+	index_file.h \
+	parallel.h \
 	primitives.h \
 	range_tree.h \
 	segment_tree.h \
 	segment_windowing.h \
 	stdafx.h \
+	succinct.h \
 	tree.h
 
 
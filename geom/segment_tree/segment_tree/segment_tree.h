@@ -59,6 +59,9 @@ bool compare_segments(const segment_t &s1, const segment_t &s2)
 }
 
 
+// Built as a tree of nodes, then flattened into one array of 32-bit words with no pointers in it, the image,
+// which is all the queries use: a tree can be saved by writing the image out and used straight from a mapped
+// file (see index_file.h).
 struct segment_tree_t
 {
     typedef vector<segment_t> segments_t;
@@ -77,11 +80,22 @@ struct segment_tree_t
     };
 
     segment_tree_t(const segments_t &ranges)
-        : root_(build_tree(ranges))
-        , segments_(ranges)
+        : external_(0)
     {
-        insert_segments();
-        check(root_);
+        MY_ASSERT(ranges.size() < (uint64_t(1) << 32));
+
+        const node_ptr root = build_tree(ranges);
+        insert_segments(ranges, root);
+        check(root);
+        flatten(ranges, root);
+    }
+
+    // over the image() of a tree, used in place, so it has to outlive the tree
+    segment_tree_t(const uint32_t *image, size_t words)
+        : external_(image)
+    {
+        if (words < header_words || words != image_words(image[0], image[1], image[2]))
+            throw std::runtime_error("segment_tree_t: not an image of a tree");
     }
 
     range_its query(const query_t &q) const
@@ -90,7 +104,7 @@ struct segment_tree_t
         if (q.y.sup < q.y.inf)
             return dst;
 
-        query(q, root_, dst);
+        query(q, dst);
         return dst;
     }
 
@@ -99,9 +113,26 @@ struct segment_tree_t
         return it;
     }
 
-    const segments_t &segments() const 
+    size_t size() const
+    {
+        return image()[0];
+    }
+
+    segment_t segment(size_t i) const
+    {
+        const coord_t *c = coords() + 4 * i;
+        return segment_t(point_t(c[0], c[1]), point_t(c[2], c[3]));
+    }
+
+    // the whole tree, position independent
+    const uint32_t *image() const
+    {
+        return external_ ? external_ : &storage_[0];
+    }
+
+    size_t image_words() const
     {
-        return segments_;
+        return image_words(image()[0], image()[1], image()[2]);
     }
 
 private:
@@ -119,6 +150,42 @@ private:
     typedef node_base_t<node_data_t> node_t;
     typedef node_t::ptr node_ptr;
 
+    // a node of the image: its interval, the children's numbers (no_node if none, never only a right one)
+    // and [first, last) of the segment ids
+    struct flat_node_t
+    {
+        coord_t inf, sup;
+        uint32_t l, r;
+        uint32_t first, last;
+    };
+
+    static const uint32_t no_node = uint32_t(-1);
+
+    // the image: the numbers of segments, nodes and ids, then the segments as x0, y0, x1, y1, the nodes in
+    // preorder, root first, and the ids of all the nodes one after another
+    static const size_t header_words = 3;
+    static const size_t node_words = sizeof(flat_node_t) / sizeof(uint32_t);
+
+    static size_t image_words(size_t segments, size_t nodes, size_t ids)
+    {
+        return header_words + 4 * segments + node_words * nodes + ids;
+    }
+
+    const coord_t *coords() const
+    {
+        return reinterpret_cast<const coord_t *>(image() + header_words);
+    }
+
+    const flat_node_t *nodes() const
+    {
+        return reinterpret_cast<const flat_node_t *>(image() + header_words + 4 * size());
+    }
+
+    const range_it *ids() const
+    {
+        return image() + header_words + 4 * size() + node_words * image()[1];
+    }
+
 private:
     static vector<node_ptr> make_parents(const vector<node_ptr> &children)
     {
@@ -186,18 +253,18 @@ private:
     }
 
 private:
-    void insert_segment(range_it it, node_ptr node)
+    static void insert_segment(const segments_t &segments, range_it it, node_ptr node, node_ptr root)
     {
         // can't have only right child
         MY_ASSERT(node->l() || !node->r());
 
         range_t interval = node->value().interval;
-        range_t it_range = segment2range(segments_.at(it));
+        range_t it_range = segment2range(segments.at(it));
 
         if ((it_range & interval).is_empty())
         {
             // root has to intersect EVERY inserted segment
-            MY_ASSERT(node != root_);
+            MY_ASSERT(node != root);
             return;
         }
 
@@ -209,60 +276,114 @@ private:
         else
         {
             if (node->l())
-                insert_segment(it, node->l());
+                insert_segment(segments, it, node->l(), root);
             if (node->r())
-                insert_segment(it, node->r());
+                insert_segment(segments, it, node->r(), root);
         }
     }
 
-    void insert_segments()
+    static void insert_segments(const segments_t &segments, node_ptr root)
     {
-        for (auto it = segments_.begin(); it != segments_.end(); ++it)
-            insert_segment(it - segments_.begin(), root_);
+        for (auto it = segments.begin(); it != segments.end(); ++it)
+            insert_segment(segments, it - segments.begin(), root, root);
 
-        sort_segments(root_);
+        sort_segments(segments, root);
     }
 
-    void sort_segments(node_ptr node)
+    static void sort_segments(const segments_t &segments, node_ptr node)
     {
-        auto comp = [this, node](range_it it1, range_it it2) -> bool
+        auto comp = [&segments](range_it it1, range_it it2) -> bool
         {
-            return compare_segments(segments_.at(it1), segments_.at(it2));;
+            return compare_segments(segments.at(it1), segments.at(it2));;
         };
 
         // maintaining segments order
         boost::sort(node->value().segments, comp);
 
         if (node->l())
-            sort_segments(node->l());
+            sort_segments(segments, node->l());
         if (node->r())
-            sort_segments(node->r());
+            sort_segments(segments, node->r());
     }
 
-    void query(query_t q, node_ptr node, range_its &dst) const
+    void flatten(const segments_t &segments, node_ptr root)
     {
-        const range_t interval = node->value().interval;
-        if (q.x < interval.inf || q.x > interval.sup)
-            return;
+        vector<flat_node_t> nodes;
+        range_its ids;
+        flatten(root, nodes, ids);
+
+        storage_.resize(image_words(segments.size(), nodes.size(), ids.size()));
+        storage_[0] = uint32_t(segments.size());
+        storage_[1] = uint32_t(nodes.size());
+        storage_[2] = uint32_t(ids.size());
+
+        coord_t *c = reinterpret_cast<coord_t *>(&storage_[header_words]);
+        BOOST_FOREACH(const segment_t &segment, segments)
+        {
+            *c++ = segment[0].x;
+            *c++ = segment[0].y;
+            *c++ = segment[1].x;
+            *c++ = segment[1].y;
+        }
+
+        if (!nodes.empty())
+            memcpy(&storage_[header_words + 4 * segments.size()], &nodes[0], nodes.size() * sizeof(flat_node_t));
+        boost::copy(ids, storage_.begin() + header_words + 4 * segments.size() + node_words * nodes.size());
+    }
+
+    // preorder, returns the node's number
+    static uint32_t flatten(node_ptr node, vector<flat_node_t> &nodes, range_its &ids)
+    {
+        if (!node)
+            return no_node;
+
+        const uint32_t number = uint32_t(nodes.size());
+        nodes.push_back(flat_node_t());
+        nodes[number].inf = node->value().interval.inf;
+        nodes[number].sup = node->value().interval.sup;
+        nodes[number].first = uint32_t(ids.size());
+        boost::copy(node->value().segments, std::back_inserter(ids));
+        nodes[number].last = uint32_t(ids.size());
+
+        const uint32_t l = flatten(node->l(), nodes, ids);
+        const uint32_t r = flatten(node->r(), nodes, ids);
+        nodes[number].l = l;
+        nodes[number].r = r;
+
+        return number;
+    }
+
+    // down the one path of nodes with x
+    void query(query_t q, range_its &dst) const
+    {
+        const flat_node_t *nodes = this->nodes();
+        const range_it *ids = this->ids();
 
         // extraction
         auto comp = [this](range_it it, const point_t &point) -> bool
         {
-            const segment_t os(geom::structures::min(segments_.at(it)), geom::structures::max(segments_.at(it)));
+            const segment_t s = segment(it);
+            const segment_t os(geom::structures::min(s), geom::structures::max(s));
             const bool res1 = point_to_the_left(os, point);
             return res1;
         };
 
-        const auto &segments = node->value().segments;
-        const auto it1 = boost::lower_bound(segments, point_t(q.x, q.y.inf), comp);
-        const auto it2 = boost::lower_bound(segments, point_t(q.x, q.y.sup), comp);
+        for (uint32_t n = 0; n != no_node; )
+        {
+            const flat_node_t &node = nodes[n];
+            if (q.x < node.inf || q.x > node.sup)
+                return;
+
+            const range_it *it1 = std::lower_bound(ids + node.first, ids + node.last, point_t(q.x, q.y.inf), comp);
+            const range_it *it2 = std::lower_bound(ids + node.first, ids + node.last, point_t(q.x, q.y.sup), comp);
 
-        std::copy(it1, it2, std::back_inserter(dst));
+            std::copy(it1, it2, std::back_inserter(dst));
 
-        if (node->l() && node->l()->value().interval.contains(q.x))
-            query(q, node->l(), dst);
-        else if (node->r())
-            query(q, node->r(), dst);
+            if (node.l != no_node && nodes[node.l].inf <= q.x && q.x <= nodes[node.l].sup)
+                n = node.l;
+            else
+                n = node.r;
+        }
     }
 
     static void check(node_ptr node)
@@ -291,7 +412,7 @@ private:
     }
 
 private:
-    node_ptr root_;
-    segments_t segments_;
+    // the image, built here or someone else's
+    vector<uint32_t> storage_;
+    const uint32_t *external_;
 };
-
@@ -1,8 +1,11 @@
 #pragma once
 
-#include "range_tree.h"
+#include "flat_range_tree.h"
 #include "segment_tree.h"
+#include "index_file.h"
 
+// All three structures are pointer-free images, so save() writes them to an index file and the file constructor
+// maps it and queries it in place, without building or reading anything.
 struct windowing_t
 {
     typedef vector<segment_t> segments_t;
@@ -16,6 +19,26 @@ struct windowing_t
 
     }
 
+    // a file written by save(), the checksum check reads all of it
+    explicit windowing_t(const string &path, bool verify_checksum = true)
+        : file_(boost::make_shared<index_file_t>(path, verify_checksum))
+        , ranges_(load<flat_range_tree_t>(*file_, ranges_tag()))
+        , x_segments_(load<segment_tree_t>(*file_, x_segments_tag()))
+        , y_segments_(load<segment_tree_t>(*file_, y_segments_tag()))
+    {
+        if (x_segments_.size() != y_segments_.size() || ranges_.size() != 2 * x_segments_.size())
+            throw index_file_error(path + ": the structures don't match");
+    }
+
+    void save(const string &path) const
+    {
+        index_file_writer_t writer;
+        writer.add(ranges_tag(), ranges_.image(), ranges_.image_words() * sizeof(uint32_t));
+        writer.add(x_segments_tag(), x_segments_.image(), x_segments_.image_words() * sizeof(uint32_t));
+        writer.add(y_segments_tag(), y_segments_.image(), y_segments_.image_words() * sizeof(uint32_t));
+        writer.write(path);
+    }
+
     indices_t query(const range_t &x, const range_t &y)
     {
         indices_t res;
@@ -37,12 +60,30 @@ struct windowing_t
         return res;
     }
 
-    const segments_t &segments() const
+    size_t size() const
+    {
+        return x_segments_.size();
+    }
+
+    segment_t segment(size_t i) const
     {
-        return x_segments_.segments();
+        return x_segments_.segment(i);
     }
 
 private:
+    // the sections of the index file, a new layout of a structure gets a new tag
+    static uint32_t ranges_tag()     { return index_file::tag("rng1"); }
+    static uint32_t x_segments_tag() { return index_file::tag("xsg1"); }
+    static uint32_t y_segments_tag() { return index_file::tag("ysg1"); }
+
+    template<typename T>
+    static T load(const index_file_t &file, uint32_t tag)
+    {
+        size_t words;
+        const uint32_t *image = file.section_array<uint32_t>(tag, words);
+        return T(image, words);
+    }
+
     static segments_t swap_xy(const segments_t &segments)
     {
         segments_t res;
@@ -54,9 +95,9 @@ private:
         return res;
     }
 
-    static range_tree_t::points_t extract_points(const segments_t &segments)
+    static flat_range_tree_t::points_t extract_points(const segments_t &segments)
     {
-        range_tree_t::points_t points;
+        flat_range_tree_t::points_t points;
         points.resize(segments.size() * 2);
 
         for (size_t i = 0; i < segments.size(); ++i)
@@ -69,6 +110,9 @@ private:
     }
 
 private:
-    range_tree_t ranges_;
+    // the mapped file the structures are in, if loaded
+    shared_ptr<const index_file_t> file_;
+
+    flat_range_tree_t ranges_;
     segment_tree_t x_segments_, y_segments_;
 };
\ No newline at end of file
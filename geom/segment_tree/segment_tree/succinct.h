@@ -0,0 +1,170 @@
+#pragma once
+
+#include "parallel.h"
+
+// building blocks of the compact structures
+
+inline size_t popcount(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return size_t((x * 0x0101010101010101ull) >> 56);
+}
+
+// bits needed for the values 0 .. max_value
+inline size_t bits_for(uint64_t max_value)
+{
+    size_t bits = 0;
+    for (; max_value != 0; max_value >>= 1)
+        ++bits;
+    return bits;
+}
+
+// unsigned values of width bits each, packed one after another
+struct packed_array_t
+{
+    packed_array_t()
+        : size_(0)
+        , width_(0)
+    {}
+
+    packed_array_t(size_t size, size_t width)
+        // two words more, so a value is always read as two whole words: the last one's second word, or the
+        // second word after an empty array or one of width 0, where every value is at bit 0
+        : words_((size * width + 63) / 64 + 2, 0)
+        , size_(size)
+        , width_(width)
+    {
+        MY_ASSERT(width < 64);
+    }
+
+    // not safe for neighbours set from different threads
+    void set(size_t i, uint64_t value)
+    {
+        MY_ASSERT(value < (uint64_t(1) << width_));
+
+        const size_t bit = i * width_;
+        uint64_t *w = &words_[bit / 64];
+        const size_t shift = bit % 64;
+
+        const uint64_t mask = (uint64_t(1) << width_) - 1;
+        w[0] = (w[0] & ~(mask << shift)) | (value << shift);
+        if (shift + width_ > 64)
+            w[1] = (w[1] & ~(mask >> (64 - shift))) | (value >> (64 - shift));
+    }
+
+    // no branches: the second word is shifted in by two steps, so a shift of 0 doesn't shift by 64
+    uint64_t operator[](size_t i) const
+    {
+        const size_t bit = i * width_;
+        const uint64_t *w = &words_[bit / 64];
+        const size_t shift = bit % 64;
+
+        const uint64_t value = (w[0] >> shift) | ((w[1] << 1) << (63 - shift));
+        return value & ((uint64_t(1) << width_) - 1);
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    size_t memory_size() const
+    {
+        return words_.size() * sizeof(uint64_t);
+    }
+
+private:
+    vector<uint64_t> words_;
+    size_t size_;
+    size_t width_;
+};
+
+// Bits with rank in constant time, reading one line of 64 bytes: a line is the number of ones before it and
+// 7 words of bits, 448 bits for 512, so 14% on top of the bits.
+struct rank_bitvector_t
+{
+    rank_bitvector_t()
+        : size_(0)
+    {}
+
+    // bit(i) for i in 0 .. size - 1, the lines are filled in parallel
+    template<typename F>
+    rank_bitvector_t(size_t size, F bit, size_t depth)
+        : lines_((size / line_bits + 1) * line_words, 0)
+        , size_(size)
+    {
+        const size_t lines = lines_.size() / line_words;
+        parallel_for(0, lines, 1 << 10, [this, size, &bit](size_t begin, size_t end)
+        {
+            for (size_t line = begin; line < end; ++line)
+            {
+                uint64_t *words = &lines_[line * line_words + 1];
+                const size_t first = line * line_bits;
+                const size_t last = std::min(size, first + line_bits);
+                for (size_t i = first; i < last; ++i)
+                {
+                    if (bit(i))
+                        words[(i - first) / 64] |= uint64_t(1) << ((i - first) % 64);
+                }
+
+                uint64_t ones = 0;
+                for (size_t w = 0; w < line_words - 1; ++w)
+                    ones += popcount(words[w]);
+                lines_[line * line_words] = ones;
+            }
+        }, depth);
+
+        // the counts of the lines into the ones before them
+        uint64_t before = 0;
+        for (size_t line = 0; line < lines; ++line)
+        {
+            const uint64_t ones = lines_[line * line_words];
+            lines_[line * line_words] = before;
+            before += ones;
+        }
+    }
+
+    bool operator[](size_t i) const
+    {
+        const uint64_t *line = &lines_[i / line_bits * line_words];
+        const size_t bit = i % line_bits;
+        return ((line[1 + bit / 64] >> (bit % 64)) & 1) != 0;
+    }
+
+    // ones in [0, pos), pos in [0, size]
+    size_t rank1(size_t pos) const
+    {
+        const uint64_t *line = &lines_[pos / line_bits * line_words];
+        const size_t bit = pos % line_bits;
+        const size_t word = bit / 64;
+
+        size_t ones = size_t(line[0]);
+        for (size_t w = 0; w < word; ++w)
+            ones += popcount(line[1 + w]);
+        return ones + popcount(line[1 + word] & ((uint64_t(1) << (bit % 64)) - 1));
+    }
+
+    size_t rank0(size_t pos) const
+    {
+        return pos - rank1(pos);
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    size_t memory_size() const
+    {
+        return lines_.size() * sizeof(uint64_t);
+    }
+
+private:
+    static const size_t line_words = 8;
+    static const size_t line_bits = (line_words - 1) * 64;
+
+    vector<uint64_t> lines_;
+    size_t size_;
+};
@@ -8,11 +8,11 @@ struct node_base_t
 
     static ptr create(value_type value, ptr left = ptr(), ptr right = ptr())
     {
-        return make_shared<node_base_t>(value, left, right);
+        return make_shared<node_base_t>(std::move(value), left, right);
     }
 
 	node_base_t(value_type value, ptr left = ptr(), ptr right = ptr())
-		: value_(value)
+		: value_(std::move(value))
 		, left_(left)
 		, right_(right)
 	{
@@ -0,0 +1,161 @@
+#include "stdafx.h"
+#include "threadpool.h"
+
+#include <cstdlib>
+#include <new>
+
+boost::mutex cout_mutex;
+
+// every allocation of the process goes through here, the array forms too
+namespace
+{
+    atomic<size_t> allocations(0);
+
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+    // out of line, so the compiler never sees a new expression's memory go to free
+    NOINLINE void *counted_alloc(size_t size)
+    {
+        ++allocations;
+        if (void *p = std::malloc(size ? size : 1))
+            return p;
+
+        throw std::bad_alloc();
+    }
+
+    NOINLINE void counted_free(void *p)
+    {
+        std::free(p);
+    }
+}
+
+void *operator new(size_t size)
+{
+    return counted_alloc(size);
+}
+
+void *operator new[](size_t size)
+{
+    return counted_alloc(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    counted_free(p);
+}
+
+namespace
+{
+    atomic<size_t> tasks_done(0);
+
+    // captures Size bytes
+    template<size_t Size>
+    struct payload_task
+    {
+        payload_task()
+        {
+            for (size_t i = 0; i < Size; ++i)
+                data[i] = char(i);
+        }
+
+        void operator()() const
+        {
+            volatile char x = data[Size - 1];
+            (void)x;
+            ++tasks_done;
+        }
+
+        char data[Size];
+    };
+
+    template<typename Task>
+    void add_and_wait(threadpool &pool, size_t num_tasks)
+    {
+        for (size_t i = 0; i < num_tasks; ++i)
+        {
+            const size_t done = tasks_done;
+            pool.add_task(Task());
+            while (tasks_done == done)
+                boost::this_thread::yield();
+        }
+    }
+
+    // heap allocations per add_task + run, once the pool is warmed up
+    template<typename Task>
+    double allocations_per_task(threadpool::scheduling_t scheduling, size_t num_tasks)
+    {
+        threadpool pool(2, pt::seconds(60), scheduling, event_log::LOG_NONE);
+
+        // chunks, caches and the task table get their memory here
+        add_and_wait<Task>(pool, num_tasks);
+
+        const size_t before = allocations;
+        add_and_wait<Task>(pool, num_tasks);
+        const size_t after = allocations;
+
+        return double(after - before) / num_tasks;
+    }
+}
+
+// Heap allocations per task: one at a time add_task of a callable with the given capture size,
+// waiting for it to finish. Captures up to small_task::inline_size bytes should cost nothing.
+int main(int argc, char* argv[])
+{
+    size_t num_tasks = 10000;
+
+    try
+    {
+        if (argc > 1)
+            num_tasks = boost::lexical_cast<size_t>(argv[1]);
+    }
+    catch (boost::bad_lexical_cast &)
+    {
+        std::cerr << "Usage: bench_allocations [num_tasks]" << endl;
+        return 1;
+    }
+
+    const threadpool::scheduling_t modes[] =
+    {
+        threadpool::SINGLE_QUEUE,
+        threadpool::WORK_STEALING,
+        threadpool::LOCK_FREE_QUEUE
+    };
+
+    cout << "capture_bytes\tsingle_queue\twork_stealing\tlock_free_queue\t(allocations/task)" << endl;
+
+    cout << "8";
+    BOOST_FOREACH(auto mode, modes)
+        cout << "\t" << allocations_per_task<payload_task<8>>(mode, num_tasks);
+    cout << endl;
+
+    cout << "48";
+    BOOST_FOREACH(auto mode, modes)
+        cout << "\t" << allocations_per_task<payload_task<48>>(mode, num_tasks);
+    cout << endl;
+
+    cout << "64";
+    BOOST_FOREACH(auto mode, modes)
+        cout << "\t" << allocations_per_task<payload_task<64>>(mode, num_tasks);
+    cout << endl;
+
+    return 0;
+}
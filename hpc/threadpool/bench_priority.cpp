@@ -0,0 +1,128 @@
+#include "stdafx.h"
+#include "threadpool.h"
+
+boost::mutex cout_mutex;
+
+namespace
+{
+    atomic<size_t> probes_done(0);
+
+    void spin_task(size_t iterations)
+    {
+        volatile size_t x = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            x = x + i;
+    }
+
+    // remembers how long it waited in the queue
+    struct probe_task
+    {
+        probe_task(uint64_t *latency_ns)
+            : latency_ns(latency_ns)
+            , submit_ns(steady_clock_ns())
+        {}
+
+        void operator()() const
+        {
+            *latency_ns = steady_clock_ns() - submit_ns;
+            ++probes_done;
+        }
+
+        uint64_t *latency_ns;
+        uint64_t submit_ns;
+    };
+
+    struct options_t
+    {
+        size_t num_threads;
+        size_t num_background;
+        size_t iterations;
+        size_t num_probes;
+        pt::time_duration probe_interval;
+    };
+
+    // background tasks are added at once and keep the pool busy, the probes come one by one meanwhile
+    vector<uint64_t> run(threadpool::scheduling_t scheduling, threadpool::priority_t background_priority,
+                         threadpool::priority_t probe_priority, const options_t &opts)
+    {
+        probes_done = 0;
+        vector<uint64_t> latencies(opts.num_probes);
+
+        threadpool pool(opts.num_threads, pt::milliseconds(1), scheduling, event_log::LOG_NONE);
+
+        vector<boost::function<void()>> background(opts.num_background, boost::bind(&spin_task, opts.iterations));
+        pool.add_tasks(background, background_priority);
+
+        for (size_t i = 0; i < opts.num_probes; ++i)
+        {
+            boost::this_thread::sleep(opts.probe_interval);
+            pool.add_task(probe_task(&latencies[i]), probe_priority);
+        }
+
+        while (probes_done < opts.num_probes)
+            boost::this_thread::yield();
+
+        boost::sort(latencies);
+        return latencies;
+    }
+
+    double percentile_us(const vector<uint64_t> &sorted, double p)
+    {
+        const size_t i = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+        return sorted[i] / 1000.;
+    }
+}
+
+// Queue latency of the probe tasks while the pool is saturated with background tasks:
+// "fifo":     everything is PRIORITY_NORMAL, the probes wait behind the backlog,
+// "priority": PRIORITY_LOW background, PRIORITY_HIGH probes.
+// The backlog is a few times longer than the probing, so the pool stays saturated all along.
+// Until the pool has a thread limit, every probe that finds no idle thread also starts an elastic worker.
+int main(int argc, char* argv[])
+{
+    options_t opts;
+    opts.num_threads = 4;
+    opts.num_background = 20000;
+    opts.iterations = 20000;
+    opts.num_probes = 200;
+    opts.probe_interval = pt::microseconds(500);
+
+    try
+    {
+        if (argc > 1)
+            opts.num_threads = boost::lexical_cast<size_t>(argv[1]);
+        if (argc > 2)
+            opts.num_background = boost::lexical_cast<size_t>(argv[2]);
+        if (argc > 3)
+            opts.num_probes = boost::lexical_cast<size_t>(argv[3]);
+    }
+    catch (boost::bad_lexical_cast &)
+    {
+        std::cerr << "Usage: bench_priority [num_threads [num_background_tasks [num_probes]]]" << endl;
+        return 1;
+    }
+
+    if (opts.num_probes == 0)
+        return 0;
+
+    const pair<threadpool::scheduling_t, const char *> modes[] =
+    {
+        make_pair(threadpool::SINGLE_QUEUE,    "single_queue"),
+        make_pair(threadpool::WORK_STEALING,   "work_stealing"),
+        make_pair(threadpool::LOCK_FREE_QUEUE, "lock_free_queue")
+    };
+
+    cout << "mode\tload\tp50\tp99\tmax\t(probe queue latency, us)" << endl;
+    BOOST_FOREACH(const auto &mode, modes)
+    {
+        const auto fifo = run(mode.first, threadpool::PRIORITY_NORMAL, threadpool::PRIORITY_NORMAL, opts);
+        cout << mode.second << "\tfifo\t" << percentile_us(fifo, 0.5) << "\t" << percentile_us(fifo, 0.99)
+             << "\t" << fifo.back() / 1000. << endl;
+
+        const auto prio = run(mode.first, threadpool::PRIORITY_LOW, threadpool::PRIORITY_HIGH, opts);
+        cout << mode.second << "\tpriority\t" << percentile_us(prio, 0.5) << "\t" << percentile_us(prio, 0.99)
+             << "\t" << prio.back() / 1000. << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "stdafx.h"
+#include "threadpool.h"
+
+boost::mutex cout_mutex;
+
+namespace
+{
+    atomic<size_t> tasks_done(0);
+
+    // mostly waiting, like a task doing I/O: more threads do help here
+    void io_task(pt::time_duration wait)
+    {
+        boost::this_thread::sleep(wait);
+        ++tasks_done;
+    }
+
+    struct options_t
+    {
+        size_t hot_threads;
+        size_t max_threads;
+        size_t num_bursts;
+        size_t burst_size;
+        pt::time_duration task_wait;
+        pt::time_duration gap;
+    };
+
+    struct result_t
+    {
+        uint64_t workers_created;
+        size_t peak_threads;
+        double tasks_per_sec;
+        uint64_t p99_queue_latency_ns;
+    };
+
+    // bursts of add_task one by one, with idle gaps in between
+    result_t run(shared_ptr<sizing_policy> policy, const options_t &opts)
+    {
+        tasks_done = 0;
+        threadpool pool(opts.hot_threads, policy, threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+
+        result_t res = result_t();
+        const size_t num_tasks = opts.num_bursts * opts.burst_size;
+
+        const auto start = boost::chrono::steady_clock::now();
+        for (size_t b = 0; b < opts.num_bursts; ++b)
+        {
+            for (size_t i = 0; i < opts.burst_size; ++i)
+                pool.add_task(boost::bind(&io_task, opts.task_wait));
+
+            const auto stats = pool.stats();
+            res.peak_threads = std::max(res.peak_threads, stats.hot_threads + stats.worker_threads);
+
+            boost::this_thread::sleep(opts.gap);
+        }
+
+        while (tasks_done < num_tasks)
+            boost::this_thread::yield();
+        const boost::chrono::duration<double> elapsed = boost::chrono::steady_clock::now() - start;
+
+        const auto stats = pool.stats();
+        res.workers_created = stats.workers_created;
+        res.tasks_per_sec = num_tasks / elapsed.count();
+        res.p99_queue_latency_ns = stats.queue_latency.percentile(0.99);
+        return res;
+    }
+}
+
+// Elastic threads started under a bursty load of 1 ms I/O-like tasks, and what they buy:
+// "on_demand":     a thread for every task that finds no idle one (the default policy),
+// "on_demand_max": the same, with max_threads,
+// "latency":       latency_target_policy with max_threads, 2 ms target, 200 ms shrink delay.
+// Throughput counts the gaps as well, it's the same for all the policies as long as they keep up.
+int main(int argc, char* argv[])
+{
+    options_t opts;
+    opts.hot_threads = 2;
+    opts.max_threads = 32;
+    opts.num_bursts = 20;
+    opts.burst_size = 500;
+    opts.task_wait = pt::milliseconds(1);
+    opts.gap = pt::milliseconds(50);
+
+    try
+    {
+        if (argc > 1)
+            opts.max_threads = boost::lexical_cast<size_t>(argv[1]);
+        if (argc > 2)
+            opts.num_bursts = boost::lexical_cast<size_t>(argv[2]);
+        if (argc > 3)
+            opts.burst_size = boost::lexical_cast<size_t>(argv[3]);
+    }
+    catch (boost::bad_lexical_cast &)
+    {
+        std::cerr << "Usage: bench_sizing [max_threads [num_bursts [burst_size]]]" << endl;
+        return 1;
+    }
+
+    const pair<const char *, shared_ptr<sizing_policy>> policies[] =
+    {
+        make_pair("on_demand", shared_ptr<sizing_policy>(
+            make_shared<spawn_on_demand_policy>(pt::seconds(1)))),
+        make_pair("on_demand_max", shared_ptr<sizing_policy>(
+            make_shared<spawn_on_demand_policy>(pt::seconds(1), opts.max_threads))),
+        make_pair("latency", shared_ptr<sizing_policy>(
+            make_shared<latency_target_policy>(opts.max_threads, pt::milliseconds(2), pt::milliseconds(200))))
+    };
+
+    cout << "policy\tworkers_created\tpeak_threads\ttasks/sec\tp99_queue_latency_us" << endl;
+    BOOST_FOREACH(const auto &p, policies)
+    {
+        const result_t res = run(p.second, opts);
+        cout << p.first << "\t" << res.workers_created << "\t" << res.peak_threads << "\t"
+             << size_t(res.tasks_per_sec) << "\t" << res.p99_queue_latency_ns / 1000. << endl;
+    }
+
+    return 0;
+}
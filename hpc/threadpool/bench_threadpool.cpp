@@ -0,0 +1,351 @@
+#include "stdafx.h"
+#include "threadpool.h"
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+boost::mutex cout_mutex;
+
+namespace
+{
+    atomic<size_t> tasks_done(0);
+
+    struct options_t
+    {
+        size_t max_threads;
+        size_t num_tasks;
+        uint64_t cpu_ns;
+        pt::time_duration sleep;
+        // every sleep_every-th task of "mixed" sleeps, the others spin
+        size_t sleep_every;
+        // threadpool::set_spin
+        pt::time_duration spin;
+        size_t spin_yields;
+        vector<string> workloads;
+        vector<string> modes;
+        bool json;
+    };
+
+    struct result_t
+    {
+        size_t num_tasks;
+        double seconds;
+        latency_histogram::snapshot_t latency;
+        uint64_t context_switches;
+    };
+
+    // voluntary and involuntary, of the whole process so far
+    uint64_t context_switches()
+    {
+#if defined(_WIN32)
+        return 0;
+#else
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+        return uint64_t(usage.ru_nvcsw) + uint64_t(usage.ru_nivcsw);
+#endif
+    }
+
+    // busy for ns nanoseconds of wall time, whatever the CPU
+    void spin_task(uint64_t ns)
+    {
+        const uint64_t start = steady_clock_ns();
+        while (steady_clock_ns() - start < ns)
+        {
+        }
+
+        ++tasks_done;
+    }
+
+    void empty_task()
+    {
+        ++tasks_done;
+    }
+
+    void sleeping_task(pt::time_duration dur)
+    {
+        boost::this_thread::sleep(dur);
+        ++tasks_done;
+    }
+
+    // binary fan-out: every task submits its two children from inside the pool
+    void fanout_task(threadpool *pool, size_t depth, uint64_t ns)
+    {
+        if (depth > 0)
+        {
+            pool->add_task(boost::bind(&fanout_task, pool, depth - 1, ns));
+            pool->add_task(boost::bind(&fanout_task, pool, depth - 1, ns));
+        }
+
+        spin_task(ns);
+    }
+
+    // waits without a thread, then works
+    void coro_task(coroutine_context &c, pt::time_duration sleep, uint64_t ns)
+    {
+        for (size_t i = 0; i < 4; ++i)
+            c.sleep(sleep);
+
+        spin_task(ns);
+    }
+
+    void wait_for(size_t num_tasks)
+    {
+        while (tasks_done < num_tasks)
+            boost::this_thread::yield();
+    }
+
+    // the tasks of a workload, added from the main thread (except for fanout)
+    size_t add_workload(threadpool &pool, const string &workload, const options_t &opts)
+    {
+        if (workload == "empty")
+        {
+            for (size_t i = 0; i < opts.num_tasks; ++i)
+                pool.add_task(&empty_task);
+            return opts.num_tasks;
+        }
+
+        if (workload == "cpu")
+        {
+            for (size_t i = 0; i < opts.num_tasks; ++i)
+                pool.add_task(boost::bind(&spin_task, opts.cpu_ns));
+            return opts.num_tasks;
+        }
+
+        if (workload == "batched")
+        {
+            const size_t batch_size = 256;
+            auto task = boost::bind(&spin_task, opts.cpu_ns);
+            vector<decltype(task)> batch;
+            for (size_t i = 0; i < opts.num_tasks; i += batch.size())
+            {
+                batch.assign(std::min(batch_size, opts.num_tasks - i), task);
+                pool.add_tasks(batch);
+            }
+            return opts.num_tasks;
+        }
+
+        if (workload == "mixed")
+        {
+            for (size_t i = 0; i < opts.num_tasks; ++i)
+            {
+                if (i % opts.sleep_every == 0)
+                    pool.add_task(boost::bind(&sleeping_task, opts.sleep));
+                else
+                    pool.add_task(boost::bind(&spin_task, opts.cpu_ns));
+            }
+            return opts.num_tasks;
+        }
+
+        if (workload == "sparse")
+        {
+            const size_t num_tasks = std::min<size_t>(opts.num_tasks, 10000);
+            for (size_t i = 0; i < num_tasks; ++i)
+            {
+                pool.add_task(&empty_task);
+                wait_for(i + 1);
+            }
+            return num_tasks;
+        }
+
+        if (workload == "coro")
+        {
+            const size_t num_tasks = std::min<size_t>(opts.num_tasks, 10000);
+            for (size_t i = 0; i < num_tasks; ++i)
+            {
+                const pt::time_duration sleep = opts.sleep;
+                const uint64_t ns = opts.cpu_ns;
+                spawn_coroutine(pool, [sleep, ns](coroutine_context &c) { coro_task(c, sleep, ns); });
+            }
+            return num_tasks;
+        }
+
+        if (workload == "fanout")
+        {
+            size_t depth = 0;
+            while ((size_t(2) << (depth + 1)) - 1 <= opts.num_tasks)
+                ++depth;
+
+            pool.add_task(boost::bind(&fanout_task, &pool, depth, opts.cpu_ns));
+            return (size_t(1) << (depth + 1)) - 1;
+        }
+
+        MY_ASSERT(false);
+        return 0;
+    }
+
+    // num_threads hot threads and no elastic ones, so the sweep compares like with like
+    result_t run(const string &workload, threadpool::scheduling_t scheduling, size_t num_threads, const options_t &opts)
+    {
+        tasks_done = 0;
+        threadpool pool(num_threads, make_shared<spawn_on_demand_policy>(pt::seconds(1), num_threads),
+                        scheduling, event_log::LOG_NONE);
+        pool.set_spin(opts.spin, opts.spin_yields);
+
+        result_t res;
+        const uint64_t switches = context_switches();
+
+        const auto start = boost::chrono::steady_clock::now();
+        res.num_tasks = add_workload(pool, workload, opts);
+        wait_for(res.num_tasks);
+        const boost::chrono::duration<double> elapsed = boost::chrono::steady_clock::now() - start;
+
+        res.seconds = elapsed.count();
+        res.context_switches = context_switches() - switches;
+        res.latency = pool.stats().queue_latency;
+        return res;
+    }
+
+    threadpool::scheduling_t parse_mode(const string &mode)
+    {
+        if (mode == "single")
+            return threadpool::SINGLE_QUEUE;
+        if (mode == "stealing")
+            return threadpool::WORK_STEALING;
+        if (mode == "lockfree")
+            return threadpool::LOCK_FREE_QUEUE;
+
+        throw std::invalid_argument("unknown mode " + mode);
+    }
+
+    vector<string> parse_list(const string &s)
+    {
+        vector<string> res;
+        boost::split(res, s, boost::is_any_of(","));
+        return res;
+    }
+
+    void print_header(const options_t &opts)
+    {
+        if (!opts.json)
+            cout << "workload,mode,threads,tasks,seconds,tasks_per_sec,p50_us,p99_us,p999_us,context_switches" << endl;
+    }
+
+    void print_result(const options_t &opts, const string &workload, const string &mode, size_t num_threads,
+                      const result_t &res)
+    {
+        const double us = 1000.;
+        const double tasks_per_sec = res.num_tasks / res.seconds;
+        const double p50 = res.latency.percentile(0.5) / us;
+        const double p99 = res.latency.percentile(0.99) / us;
+        const double p999 = res.latency.percentile(0.999) / us;
+
+        if (opts.json)
+        {
+            cout << "{\"workload\": \"" << workload << "\", \"mode\": \"" << mode << "\", \"threads\": " << num_threads
+                 << ", \"tasks\": " << res.num_tasks << ", \"seconds\": " << res.seconds
+                 << ", \"tasks_per_sec\": " << size_t(tasks_per_sec)
+                 << ", \"p50_us\": " << p50 << ", \"p99_us\": " << p99 << ", \"p999_us\": " << p999
+                 << ", \"context_switches\": " << res.context_switches << "}" << endl;
+        }
+        else
+        {
+            cout << workload << "," << mode << "," << num_threads << "," << res.num_tasks << "," << res.seconds << ","
+                 << size_t(tasks_per_sec) << "," << p50 << "," << p99 << "," << p999 << ","
+                 << res.context_switches << endl;
+        }
+    }
+}
+
+// Throughput and latency of the scheduling modes for 1, 2, 4.. max_threads hot threads, one line per
+// workload, mode and thread count, as CSV or JSON lines (--json) so runs can be diffed.
+// Workloads:
+//  "empty":   tasks that do nothing, the pool's own overhead,
+//  "cpu":     tasks spinning for --cpu-ns,
+//  "batched": the same, added with add_tasks in batches of 256,
+//  "mixed":   every --sleep-every-th task sleeps for --sleep-us, the others spin for --cpu-ns,
+//  "sparse":  empty tasks added one at a time, each once the previous one is done (up to 10000 of them),
+//             so the workers run out of work in between: the latency is the wakeup latency,
+//  "coro":    up to 10000 coroutines that sleep for --sleep-us 4 times (a timer tick at least), then spin
+//             for --cpu-ns: all of them wait at once, without taking up a thread,
+//  "fanout":  a binary tree of cpu tasks, every task adds its children from inside the pool.
+// All the tasks but the fanout ones are added by the main thread. Latency is from add_task to the start of
+// the task (stats().queue_latency); context switches are of the whole process.
+// --spin-us and --spin-yields set how long idle workers look for tasks before they park (threadpool::set_spin).
+int main(int argc, char* argv[])
+{
+    options_t opts;
+    opts.max_threads = 64;
+    opts.num_tasks = 100000;
+    opts.cpu_ns = 1000;
+    opts.sleep = pt::microseconds(100);
+    opts.sleep_every = 4;
+    opts.spin = pt::time_duration();
+    opts.spin_yields = 0;
+    opts.workloads = parse_list("empty,cpu,batched,mixed,sparse,coro,fanout");
+    opts.modes = parse_list("single,stealing,lockfree");
+    opts.json = false;
+
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const string arg = argv[i];
+            if (arg == "--json")
+            {
+                opts.json = true;
+                continue;
+            }
+
+            if (i + 1 >= argc)
+                throw std::invalid_argument(arg);
+            const string value = argv[++i];
+
+            if (arg == "--threads")
+                opts.max_threads = boost::lexical_cast<size_t>(value);
+            else if (arg == "--tasks")
+                opts.num_tasks = boost::lexical_cast<size_t>(value);
+            else if (arg == "--cpu-ns")
+                opts.cpu_ns = boost::lexical_cast<uint64_t>(value);
+            else if (arg == "--sleep-us")
+                opts.sleep = pt::microseconds(boost::lexical_cast<int64_t>(value));
+            else if (arg == "--sleep-every")
+                opts.sleep_every = std::max<size_t>(boost::lexical_cast<size_t>(value), 1);
+            else if (arg == "--spin-us")
+                opts.spin = pt::microseconds(boost::lexical_cast<int64_t>(value));
+            else if (arg == "--spin-yields")
+                opts.spin_yields = boost::lexical_cast<size_t>(value);
+            else if (arg == "--workloads")
+                opts.workloads = parse_list(value);
+            else if (arg == "--modes")
+                opts.modes = parse_list(value);
+            else
+                throw std::invalid_argument(arg);
+        }
+
+        BOOST_FOREACH(const string &mode, opts.modes)
+            parse_mode(mode);
+
+        const string workloads[] = { "empty", "cpu", "batched", "mixed", "sparse", "coro", "fanout" };
+        BOOST_FOREACH(const string &workload, opts.workloads)
+        {
+            if (boost::find(workloads, workload) == boost::end(workloads))
+                throw std::invalid_argument(workload);
+        }
+    }
+    catch (std::exception &)
+    {
+        std::cerr << "Usage: bench [--threads max_threads] [--tasks num_tasks] [--cpu-ns ns] [--sleep-us us]\n"
+                     "             [--sleep-every n] [--spin-us us] [--spin-yields n]\n"
+                     "             [--workloads empty,cpu,batched,mixed,sparse,coro,fanout]\n"
+                     "             [--modes single,stealing,lockfree] [--json]" << endl;
+        return 1;
+    }
+
+    print_header(opts);
+    for (size_t num_threads = 1; num_threads <= opts.max_threads; num_threads *= 2)
+    {
+        BOOST_FOREACH(const string &workload, opts.workloads)
+        {
+            BOOST_FOREACH(const string &mode, opts.modes)
+            {
+                const result_t res = run(workload, parse_mode(mode), num_threads, opts);
+                print_result(opts, workload, mode, num_threads, res);
+            }
+        }
+    }
+
+    return 0;
+}
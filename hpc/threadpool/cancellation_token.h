@@ -0,0 +1,38 @@
+#pragma once
+
+// Shared cancellation flag of a group of tasks: every task added with a copy of the token belongs to the group.
+// Once the token is canceled the queued tasks of the group never start, and the running ones can see it
+// with is_canceled() (or threadpool::cancellation_requested()) and return early.
+// A default constructed token is no group at all and can't be canceled.
+struct cancellation_token
+{
+    cancellation_token()
+    {}
+
+    static cancellation_token create()
+    {
+        cancellation_token res;
+        res.flag_ = boost::make_shared<atomic_bool>(false);
+        return res;
+    }
+
+    void cancel() const
+    {
+        if (flag_)
+            flag_->store(true);
+    }
+
+    // one relaxed load, cheap enough to poll in a loop
+    bool is_canceled() const
+    {
+        return flag_ && flag_->load(memory_order_relaxed);
+    }
+
+    bool empty() const
+    {
+        return !flag_;
+    }
+
+private:
+    shared_ptr<atomic_bool> flag_;
+};
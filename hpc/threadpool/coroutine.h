@@ -0,0 +1,302 @@
+#pragma once
+
+// Coroutine tasks on top of threadpool. Included at the bottom of threadpool.h, don't include directly.
+
+// What a coroutine's body gets, spawn_coroutine runs one. Every wait suspends the coroutine, hands the worker
+// back to the pool and has the coroutine resumed, as a new pool task, once the awaited thing happens. So a
+// waiting coroutine takes up no thread, where a sleep_task blocks one (and the pool may start another one to
+// make up for it): thousands of mostly waiting coroutines run on a few hot threads.
+// Coroutines are stackful (Boost.Context), the waits may be anywhere down the body's call stack. The stack has
+// a fixed size and a guard page. The coroutine may go on on another worker after every wait, so neither thread
+// locals nor locks may be held across one.
+// A coroutine that is never resumed (canceled through its token, or dropped while waiting because the pool
+// got drained or destroyed) has its stack unwound and its future gets task_canceled. The unwinding throws
+// boost::context::detail::forced_unwind through the body, a catch (...) in there has to rethrow it.
+struct coroutine_context
+    : boost::noncopyable
+{
+    static const size_t default_stack_size = 64 * 1024;
+
+    virtual ~coroutine_context()
+    {}
+
+public:
+    threadpool &pool() const
+    {
+        return pool_;
+    }
+
+    // canceled through the coroutine's token, or the pool canceled the part of it running now
+    bool cancellation_requested() const
+    {
+        return token_.is_canceled() || threadpool::cancellation_requested();
+    }
+
+    // to the back of the queue, lets the other tasks run
+    void yield()
+    {
+        suspend([](const coroutine_ptr &self) { resume_later(self); });
+    }
+
+    // schedule_after, so up to a timer tick late
+    void sleep(pt::time_duration duration)
+    {
+        suspend([duration](const coroutine_ptr &self)
+        {
+            try
+            {
+                self->pool_.schedule_after(duration, coroutine_step(self), self->priority_);
+            }
+            catch (pool_stopped &)
+            {
+            }
+        });
+    }
+
+    // the future's value, or its exception rethrown
+    template<typename R>
+    R await(const task_future<R> &future)
+    {
+        if (!future.is_ready())
+        {
+            suspend([future](const coroutine_ptr &self)
+            {
+                future.on_ready([self]() { resume_later(self); });
+            });
+        }
+
+        return future.get();
+    }
+
+#if !defined(_WIN32)
+    // until fd is readable, or has an error or a hangup, through the pool's reactor()
+    void await_readable(int fd)
+    {
+        await_io(fd, POLLIN);
+    }
+
+    void await_writable(int fd)
+    {
+        await_io(fd, POLLOUT);
+    }
+#endif
+
+protected:
+    coroutine_context(threadpool &pool, const cancellation_token &token, threadpool::priority_t priority,
+                      size_t stack_size)
+        : pool_(pool)
+        , token_(token)
+        , priority_(priority)
+        , stack_size_(stack_size)
+        , started_(false)
+        , interrupted_(false)
+    {}
+
+    // the body, on the coroutine's stack
+    virtual void run() = 0;
+
+    static void start(const shared_ptr<coroutine_context> &self)
+    {
+        self->pool_.add_task(coroutine_step(self), self->token_, self->priority_);
+    }
+
+    // unwinds the stack of a suspended coroutine, before the derived part it runs in goes away
+    void unwind()
+    {
+        coro_ = continuation_t();
+    }
+
+    // the body got a thread_interrupted, the pool sees it once the coroutine is off the thread
+    void set_interrupted()
+    {
+        interrupted_ = true;
+    }
+
+private:
+    typedef shared_ptr<coroutine_context> coroutine_ptr;
+    typedef boost::context::continuation continuation_t;
+    // how a suspended coroutine gets resumed, called by the worker once the coroutine is off its stack
+    typedef boost::function<void(const coroutine_ptr &)> wake_t;
+
+    // one stretch of the coroutine, from a wait to the next one
+    struct coroutine_step
+    {
+        explicit coroutine_step(const coroutine_ptr &self)
+            : self(self)
+        {}
+
+        void operator()()
+        {
+            self->resume(self);
+        }
+
+        coroutine_ptr self;
+    };
+
+    // a draining pool takes no more, the coroutine is dropped along with the last reference to it
+    static void resume_later(const coroutine_ptr &self)
+    {
+        try
+        {
+            self->pool_.add_task(coroutine_step(self), self->token_, self->priority_);
+        }
+        catch (pool_stopped &)
+        {
+        }
+    }
+
+#if !defined(_WIN32)
+    void await_io(int fd, short events)
+    {
+        suspend([fd, events](const coroutine_ptr &self)
+        {
+            self->pool_.reactor().wait(fd, events, [self]() { resume_later(self); });
+        });
+    }
+#endif
+
+    // on the coroutine's stack: back to the worker, which calls wake
+    void suspend(const wake_t &wake)
+    {
+        MY_ASSERT(wake_.empty());
+        wake_ = wake;
+        caller_ = std::move(caller_).resume();
+    }
+
+    // on a worker: runs the coroutine up to its next wait or its end
+    void resume(const coroutine_ptr &self)
+    {
+        // the stack is unwound when the last reference goes
+        if (token_.is_canceled())
+            return;
+
+        if (started_)
+        {
+            coro_ = std::move(coro_).resume();
+        }
+        else
+        {
+            started_ = true;
+            coro_ = boost::context::callcc(std::allocator_arg, boost::context::protected_fixedsize_stack(stack_size_),
+                [this](continuation_t &&caller)
+                {
+                    caller_ = std::move(caller);
+                    run();
+                    return std::move(caller_);
+                });
+        }
+
+        if (interrupted_)
+        {
+            interrupted_ = false;
+            throw boost::thread_interrupted();
+        }
+
+        // whoever resumes the coroutine from here on may do it right away, on another thread
+        if (!wake_.empty())
+        {
+            wake_t wake;
+            wake.swap(wake_);
+            wake(self);
+        }
+    }
+
+private:
+    threadpool &pool_;
+    const cancellation_token token_;
+    const threadpool::priority_t priority_;
+    const size_t stack_size_;
+
+    // the suspended coroutine, seen from the worker
+    continuation_t coro_;
+    // the worker, seen from the running coroutine
+    continuation_t caller_;
+    wake_t wake_;
+    bool started_;
+    bool interrupted_;
+};
+
+template<typename R, typename F>
+struct coroutine_impl
+    : coroutine_context
+{
+    coroutine_impl(threadpool &pool, const cancellation_token &token, threadpool::priority_t priority,
+                   size_t stack_size, const shared_ptr<future_state<R>> &state, const F &f)
+        : coroutine_context(pool, token, priority, stack_size)
+        , state_(state)
+        , f_(f)
+        , done_(false)
+    {}
+
+    // never resumed, or never started at all. May run on the thread draining the pool, the continuations
+    // of the future don't throw pool_stopped from here (see task_future::then)
+    ~coroutine_impl()
+    {
+        unwind();
+
+        if (!done_)
+            state_->set_exception(boost::copy_exception(task_canceled()));
+    }
+
+    static void spawn(const shared_ptr<coroutine_impl> &self)
+    {
+        coroutine_context::start(self);
+    }
+
+private:
+    void run()
+    {
+        coroutine_context &self = *this;
+        F &f = f_;
+        auto call = [&self, &f]() { return f(self); };
+
+        // the state is made ready outside the try, see future_promise::run
+        optional<typename future_traits<R>::value_type> value;
+        boost::exception_ptr error;
+        try
+        {
+            value = future_traits<R>::invoke(call);
+        }
+        catch (boost::context::detail::forced_unwind const&)
+        {
+            throw;
+        }
+        catch (boost::thread_interrupted const&)
+        {
+            error = boost::copy_exception(task_canceled());
+            set_interrupted();
+        }
+        catch (...)
+        {
+            error = boost::current_exception();
+        }
+
+        done_ = true;
+        if (error)
+            state_->set_exception(error);
+        else
+            state_->set_value(*value);
+    }
+
+private:
+    shared_ptr<future_state<R>> state_;
+    F f_;
+    bool done_;
+};
+
+// Runs f(coroutine_context &) as a coroutine on the pool, see coroutine_context. Its result (or exception) comes
+// back through the future. Canceling the token drops the coroutine at its next wait, or before it starts.
+// Throws pool_stopped like add_task.
+template<typename F>
+task_future<typename boost::result_of<F(coroutine_context &)>::type>
+spawn_coroutine(threadpool &pool, F f, const cancellation_token &token = cancellation_token(),
+                threadpool::priority_t priority = threadpool::PRIORITY_NORMAL,
+                size_t stack_size = coroutine_context::default_stack_size)
+{
+    typedef typename boost::result_of<F(coroutine_context &)>::type result_t;
+    typedef coroutine_impl<result_t, F> impl_t;
+
+    auto state = boost::make_shared<future_state<result_t>>(&pool);
+    impl_t::spawn(boost::make_shared<impl_t>(pool, token, priority, stack_size, state, f));
+    return task_future<result_t>(state);
+}
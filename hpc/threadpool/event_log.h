@@ -0,0 +1,308 @@
+#pragma once
+
+extern boost::mutex cout_mutex;
+
+// Asynchronous event log.
+// record() copies a fixed-size event into a single-producer ring of the calling thread, which is
+// a handful of plain stores, no locks and no I/O. A background thread drains all the rings every
+// few milliseconds and writes the events out, either as text (through the formatter, under cout_mutex)
+// or as raw records to a binary file. If a ring is full the event is dropped and counted.
+//
+// Binary file layout: a sequence of log_event_t records in native byte order, 32 bytes each,
+// see log_event_t for the fields.
+struct log_event_t
+{
+    uint64_t time_ns; // steady clock
+    uint32_t type;    // defined by the owner of the log
+    uint32_t flags;   // defined by the owner of the log
+    uint64_t a, b;    // arguments
+};
+
+struct event_log
+    : boost::noncopyable
+{
+    enum log_level_t
+    {
+        LOG_NONE,
+        // thread lifecycle
+        LOG_THREADS,
+        // thread lifecycle and every task
+        LOG_TASKS
+    };
+
+    typedef boost::function<void(std::ostream &, const log_event_t &)> formatter_t;
+
+    static const size_t ring_capacity = 4096;
+
+    event_log(log_level_t level, std::ostream &text_out, const formatter_t &formatter)
+        : id_(next_log_id())
+        , level_(level)
+        , dropped_(0)
+        , text_out_(&text_out)
+        , formatter_(formatter)
+        , stop_(false)
+    {
+        drain_thread_ = boost::thread(boost::bind(&event_log::drain_run, this));
+    }
+
+    ~event_log()
+    {
+        stop();
+
+        BOOST_FOREACH(ring_t *r, rings_)
+            delete r;
+    }
+
+public:
+    bool enabled(log_level_t level) const
+    {
+        return level <= level_.load(memory_order_relaxed);
+    }
+
+    void set_level(log_level_t level)
+    {
+        level_ = level;
+    }
+
+    log_level_t level() const
+    {
+        return log_level_t(level_.load());
+    }
+
+    void record(log_level_t level, uint32_t type, uint64_t a, uint64_t b = 0, uint32_t flags = 0)
+    {
+        if (!enabled(level))
+            return;
+
+        const log_event_t e =
+        {
+            uint64_t(boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+                boost::chrono::steady_clock::now().time_since_epoch()).count()),
+            type, flags, a, b
+        };
+
+        if (!thread_ring().push(e))
+            ++dropped_;
+    }
+
+    // binary records to the file from now on, false if it can't be opened
+    bool set_binary_output(const string &path)
+    {
+        auto file = boost::make_shared<std::ofstream>(path.c_str(), std::ios::binary | std::ios::trunc);
+        if (!*file)
+            return false;
+
+        flush();
+        mutex_lock_t lock(drain_mutex_);
+        binary_out_ = file;
+        return true;
+    }
+
+    void set_text_output()
+    {
+        flush();
+        mutex_lock_t lock(drain_mutex_);
+        binary_out_.reset();
+    }
+
+    // the calling thread won't log any more, its ring goes away once drained
+    void retire_thread()
+    {
+        thread_state_t *t = thread_state_.get();
+        if (t && t->log_id == id_)
+        {
+            t->ring->retired = true;
+            thread_state_.reset();
+        }
+    }
+
+    // writes out everything recorded so far
+    void flush()
+    {
+        mutex_lock_t lock(drain_mutex_);
+        drain();
+    }
+
+    // stops the drain thread after writing everything out, record() still works but nobody drains
+    void stop()
+    {
+        {
+            mutex_lock_t lock(drain_mutex_);
+            if (stop_)
+                return;
+
+            stop_ = true;
+        }
+        drain_cond_.notify_all();
+        drain_thread_.join();
+
+        flush();
+
+        if (dropped_ != 0 && !binary_out_)
+        {
+            boost::mutex::scoped_lock l(cout_mutex);
+            *text_out_ << dropped_ << " log events dropped" << endl;
+        }
+    }
+
+    size_t dropped() const
+    {
+        return dropped_;
+    }
+
+private:
+    // single producer (the owner thread), single consumer (whoever holds drain_mutex_)
+    struct ring_t
+        : boost::noncopyable
+    {
+        ring_t()
+            : events(new log_event_t[ring_capacity])
+            , head(0)
+            , tail(0)
+            , retired(false)
+        {}
+
+        bool push(const log_event_t &e)
+        {
+            const size_t h = head.load(memory_order_relaxed);
+            if (h - tail.load(memory_order_acquire) == ring_capacity)
+                return false;
+
+            events[h % ring_capacity] = e;
+            head.store(h + 1, memory_order_release);
+            return true;
+        }
+
+        template<typename F>
+        void pop_all(F f)
+        {
+            const size_t h = head.load(memory_order_acquire);
+            size_t t = tail.load(memory_order_relaxed);
+            for (; t != h; ++t)
+                f(events[t % ring_capacity]);
+
+            tail.store(t, memory_order_release);
+        }
+
+        boost::scoped_array<log_event_t> events;
+        atomic<size_t> head;
+        atomic<size_t> tail;
+        atomic_bool retired;
+    };
+
+    // belongs to the thread, may outlive the log, log_id tells if it's still ours
+    struct thread_state_t
+    {
+        uint64_t log_id;
+        ring_t *ring;
+    };
+
+    typedef boost::mutex mutex_t;
+    typedef boost::mutex::scoped_lock mutex_lock_t;
+
+    ring_t &thread_ring()
+    {
+        thread_state_t *t = thread_state_.get();
+        if (!t || t->log_id != id_)
+        {
+            ring_t *r = new ring_t();
+            {
+                mutex_lock_t lock(rings_mutex_);
+                rings_.push_back(r);
+            }
+
+            t = new thread_state_t();
+            t->log_id = id_;
+            t->ring = r;
+            thread_state_.reset(t);
+        }
+        return *t->ring;
+    }
+
+    void drain_run()
+    {
+        mutex_lock_t lock(drain_mutex_);
+        while (!stop_)
+        {
+            drain_cond_.timed_wait(lock, pt::milliseconds(10));
+            drain();
+        }
+    }
+
+    // requires drain_mutex_
+    void drain()
+    {
+        vector<ring_t *> rings;
+        {
+            mutex_lock_t lock(rings_mutex_);
+            rings = rings_;
+        }
+
+        batch_.clear();
+        BOOST_FOREACH(ring_t *r, rings)
+        {
+            // retired before draining: nothing gets pushed after this check
+            const bool retired = r->retired;
+            r->pop_all([this](const log_event_t &e)
+            {
+                batch_.push_back(e);
+            });
+
+            if (retired)
+            {
+                mutex_lock_t lock(rings_mutex_);
+                rings_.erase(std::find(rings_.begin(), rings_.end(), r));
+                delete r;
+            }
+        }
+
+        if (batch_.empty())
+            return;
+
+        // rings are drained one by one, restore the global order
+        boost::sort(batch_, [](const log_event_t &e1, const log_event_t &e2)
+        {
+            return e1.time_ns < e2.time_ns;
+        });
+
+        if (binary_out_)
+        {
+            binary_out_->write(reinterpret_cast<const char *>(&batch_[0]), batch_.size() * sizeof(log_event_t));
+            binary_out_->flush();
+        }
+        else
+        {
+            boost::mutex::scoped_lock l(cout_mutex);
+            BOOST_FOREACH(const log_event_t &e, batch_)
+                formatter_(*text_out_, e);
+            text_out_->flush();
+        }
+    }
+
+    static uint64_t next_log_id()
+    {
+        static atomic<uint64_t> id(0);
+        return ++id;
+    }
+
+private:
+    const uint64_t id_;
+    atomic<int> level_;
+    atomic<size_t> dropped_;
+
+    boost::thread_specific_ptr<thread_state_t> thread_state_;
+
+    mutex_t rings_mutex_;
+    vector<ring_t *> rings_;
+
+    // guards the outputs, batch_ and stop_
+    mutex_t drain_mutex_;
+    boost::condition_variable drain_cond_;
+    std::ostream *text_out_;
+    shared_ptr<std::ofstream> binary_out_;
+    formatter_t formatter_;
+    vector<log_event_t> batch_;
+    bool stop_;
+
+    boost::thread drain_thread_;
+};
@@ -0,0 +1,169 @@
+#pragma once
+
+#if !defined(_WIN32)
+
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Calls back when file descriptors get ready. One thread poll()s every descriptor waited for, a pipe wakes it
+// up when a wait is added. A wait is one-shot: its callback runs once, on the reactor thread, as soon as the
+// descriptor is ready for any of the events or has an error or a hangup. Callbacks should be quick, hand the work
+// over to a pool rather than do it. poll is O(waits) per wakeup, fine for the thousands of descriptors of
+// coroutines waiting for I/O, not for a server with a hundred thousand connections.
+struct io_reactor
+    : boost::noncopyable
+{
+    typedef boost::function<void()> callback_t;
+
+    io_reactor()
+        : next_wait_id_(0)
+        , stop_(false)
+    {
+        if (pipe(wake_pipe_) != 0)
+            throw std::runtime_error("io_reactor: can't create the wake-up pipe");
+
+        for (size_t i = 0; i < 2; ++i)
+            fcntl(wake_pipe_[i], F_SETFL, fcntl(wake_pipe_[i], F_GETFL) | O_NONBLOCK);
+
+        thread_ = boost::thread(boost::bind(&io_reactor::run, this));
+    }
+
+    // the callbacks of the pending waits are destroyed without being called
+    ~io_reactor()
+    {
+        {
+            mutex_lock_t lock(mutex_);
+            stop_ = true;
+        }
+        wake();
+        thread_.join();
+
+        close(wake_pipe_[0]);
+        close(wake_pipe_[1]);
+    }
+
+public:
+    // events of poll(), POLLIN and/or POLLOUT
+    void wait(int fd, short events, const callback_t &callback)
+    {
+        {
+            mutex_lock_t lock(mutex_);
+            waits_.insert(make_pair(next_wait_id_++, wait_t(fd, events, callback)));
+        }
+        wake();
+    }
+
+    // drops every pending wait without calling back, returns how many there were
+    size_t clear()
+    {
+        map<uint64_t, wait_t> waits;
+        {
+            mutex_lock_t lock(mutex_);
+            waits.swap(waits_);
+        }
+
+        // the callbacks are destroyed outside of the lock, they may hold anything
+        return waits.size();
+    }
+
+    size_t size()
+    {
+        mutex_lock_t lock(mutex_);
+        return waits_.size();
+    }
+
+private:
+    typedef boost::mutex::scoped_lock mutex_lock_t;
+
+    struct wait_t
+    {
+        wait_t(int fd, short events, const callback_t &callback)
+            : fd(fd)
+            , events(events)
+            , callback(callback)
+        {}
+
+        int fd;
+        short events;
+        callback_t callback;
+    };
+
+    void wake()
+    {
+        // a full pipe wakes the thread up just as well
+        const char c = 0;
+        if (write(wake_pipe_[1], &c, 1) < 0)
+        {
+        }
+    }
+
+    // the waits are polled from a copy, so the ones added or cleared meanwhile are matched by id afterwards
+    void run()
+    {
+        vector<pollfd> fds;
+        vector<uint64_t> ids;
+        vector<callback_t> ready;
+
+        mutex_lock_t lock(mutex_);
+        while (!stop_)
+        {
+            fds.clear();
+            ids.clear();
+
+            const pollfd wake_fd = { wake_pipe_[0], POLLIN, 0 };
+            fds.push_back(wake_fd);
+            BOOST_FOREACH(const auto &w, waits_)
+            {
+                const pollfd fd = { w.second.fd, w.second.events, 0 };
+                fds.push_back(fd);
+                ids.push_back(w.first);
+            }
+
+            lock.unlock();
+            const int n = poll(&fds[0], nfds_t(fds.size()), -1);
+            if (n > 0 && fds[0].revents != 0)
+            {
+                char buf[64];
+                while (read(wake_pipe_[0], buf, sizeof(buf)) > 0)
+                {
+                }
+            }
+            lock.lock();
+
+            for (size_t i = 1; n > 0 && i < fds.size(); ++i)
+            {
+                if (fds[i].revents == 0)
+                    continue;
+
+                auto it = waits_.find(ids[i - 1]);
+                if (it == waits_.end())
+                    continue;
+
+                ready.push_back(it->second.callback);
+                waits_.erase(it);
+            }
+
+            if (ready.empty())
+                continue;
+
+            lock.unlock();
+            BOOST_FOREACH(const callback_t &callback, ready)
+                callback();
+            ready.clear();
+            lock.lock();
+        }
+    }
+
+private:
+    int wake_pipe_[2];
+    boost::thread thread_;
+
+    boost::mutex mutex_;
+    // guarded by mutex_
+    map<uint64_t, wait_t> waits_;
+    uint64_t next_wait_id_;
+    bool stop_;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#pragma once
+
+inline uint64_t steady_clock_ns()
+{
+    return uint64_t(boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+        boost::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// HDR-style histogram of nanosecond values.
+// Every power of two is split into sub_bucket_count linear buckets, so any value is known to within
+// 1/sub_bucket_count (~3%) whatever its magnitude, and the whole range of uint64_t fits in a fixed array.
+// record() is a couple of relaxed increments, meant to be called by one owner thread, while snapshots
+// can be taken from any thread at any time.
+struct latency_histogram
+    : boost::noncopyable
+{
+    static const size_t sub_bucket_bits = 5;
+    static const size_t sub_bucket_count = size_t(1) << sub_bucket_bits;
+    static const size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_bucket_count;
+
+    // plain copy of one or more histograms
+    struct snapshot_t
+    {
+        snapshot_t()
+            : counts(bucket_count)
+            , count(0)
+            , sum(0)
+            , max(0)
+        {}
+
+        // the smallest bucket upper bound with at least p (0..1) of the values at or below it
+        uint64_t percentile(double p) const
+        {
+            if (count == 0)
+                return 0;
+
+            const uint64_t rank = std::max<uint64_t>(1, uint64_t(p * count + 0.5));
+            uint64_t seen = 0;
+            for (size_t b = 0; b < bucket_count; ++b)
+            {
+                seen += counts[b];
+                if (seen >= rank)
+                    return std::min(bucket_upper(b), max);
+            }
+            return max;
+        }
+
+        uint64_t mean() const
+        {
+            return count ? sum / count : 0;
+        }
+
+        vector<uint64_t> counts;
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+    };
+
+    latency_histogram()
+        : counts_(new atomic<uint64_t>[bucket_count])
+        , count_(0)
+        , sum_(0)
+        , max_(0)
+    {
+        for (size_t b = 0; b < bucket_count; ++b)
+            counts_[b].store(0, memory_order_relaxed);
+    }
+
+public:
+    void record(uint64_t value)
+    {
+        counts_[bucket_of(value)].fetch_add(1, memory_order_relaxed);
+        count_.fetch_add(1, memory_order_relaxed);
+        sum_.fetch_add(value, memory_order_relaxed);
+
+        if (value > max_.load(memory_order_relaxed))
+            max_.store(value, memory_order_relaxed);
+    }
+
+    // adds this histogram to s
+    void add_to(snapshot_t &s) const
+    {
+        for (size_t b = 0; b < bucket_count; ++b)
+            s.counts[b] += counts_[b].load(memory_order_relaxed);
+
+        s.count += count_.load(memory_order_relaxed);
+        s.sum += sum_.load(memory_order_relaxed);
+        s.max = std::max<uint64_t>(s.max, max_.load(memory_order_relaxed));
+    }
+
+    static size_t bucket_of(uint64_t value)
+    {
+        if (value < sub_bucket_count)
+            return size_t(value);
+
+        // value >> shift lands in [sub_bucket_count, 2 * sub_bucket_count)
+        const size_t shift = highest_bit(value) - sub_bucket_bits;
+        return (shift + 1) * sub_bucket_count + size_t(value >> shift) - sub_bucket_count;
+    }
+
+    // the largest value that goes to bucket b
+    static uint64_t bucket_upper(size_t b)
+    {
+        if (b < 2 * sub_bucket_count)
+            return b;
+
+        const size_t shift = b / sub_bucket_count - 1;
+        const uint64_t top = b % sub_bucket_count + sub_bucket_count;
+        return ((top + 1) << shift) - 1;
+    }
+
+private:
+    static size_t highest_bit(uint64_t value)
+    {
+        size_t res = 0;
+        for (size_t step = 32; step != 0; step /= 2)
+        {
+            if (value >> step)
+            {
+                value >>= step;
+                res += step;
+            }
+        }
+        return res;
+    }
+
+private:
+    boost::scoped_array<atomic<uint64_t>> counts_;
+    atomic<uint64_t> count_;
+    atomic<uint64_t> sum_;
+    atomic<uint64_t> max_;
+};
@@ -2,62 +2,425 @@
 #include "threadpool.h"
 
 #include <signal.h>
+#include <cstdio>
+
+#if !defined(_WIN32)
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
 
 boost::scoped_ptr<threadpool> pool;
 boost::mutex cout_mutex;
 
+// how long Ctrl-C, kill and the end of the input give the queued tasks
+const pt::time_duration shutdown_deadline = pt::seconds(5);
+
 struct args_t
 {
     size_t num_hot_threads;
     pt::time_duration timeout;
+    threadpool::scheduling_t scheduling;
+    size_t max_threads;
+    // the tasks a drain drops are saved there, and added again by the next run
+    optional<string> checkpoint;
 };
 
 optional<args_t> parse_args(int argc, char* argv[])
 {
     args_t res;
     bool error = true;
+
+    vector<string> args;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (string(argv[i]) == "--checkpoint" && i + 1 < argc)
+            res.checkpoint = string(argv[++i]);
+        else
+            args.push_back(argv[i]);
+    }
     
-    if (argc == 3)
+    if (args.size() >= 2 && args.size() <= 4)
     {
         try
         {
-            res.num_hot_threads = boost::lexical_cast<size_t>(argv[1]);
-            res.timeout = pt::seconds(boost::lexical_cast<size_t>(argv[2]));
+            res.num_hot_threads = boost::lexical_cast<size_t>(args[0]);
+            res.timeout = pt::seconds(boost::lexical_cast<size_t>(args[1]));
+            res.scheduling = threadpool::SINGLE_QUEUE;
+            res.max_threads = size_t(-1);
             error = false;
+
+            if (args.size() >= 3)
+            {
+                const string &scheduling = args[2];
+                if (scheduling == "stealing")
+                    res.scheduling = threadpool::WORK_STEALING;
+                else if (scheduling == "lockfree")
+                    res.scheduling = threadpool::LOCK_FREE_QUEUE;
+                else if (scheduling != "single")
+                    error = true;
+            }
+
+            if (args.size() == 4)
+                res.max_threads = boost::lexical_cast<size_t>(args[3]);
         }
         catch (boost::bad_lexical_cast &) {}
     }
 
     if (error)
     {
-        cout << "Usage: program num_hot_threads timeout" << endl;
+        cout << "Usage: program num_hot_threads timeout [single|stealing|lockfree [max_threads]] [--checkpoint file]" << endl;
         return boost::none;
     }
     return res;
 }
 
-void sig_handler(int /*signum*/)
+// add seconds... [low|normal|high]
+optional<threadpool::priority_t> parse_priority(const string &s)
+{
+    if (s == "low")
+        return threadpool::PRIORITY_LOW;
+    if (s == "normal")
+        return threadpool::PRIORITY_NORMAL;
+    if (s == "high")
+        return threadpool::PRIORITY_HIGH;
+
+    return boost::none;
+}
+
+const char *priority_name(threadpool::priority_t priority)
+{
+    switch (priority)
+    {
+    case threadpool::PRIORITY_LOW:
+        return "low";
+    case threadpool::PRIORITY_HIGH:
+        return "high";
+    default:
+        return "normal";
+    }
+}
+
+// Checkpoint file, a header line and then a line per task:
+//  task <priority> <seconds>
+//  timer <priority> <seconds> <delay ms> <period ms, 0 for "after">
+const char checkpoint_header[] = "threadpool checkpoint 1";
+
+// the sleep tasks among the dropped ones, returns how many were saved.
+// Written to a temporary file first, so a crash never leaves half a checkpoint behind
+size_t save_checkpoint(const string &file, vector<threadpool::dropped_task_t> &dropped)
+{
+    const string tmp = file + ".tmp";
+    size_t saved = 0;
+    {
+        std::ofstream out(tmp.c_str());
+        out << checkpoint_header << "\n";
+
+        BOOST_FOREACH(threadpool::dropped_task_t &t, dropped)
+        {
+            const sleep_task *task = t.task.target<sleep_task>();
+            if (!task)
+                continue;
+
+            const int64_t seconds = task->duration().total_seconds();
+            if (t.period == pt::time_duration() && t.delay == pt::time_duration())
+                out << "task " << priority_name(t.priority) << " " << seconds << "\n";
+            else
+                out << "timer " << priority_name(t.priority) << " " << seconds << " "
+                    << t.delay.total_milliseconds() << " " << t.period.total_milliseconds() << "\n";
+            ++saved;
+        }
+
+        if (!out.flush())
+            return 0;
+    }
+
+    std::remove(file.c_str());
+    return std::rename(tmp.c_str(), file.c_str()) == 0 ? saved : 0;
+}
+
+// adds the tasks of a checkpoint and deletes it, they're the pool's now. Returns how many were added
+size_t load_checkpoint(const string &file)
 {
+    std::ifstream in(file.c_str());
+    string line;
+    if (!std::getline(in, line) || line != checkpoint_header)
+        return 0;
+
+    size_t loaded = 0;
+    while (std::getline(in, line))
+    {
+        vector<string> parts;
+        boost::split(parts, line, boost::is_space());
+
+        try
+        {
+            const auto priority = parse_priority(parts.at(1));
+            if (!priority)
+                continue;
+
+            const sleep_task task(boost::lexical_cast<int>(parts.at(2)));
+            if (parts.at(0) == "task" && parts.size() == 3)
+            {
+                pool->add_task(task, *priority);
+            }
+            else if (parts.at(0) == "timer" && parts.size() == 5)
+            {
+                // a periodic task loses its phase, it's next due a period from now
+                const auto delay = pt::milliseconds(boost::lexical_cast<int64_t>(parts.at(3)));
+                const auto period = pt::milliseconds(boost::lexical_cast<int64_t>(parts.at(4)));
+                if (period == pt::time_duration())
+                    pool->schedule_after(delay, task, *priority);
+                else
+                    pool->schedule_every(period, task, *priority);
+            }
+            else
+                continue;
+
+            ++loaded;
+        }
+        catch (boost::bad_lexical_cast &) {}
+        catch (std::out_of_range &) {}
+    }
+
+    in.close();
+    std::remove(file.c_str());
+    return loaded;
+}
+
+void print_latency(const char *name, const latency_histogram::snapshot_t &h)
+{
+    const double us = 1000.;
+    cout << name << " (us): count " << h.count
+         << ", mean " << h.mean() / us
+         << ", p50 " << h.percentile(0.5) / us
+         << ", p99 " << h.percentile(0.99) / us
+         << ", p999 " << h.percentile(0.999) / us
+         << ", max " << h.max / us << endl;
+}
+
+void print_stats(const threadpool::stats_t &s)
+{
+    cout << "Threads: " << s.hot_threads << " hot, " << s.worker_threads << " worker ("
+         << s.workers_created << " created, " << s.workers_expired << " expired)" << endl;
+    cout << "Tasks: " << s.tasks_added << " added, " << s.tasks_started << " started, "
+         << s.tasks_finished << " finished, " << s.tasks_interrupted << " interrupted, "
+         << s.tasks_removed << " removed from queue, " << s.queue_depth << " queued, "
+         << s.timers << " timers" << endl;
+    cout << "Tasks run: " << s.tasks_on_hot_threads << " on hot threads, "
+         << s.tasks_on_worker_threads << " on worker threads" << endl;
+    print_latency("Queue latency", s.queue_latency);
+    print_latency("Service time", s.service_time);
+}
+
+// the tasks of an "add N M ..." command, first_id .. first_id + count - 1, and the group to cancel them with
+struct batch_t
+{
+    size_t count;
+    cancellation_token token;
+    // the tasks before this one have all finished
+    size_t finished;
+};
+
+typedef map<threadpool::task_id_t, batch_t> batches_t;
+
+// the batch task_id is in, or batches.end()
+batches_t::iterator find_batch(batches_t &batches, threadpool::task_id_t task_id)
+{
+    auto it = batches.upper_bound(task_id);
+    if (it == batches.begin())
+        return batches.end();
+
+    --it;
+    return task_id - it->first < it->second.count ? it : batches.end();
+}
+
+// forgets the batches whose tasks have all finished, the tasks are checked in order, each one until it has
+void forget_finished_batches(batches_t &batches)
+{
+    for (auto it = batches.begin(); it != batches.end(); )
+    {
+        batch_t &batch = it->second;
+        while (batch.finished < batch.count && !pool->is_pending(it->first + batch.finished))
+            ++batch.finished;
+
+        if (batch.finished == batch.count)
+            batches.erase(it++);
+        else
+            ++it;
+    }
+}
+
+// drains the pool, saves what it dropped and destroys it
+void shutdown(pt::time_duration deadline, const optional<string> &checkpoint)
+{
+    vector<threadpool::dropped_task_t> dropped;
+    const auto res = pool->drain(deadline, &dropped);
+    const size_t saved = checkpoint ? save_checkpoint(*checkpoint, dropped) : 0;
+
+    {
+        boost::mutex::scoped_lock l(cout_mutex);
+        cout << "Drained" << (res.complete ? "" : " (deadline passed)") << ": " << res.tasks_finished << " finished, "
+             << res.tasks_interrupted << " interrupted, " << res.tasks_dropped << " dropped";
+        if (checkpoint)
+            cout << ", " << saved << " saved to " << *checkpoint;
+        cout << endl;
+
+        if (!dropped.empty())
+        {
+            cout << "Dropped task ids:";
+            BOOST_FOREACH(const threadpool::dropped_task_t &t, dropped)
+                cout << " " << t.id;
+            cout << endl;
+        }
+    }
+
+    // the dropped tasks go before the pool, in case they reference it
+    dropped.clear();
     pool.reset();
-    exit(0);
 }
 
-int main(int argc, char* argv[])
+// The handler only sets the flag (and wakes the main loop up), anything more (locks, allocations, the pool's
+// destructor) isn't async-signal-safe. The main loop drains the pool once it sees the flag.
+volatile sig_atomic_t stop_requested = 0;
+
+#if !defined(_WIN32)
+// The self-pipe: the handler writes a byte to it and the main loop polls it along with stdin, so a signal
+// that comes just before the loop waits for input still wakes it up, whichever thread gets it
+int stop_pipe[2] = { -1, -1 };
+
+// what stdin has given past the last whole line
+string pending_input;
+#endif
+
+void sig_handler(int)
+{
+    stop_requested = 1;
+
+#if !defined(_WIN32)
+    const int saved_errno = errno;
+    const char c = 0;
+    // a full pipe has a wakeup in it already
+    if (write(stop_pipe[1], &c, 1) < 0) {}
+    errno = saved_errno;
+#endif
+}
+
+void install_sig_handler()
 {
+#if defined(_WIN32)
     signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+#else
+    if (pipe(stop_pipe) == 0)
+    {
+        for (size_t i = 0; i < 2; ++i)
+        {
+            fcntl(stop_pipe[i], F_SETFL, fcntl(stop_pipe[i], F_GETFL) | O_NONBLOCK);
+            fcntl(stop_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = sig_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+#endif
+}
+
+// The next line of the input, false on Ctrl-C, kill or the end of the input
+#if defined(_WIN32)
+bool read_command(string &cmd)
+{
+    // the console runs the handler on a thread of its own, and the read fails
+    return !stop_requested && std::getline(std::cin, cmd) && !stop_requested;
+}
+#else
+// stdin is read here rather than through cin, whose buffer could hold lines poll doesn't know about
+bool read_command(string &cmd)
+{
+    for (;;)
+    {
+        if (stop_requested)
+            return false;
+
+        const size_t eol = pending_input.find('\n');
+        if (eol != string::npos)
+        {
+            cmd = pending_input.substr(0, eol);
+            pending_input.erase(0, eol + 1);
+            return true;
+        }
+
+        pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { stop_pipe[0], POLLIN, 0 } };
+        if (poll(fds, stop_pipe[0] < 0 ? 1 : 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // stop_requested is set before the pipe is written to
+        if (fds[1].revents != 0)
+            continue;
+
+        char buf[4096];
+        const ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+        {
+            // the end of the input, a last line may have no end of line
+            if (pending_input.empty())
+                return false;
+
+            cmd.swap(pending_input);
+            pending_input.clear();
+            return true;
+        }
+
+        pending_input.append(buf, size_t(n));
+    }
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    install_sig_handler();
 
     auto args = parse_args(argc, argv);
     if (!args)
         return 1;
 
-    pool.reset(new threadpool(args->num_hot_threads, args->timeout));
+    pool.reset(new threadpool(args->num_hot_threads,
+        make_shared<spawn_on_demand_policy>(args->timeout, args->max_threads), args->scheduling));
+
+    if (args->checkpoint)
+    {
+        const size_t resumed = load_checkpoint(*args->checkpoint);
+        if (resumed != 0)
+        {
+            boost::mutex::scoped_lock l(cout_mutex);
+            cout << "Resumed " << resumed << " tasks from " << *args->checkpoint << endl;
+        }
+    }
+
+    // by the first task id
+    batches_t batches;
 
     while (pool)
     {
         string cmd;
-        std::getline(std::cin, cmd);
-        if (!pool)
+        if (!read_command(cmd))
+        {
+            // Ctrl-C, kill or the end of the input
+            shutdown(shutdown_deadline, args->checkpoint);
             break;
+        }
 
         vector<string> parts;
 
@@ -68,10 +431,49 @@ int main(int argc, char* argv[])
         {
             try
             {
+                auto priority = threadpool::PRIORITY_NORMAL;
+                if (parts.at(0) == "add" && parts.size() > 2)
+                {
+                    if (auto p = parse_priority(parts.back()))
+                    {
+                        priority = *p;
+                        parts.pop_back();
+                    }
+                }
+
                 if (parts.at(0) == "add" && parts.size() == 2)
                 {
                     int seconds = boost::lexical_cast<int>(parts.at(1));
-                    auto task_id = pool->add_task(sleep_task(seconds));
+                    auto task_id = pool->add_task(sleep_task(seconds), priority);
+
+                    boost::mutex::scoped_lock l(cout_mutex);
+                    cout << "Task id: " << task_id << endl;
+                    error = false;
+                }
+                else if (parts.at(0) == "add" && parts.size() > 2)
+                {
+                    vector<sleep_task> tasks;
+                    for (size_t i = 1; i < parts.size(); ++i)
+                        tasks.push_back(sleep_task(boost::lexical_cast<int>(parts.at(i))));
+
+                    const auto token = cancellation_token::create();
+                    auto task_ids = pool->add_tasks(tasks, priority, token);
+
+                    forget_finished_batches(batches);
+                    const batch_t batch = { tasks.size(), token, 0 };
+                    batches[task_ids.front()] = batch;
+
+                    boost::mutex::scoped_lock l(cout_mutex);
+                    cout << "Task ids: " << task_ids.front() << ".." << task_ids.back() << endl;
+                    error = false;
+                }
+                else if ((parts.at(0) == "after" || parts.at(0) == "every") && parts.size() == 3)
+                {
+                    // after|every <ms> <seconds>
+                    auto delay = pt::milliseconds(boost::lexical_cast<int>(parts.at(1)));
+                    sleep_task task(boost::lexical_cast<int>(parts.at(2)));
+                    auto task_id = parts.at(0) == "after" ? pool->schedule_after(delay, task)
+                                                          : pool->schedule_every(delay, task);
 
                     boost::mutex::scoped_lock l(cout_mutex);
                     cout << "Task id: " << task_id << endl;
@@ -99,6 +501,76 @@ int main(int argc, char* argv[])
                     cout << endl;
                     error = false;
                 }
+                else if (parts.at(0) == "cancel" && parts.size() == 3 && parts.at(1) == "batch")
+                {
+                    // cancel batch <any task id of the batch>
+                    auto task_id = boost::lexical_cast<threadpool::task_id_t>(parts.at(2));
+                    auto it = find_batch(batches, task_id);
+                    if (it != batches.end())
+                    {
+                        const size_t removed = pool->cancel_group(it->second.token);
+
+                        boost::mutex::scoped_lock l(cout_mutex);
+                        cout << "Batch " << it->first << ": " << removed << " removed from queue" << endl;
+                        batches.erase(it);
+                        error = false;
+                    }
+                }
+                else if (parts.at(0) == "cancel" && parts.size() == 3)
+                {
+                    // cancel <first id> <last id>
+                    auto first = boost::lexical_cast<threadpool::task_id_t>(parts.at(1));
+                    auto last = boost::lexical_cast<threadpool::task_id_t>(parts.at(2));
+                    if (first <= last)
+                    {
+                        const size_t canceled = pool->cancel_tasks(boost::irange(first, last + 1));
+
+                        boost::mutex::scoped_lock l(cout_mutex);
+                        cout << "Tasks " << first << ".." << last << ": " << canceled << " canceled" << endl;
+                        error = false;
+                    }
+                }
+                else if (parts.at(0) == "log" && parts.size() == 2 && parts.at(1) != "binary")
+                {
+                    const string &mode = parts.at(1);
+                    error = false;
+
+                    if (mode == "none")
+                        pool->log().set_level(event_log::LOG_NONE);
+                    else if (mode == "threads")
+                        pool->log().set_level(event_log::LOG_THREADS);
+                    else if (mode == "tasks")
+                        pool->log().set_level(event_log::LOG_TASKS);
+                    else if (mode == "text")
+                        pool->log().set_text_output();
+                    else
+                        error = true;
+                }
+                else if (parts.at(0) == "log" && parts.size() == 3 && parts.at(1) == "binary")
+                {
+                    error = !pool->log().set_binary_output(parts.at(2));
+                }
+                else if (parts.at(0) == "affinity" && (parts.size() == 2 || parts.size() == 3))
+                {
+                    // affinity 0-3,8 [each]
+                    const bool each = parts.size() == 3 && parts.at(2) == "each";
+                    if (parts.size() == 2 || each)
+                        error = !pool->set_affinity(parse_cpu_list(parts.at(1)), each);
+                }
+                else if (parts.at(0) == "stats" && parts.size() == 1)
+                {
+                    const auto stats = pool->stats();
+
+                    boost::mutex::scoped_lock l(cout_mutex);
+                    print_stats(stats);
+                    error = false;
+                }
+                else if (parts.at(0) == "drain" && parts.size() == 2)
+                {
+                    // drain <ms>
+                    shutdown(pt::milliseconds(boost::lexical_cast<int>(parts.at(1))), args->checkpoint);
+                    error = false;
+                }
                 else if (parts.at(0) == "quit")
                 {
                     pool.reset();
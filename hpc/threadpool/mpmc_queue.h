@@ -0,0 +1,106 @@
+#pragma once
+
+// Bounded lock-free multi-producer/multi-consumer ring, D. Vyukov's algorithm.
+// Every cell carries a sequence number telling whether it's ready to be written (seq == pos)
+// or read (seq == pos + 1), so producers and consumers only contend on their own position counter.
+// T is copied with plain loads/stores, so it should be something small like a pointer.
+template<typename T>
+struct mpmc_queue
+    : boost::noncopyable
+{
+    explicit mpmc_queue(size_t log_capacity)
+        : mask_((size_t(1) << log_capacity) - 1)
+        , cells_(new cell_t[size_t(1) << log_capacity])
+        , enqueue_pos_(0)
+        , dequeue_pos_(0)
+    {
+        for (size_t i = 0; i <= mask_; ++i)
+            cells_[i].sequence.store(i, memory_order_relaxed);
+    }
+
+public:
+    // false if the queue is full
+    bool try_push(T item)
+    {
+        cell_t *cell;
+        size_t pos = enqueue_pos_.load(memory_order_relaxed);
+        for (;;)
+        {
+            cell = &cells_[pos & mask_];
+            const size_t seq = cell->sequence.load(memory_order_acquire);
+            const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+            if (diff == 0)
+            {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = enqueue_pos_.load(memory_order_relaxed);
+        }
+
+        cell->data = item;
+        cell->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    // boost::none if the queue is empty (or the head item isn't published yet)
+    optional<T> try_pop()
+    {
+        cell_t *cell;
+        size_t pos = dequeue_pos_.load(memory_order_relaxed);
+        for (;;)
+        {
+            cell = &cells_[pos & mask_];
+            const size_t seq = cell->sequence.load(memory_order_acquire);
+            const intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+
+            if (diff == 0)
+            {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return boost::none;
+            else
+                pos = dequeue_pos_.load(memory_order_relaxed);
+        }
+
+        const T item = cell->data;
+        cell->sequence.store(pos + mask_ + 1, memory_order_release);
+        return item;
+    }
+
+    // approximate if called concurrently with push/pop
+    bool empty() const
+    {
+        return enqueue_pos_.load(memory_order_seq_cst) <= dequeue_pos_.load(memory_order_seq_cst);
+    }
+
+    size_t capacity() const
+    {
+        return mask_ + 1;
+    }
+
+private:
+    struct cell_t
+    {
+        atomic<size_t> sequence;
+        T data;
+    };
+
+    // keep the hot counters on their own cache lines
+    typedef char cache_line_pad_t[64];
+
+private:
+    const size_t mask_;
+    boost::scoped_array<cell_t> cells_;
+
+    cache_line_pad_t pad0_;
+    atomic<size_t> enqueue_pos_;
+    cache_line_pad_t pad1_;
+    atomic<size_t> dequeue_pos_;
+    cache_line_pad_t pad2_;
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+// Fixed-size memory blocks for objects of type T.
+// Memory is carved from chunks that live as long as the pool. Every thread keeps its own cache of free
+// blocks, full batches go through a mutex-guarded depot, so a thread that only frees (a worker) feeds
+// a thread that only allocates (a producer) without taking the lock on every block.
+// allocate/deallocate hand out raw memory, construct and destroy the objects in place.
+template<typename T>
+struct node_pool
+    : boost::noncopyable
+{
+    static const size_t batch_size = 64;
+
+    node_pool()
+        : id_(next_pool_id())
+    {}
+
+    ~node_pool()
+    {
+        BOOST_FOREACH(block_t *chunk, chunks_)
+            delete [] chunk;
+    }
+
+public:
+    void *allocate()
+    {
+        cache_t &c = cache();
+        if (!c.head)
+            refill(c);
+
+        block_t *b = c.head;
+        c.head = b->next;
+        --c.count;
+        return b;
+    }
+
+    void deallocate(void *p)
+    {
+        cache_t &c = cache();
+        block_t *b = static_cast<block_t *>(p);
+        b->next = c.head;
+        c.head = b;
+        ++c.count;
+
+        if (c.count >= 2 * batch_size)
+            give_batch(c, batch_size);
+    }
+
+    // gives everything cached by the calling thread back to the depot, call before the thread exits
+    void flush_thread_cache()
+    {
+        cache_t *c = caches_.get();
+        if (c && c->pool_id == id_ && c->count != 0)
+            give_batch(*c, c->count);
+    }
+
+private:
+    union block_t
+    {
+        block_t *next;
+        typename std::aligned_storage<sizeof(T), boost::alignment_of<T>::value>::type storage;
+    };
+
+    struct batch_t
+    {
+        block_t *head;
+        size_t count;
+    };
+
+    // belongs to the thread, so it may outlive the pool, pool_id tells if it's still ours
+    struct cache_t
+    {
+        explicit cache_t(uint64_t pool_id)
+            : pool_id(pool_id)
+            , head(0)
+            , count(0)
+        {}
+
+        uint64_t pool_id;
+        block_t *head;
+        size_t count;
+    };
+
+    typedef boost::mutex mutex_t;
+    typedef boost::mutex::scoped_lock mutex_lock_t;
+
+    cache_t &cache()
+    {
+        cache_t *c = caches_.get();
+
+        // a new pool at the address of a dead one finds the dead one's cache, its blocks are long gone
+        if (!c || c->pool_id != id_)
+        {
+            c = new cache_t(id_);
+            caches_.reset(c);
+        }
+        return *c;
+    }
+
+    void refill(cache_t &c)
+    {
+        MY_ASSERT(!c.head);
+        mutex_lock_t lock(depot_mutex_);
+
+        if (!depot_.empty())
+        {
+            c.head = depot_.back().head;
+            c.count = depot_.back().count;
+            depot_.pop_back();
+            return;
+        }
+
+        block_t *chunk = new block_t[batch_size];
+        chunks_.push_back(chunk);
+
+        for (size_t i = 0; i < batch_size; ++i)
+            chunk[i].next = i + 1 < batch_size ? &chunk[i + 1] : 0;
+
+        c.head = chunk;
+        c.count = batch_size;
+    }
+
+    void give_batch(cache_t &c, size_t count)
+    {
+        MY_ASSERT(count <= c.count);
+
+        batch_t batch = { c.head, count };
+        block_t *last = c.head;
+        for (size_t i = 1; i < count; ++i)
+            last = last->next;
+
+        c.head = last->next;
+        c.count -= count;
+        last->next = 0;
+
+        mutex_lock_t lock(depot_mutex_);
+        depot_.push_back(batch);
+    }
+
+    static uint64_t next_pool_id()
+    {
+        static atomic<uint64_t> id(0);
+        return ++id;
+    }
+
+private:
+    const uint64_t id_;
+    boost::thread_specific_ptr<cache_t> caches_;
+
+    mutex_t depot_mutex_;
+    vector<batch_t> depot_;
+    vector<block_t *> chunks_;
+};
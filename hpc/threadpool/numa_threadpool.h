@@ -0,0 +1,87 @@
+#pragma once
+
+// One threadpool per NUMA node, with the node's threads pinned to its CPUs, so a task and the data it touches
+// stay on one node. Every node has its own queues and locks, and tasks never move between nodes.
+// add_task and submit go to the node the caller is running on, add_task_on to the given one.
+// Task ids are unique across the nodes, the node index is in the low part.
+struct numa_threadpool
+    : boost::noncopyable
+{
+    typedef threadpool::task_t task_t;
+    typedef threadpool::task_id_t task_id_t;
+
+    // threads_per_node == 0: as many hot threads as the node has CPUs
+    numa_threadpool(size_t threads_per_node, pt::time_duration timeout,
+                    threadpool::scheduling_t scheduling = threadpool::SINGLE_QUEUE, bool one_cpu_each = true,
+                    event_log::log_level_t log_level = event_log::LOG_TASKS)
+        : nodes_(numa_nodes())
+    {
+        BOOST_FOREACH(const numa_node_t &node, nodes_)
+        {
+            BOOST_FOREACH(size_t cpu, node.cpus)
+            {
+                if (cpu >= node_of_cpu_.size())
+                    node_of_cpu_.resize(cpu + 1, 0);
+
+                node_of_cpu_[cpu] = pools_.size();
+            }
+
+            const size_t num_threads = threads_per_node ? threads_per_node : node.cpus.size();
+            pools_.push_back(make_shared<threadpool>(num_threads, timeout, scheduling, log_level));
+            pools_.back()->set_affinity(node.cpus, one_cpu_each);
+        }
+    }
+
+public:
+    size_t num_nodes() const
+    {
+        return pools_.size();
+    }
+
+    const numa_node_t &node(size_t index) const
+    {
+        return nodes_.at(index);
+    }
+
+    threadpool &pool(size_t index)
+    {
+        return *pools_.at(index);
+    }
+
+    // the node of the CPU the caller is running on now
+    size_t local_node() const
+    {
+        const size_t cpu = current_cpu();
+        return cpu < node_of_cpu_.size() ? node_of_cpu_[cpu] : 0;
+    }
+
+    task_id_t add_task(task_t task, threadpool::priority_t priority = threadpool::PRIORITY_NORMAL,
+                       optional<pt::time_duration> deadline = boost::none)
+    {
+        return add_task_on(local_node(), std::move(task), priority, deadline);
+    }
+
+    task_id_t add_task_on(size_t index, task_t task, threadpool::priority_t priority = threadpool::PRIORITY_NORMAL,
+                          optional<pt::time_duration> deadline = boost::none)
+    {
+        const task_id_t local_id = pool(index).add_task(std::move(task), priority, deadline);
+        return local_id * num_nodes() + index;
+    }
+
+    template<typename F>
+    task_future<typename boost::result_of<F()>::type> submit(F f)
+    {
+        return pool(local_node()).submit(f);
+    }
+
+    threadpool::cancel_result_t cancel_task(task_id_t task_id)
+    {
+        return pool(size_t(task_id % num_nodes())).cancel_task(task_id / num_nodes());
+    }
+
+private:
+    vector<numa_node_t> nodes_;
+    // cpu -> index in pools_
+    vector<size_t> node_of_cpu_;
+    vector<shared_ptr<threadpool>> pools_;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+// Keeps freed single-object blocks (container nodes) on a list instead of returning them to the heap.
+// Not thread-safe: every container gets its own free_list_t and is locked from outside.
+struct free_list_t
+    : boost::noncopyable
+{
+    free_list_t()
+        : head_(0)
+        , block_size_(0)
+    {}
+
+    ~free_list_t()
+    {
+        release();
+    }
+
+    // returns the kept blocks to the heap
+    void release()
+    {
+        while (head_)
+        {
+            node_t *next = head_->next;
+            ::operator delete(head_);
+            head_ = next;
+        }
+    }
+
+    // only blocks of the first size asked for are recycled, that's the node size of the container
+    void *allocate(size_t size)
+    {
+        if (block_size_ == 0)
+            block_size_ = std::max(size, sizeof(node_t));
+
+        if (size > block_size_ || !head_)
+            return ::operator new(std::max(size, block_size_));
+
+        node_t *n = head_;
+        head_ = n->next;
+        return n;
+    }
+
+    void deallocate(void *p, size_t size)
+    {
+        if (size > block_size_)
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        node_t *n = static_cast<node_t *>(p);
+        n->next = head_;
+        head_ = n;
+    }
+
+private:
+    struct node_t
+    {
+        node_t *next;
+    };
+
+    node_t *head_;
+    size_t block_size_;
+};
+
+template<typename T>
+struct recycling_allocator
+{
+    typedef T value_type;
+
+    explicit recycling_allocator(free_list_t *list)
+        : list(list)
+    {}
+
+    template<typename U>
+    recycling_allocator(const recycling_allocator<U> &other)
+        : list(other.list)
+    {}
+
+    T *allocate(size_t n)
+    {
+        if (n == 1)
+            return static_cast<T *>(list->allocate(sizeof(T)));
+
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        if (n == 1)
+            list->deallocate(p, sizeof(T));
+        else
+            ::operator delete(p);
+    }
+
+    free_list_t *list;
+};
+
+template<typename T, typename U>
+bool operator==(const recycling_allocator<T> &a, const recycling_allocator<U> &b)
+{
+    return a.list == b.list;
+}
+
+template<typename T, typename U>
+bool operator!=(const recycling_allocator<T> &a, const recycling_allocator<U> &b)
+{
+    return a.list != b.list;
+}
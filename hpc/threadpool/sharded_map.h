@@ -0,0 +1,147 @@
+#pragma once
+
+#include "recycling_allocator.h"
+
+// unordered_map split into independently locked shards.
+// Threads working on different keys rarely meet on the same mutex.
+// Map nodes are recycled per shard, so a steady insert/erase stream doesn't touch the heap.
+template<typename Key, typename Value, size_t NumShards = 64>
+struct sharded_map
+    : boost::noncopyable
+{
+    void insert(const Key &key, const Value &value)
+    {
+        shard_t &s = shard(key);
+        mutex_lock_t lock(s.mutex);
+        s.map.insert(make_pair(key, value));
+    }
+
+    // [first, last) of pair<Key, Value>, every shard is locked at most once
+    template<typename It>
+    void insert(It first, It last)
+    {
+        const size_t n = std::distance(first, last);
+
+        // counting sort of the items by shard
+        boost::array<size_t, NumShards + 1> offsets;
+        offsets.assign(0);
+
+        vector<size_t> shard_of;
+        shard_of.reserve(n);
+        for (It it = first; it != last; ++it)
+        {
+            shard_of.push_back(shard_index(it->first));
+            ++offsets[shard_of.back() + 1];
+        }
+
+        for (size_t s = 0; s < NumShards; ++s)
+            offsets[s + 1] += offsets[s];
+
+        vector<It> sorted(n);
+        {
+            boost::array<size_t, NumShards + 1> pos = offsets;
+            size_t i = 0;
+            for (It it = first; it != last; ++it, ++i)
+                sorted[pos[shard_of[i]]++] = it;
+        }
+
+        for (size_t s = 0; s < NumShards; ++s)
+        {
+            if (offsets[s] == offsets[s + 1])
+                continue;
+
+            mutex_lock_t lock(shards_[s].mutex);
+            for (size_t i = offsets[s]; i < offsets[s + 1]; ++i)
+                shards_[s].map.insert(*sorted[i]);
+        }
+    }
+
+    // false if there's no such key
+    bool erase(const Key &key)
+    {
+        shard_t &s = shard(key);
+        mutex_lock_t lock(s.mutex);
+        return s.map.erase(key) != 0;
+    }
+
+    // calls f(value) under the shard lock, false if there's no such key
+    template<typename F>
+    bool visit(const Key &key, F f)
+    {
+        shard_t &s = shard(key);
+        mutex_lock_t lock(s.mutex);
+
+        const auto it = s.map.find(key);
+        if (it == s.map.end())
+            return false;
+
+        f(it->second);
+        return true;
+    }
+
+    // removes everything and calls f(key, value) for every removed item, outside of the locks
+    template<typename F>
+    void clear(F f)
+    {
+        BOOST_FOREACH(shard_t &s, shards_)
+        {
+            vector<pair<Key, Value>> items;
+            {
+                mutex_lock_t lock(s.mutex);
+                items.assign(s.map.begin(), s.map.end());
+                s.map.clear();
+            }
+
+            BOOST_FOREACH(const auto &item, items)
+                f(item.first, item.second);
+        }
+    }
+
+    // the shards that are empty give back their buckets and recycled nodes, the others are left alone
+    void trim()
+    {
+        BOOST_FOREACH(shard_t &s, shards_)
+        {
+            mutex_lock_t lock(s.mutex);
+            if (!s.map.empty())
+                continue;
+
+            map_t(64, boost::hash<Key>(), std::equal_to<Key>(), allocator_t(&s.free_list)).swap(s.map);
+            s.free_list.release();
+        }
+    }
+
+private:
+    typedef boost::mutex mutex_t;
+    typedef boost::mutex::scoped_lock mutex_lock_t;
+
+    typedef recycling_allocator<pair<const Key, Value>> allocator_t;
+    typedef unordered_map<Key, Value, boost::hash<Key>, std::equal_to<Key>, allocator_t> map_t;
+
+    struct shard_t
+    {
+        shard_t()
+            : map(64, boost::hash<Key>(), std::equal_to<Key>(), allocator_t(&free_list))
+        {}
+
+        mutex_t mutex;
+        // has to outlive the map
+        free_list_t free_list;
+        map_t map;
+        // neighbouring shards shouldn't share a cache line
+        char pad[64];
+    };
+
+    static size_t shard_index(const Key &key)
+    {
+        return boost::hash<Key>()(key) % NumShards;
+    }
+
+    shard_t &shard(const Key &key)
+    {
+        return shards_[shard_index(key)];
+    }
+
+private:
+    boost::array<shard_t, NumShards> shards_;
+};
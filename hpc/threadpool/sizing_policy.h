@@ -0,0 +1,123 @@
+#pragma once
+
+// What the pool tells its sizing policy
+struct pool_load_t
+{
+    // alive, hot and elastic
+    size_t threads;
+    size_t hot_threads;
+    // not running a task
+    size_t idle_threads;
+    // added and not taken by a thread yet
+    size_t pending_tasks;
+    // how long the pending tasks are expected to wait (pending / recent throughput),
+    // only measured if the policy has a tick
+    uint64_t queue_latency_ns;
+};
+
+// Decides when the pool starts elastic worker threads and when they go away.
+// The pool calls it under its lock, so it may keep state but mustn't call back into the pool.
+struct sizing_policy
+{
+    virtual ~sizing_policy() {}
+
+    // elastic threads to start now; asked when a task is added while no thread is idle, and on every tick
+    virtual size_t grow_by(const pool_load_t &load) = 0;
+    // an elastic thread has had nothing to do for idle_time, true lets it exit
+    virtual bool shrink(const pool_load_t &load, pt::time_duration idle_time) = 0;
+    // how often idle elastic threads ask shrink
+    virtual pt::time_duration idle_check() const = 0;
+    // how often the pool measures the queue latency and asks grow_by on its own, zero for never
+    virtual pt::time_duration tick() const = 0;
+};
+
+// A new thread whenever a task finds no idle one, up to max_threads.
+// An elastic thread exits once it has been idle for the timeout.
+struct spawn_on_demand_policy
+    : sizing_policy
+{
+    explicit spawn_on_demand_policy(pt::time_duration timeout, size_t max_threads = size_t(-1))
+        : timeout_(timeout)
+        , max_threads_(max_threads)
+    {}
+
+    size_t grow_by(const pool_load_t &load)
+    {
+        return load.idle_threads == 0 && load.pending_tasks != 0 && load.threads < max_threads_ ? 1 : 0;
+    }
+
+    bool shrink(const pool_load_t &, pt::time_duration idle_time)
+    {
+        return idle_time >= timeout_;
+    }
+
+    pt::time_duration idle_check() const
+    {
+        return timeout_;
+    }
+
+    pt::time_duration tick() const
+    {
+        return pt::time_duration();
+    }
+
+private:
+    pt::time_duration timeout_;
+    size_t max_threads_;
+};
+
+// Grows by one thread per tick (half the target, which is at least 1 ms) while the queue latency is above
+// the target and there is room under max_threads; a busy pool within the target gets no new threads and
+// the excess tasks just queue.
+// Shrinks with hysteresis: an elastic thread exits only after being idle for shrink_after, with the latency
+// below half the target and no growth during the last shrink_after, so a bursty load doesn't make the pool
+// start and stop threads all the time.
+struct latency_target_policy
+    : sizing_policy
+{
+    latency_target_policy(size_t max_threads, pt::time_duration target, pt::time_duration shrink_after)
+        : max_threads_(max_threads)
+        , target_ns_(uint64_t(std::max<int64_t>(target.total_nanoseconds(), 1000000)))
+        , shrink_after_(shrink_after)
+        , last_grow_ns_(0)
+    {}
+
+    size_t grow_by(const pool_load_t &load)
+    {
+        if (load.threads >= max_threads_ || load.idle_threads != 0 || load.pending_tasks == 0)
+            return 0;
+
+        if (load.queue_latency_ns <= target_ns_)
+            return 0;
+
+        last_grow_ns_ = steady_clock_ns();
+        return 1;
+    }
+
+    bool shrink(const pool_load_t &load, pt::time_duration idle_time)
+    {
+        if (idle_time < shrink_after_)
+            return false;
+
+        if (load.queue_latency_ns >= target_ns_ / 2)
+            return false;
+
+        return steady_clock_ns() - last_grow_ns_ >= uint64_t(shrink_after_.total_nanoseconds());
+    }
+
+    pt::time_duration idle_check() const
+    {
+        return shrink_after_;
+    }
+
+    pt::time_duration tick() const
+    {
+        return pt::microseconds(int64_t(target_ns_ / 2000));
+    }
+
+private:
+    size_t max_threads_;
+    uint64_t target_ns_;
+    pt::time_duration shrink_after_;
+    uint64_t last_grow_ns_;
+};
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "sharded_map.h"
+
+// Map from sequential 63-bit ids to small values (pointers), over a fixed array of slots: id lives in slot
+// id % capacity, so the slot index is the low part of the id and the high part is the slot's generation.
+// A slot is tagged with the full id, a lookup is one indexed load and a compare, and an old id never matches
+// the slot's new occupant, however often the slot has been reused since.
+// The top bit of the tag locks the slot, so visit and erase of the same id serialize on it while other ids
+// never meet. Slots are 16 bytes, 4 to a cache line, and the array starts on a cache line.
+// An id whose slot is still taken by an older one (capacity ids apart and both alive) goes to an overflow
+// sharded_map: the table's memory is fixed, and the rare overflow only costs what the plain map would.
+// The overflow is not bounded: inserts never fail or wait, so it grows with the ids alive beyond the slots
+// (for the pool, with a queue that outgrows the table). Once it empties again after holding more than
+// min_trim ids, it gives its memory back, so a spike isn't paid for for the rest of the table's life.
+template<typename Value>
+struct slot_table
+    : boost::noncopyable
+{
+    typedef uint64_t key_t;
+
+    explicit slot_table(size_t log_capacity)
+        : mask_((size_t(1) << log_capacity) - 1)
+        , memory_(new char[(mask_ + 1) * sizeof(slot_t) + cache_line - 1])
+        , overflow_size_(0)
+        , overflow_peak_(0)
+    {
+        const uintptr_t start = (uintptr_t(memory_.get()) + cache_line - 1) & ~uintptr_t(cache_line - 1);
+        slots_ = reinterpret_cast<slot_t *>(start);
+        for (size_t i = 0; i <= mask_; ++i)
+            new (&slots_[i]) slot_t();
+    }
+
+    ~slot_table()
+    {
+        for (size_t i = 0; i <= mask_; ++i)
+            slots_[i].~slot_t();
+    }
+
+public:
+    void insert(key_t id, const Value &value)
+    {
+        if (!try_insert(id, value))
+        {
+            overflowed(1);
+            overflow_.insert(id, value);
+        }
+    }
+
+    // [first, last) of pair<key_t, Value>, the overflow (if any) goes to the map in one batch
+    template<typename It>
+    void insert(It first, It last)
+    {
+        vector<pair<key_t, Value>> overflow;
+        for (; first != last; ++first)
+        {
+            if (!try_insert(first->first, first->second))
+                overflow.push_back(*first);
+        }
+
+        if (!overflow.empty())
+        {
+            overflowed(overflow.size());
+            overflow_.insert(overflow.begin(), overflow.end());
+        }
+    }
+
+    void erase(key_t id)
+    {
+        slot_t &s = slot(id);
+        if (lock(s, id))
+        {
+            s.value = Value();
+            s.tag.store(empty_tag, memory_order_release);
+            return;
+        }
+
+        if (overflow_size_ != 0 && overflow_.erase(id) && --overflow_size_ == 0)
+            trim_overflow();
+    }
+
+    // calls f(value) with the slot locked, false if there's no such id
+    template<typename F>
+    bool visit(key_t id, F f)
+    {
+        slot_t &s = slot(id);
+        if (lock(s, id))
+        {
+            f(s.value);
+            s.tag.store(id, memory_order_release);
+            return true;
+        }
+
+        return overflow_size_ != 0 && overflow_.visit(id, f);
+    }
+
+    // removes everything and calls f(id, value) for every removed item, outside of the locks
+    template<typename F>
+    void clear(F f)
+    {
+        vector<pair<key_t, Value>> items;
+        for (size_t i = 0; i <= mask_; ++i)
+        {
+            slot_t &s = slots_[i];
+            const key_t id = s.tag.load(memory_order_relaxed) & ~locked_bit;
+            if (id == empty_tag || !lock(s, id))
+                continue;
+
+            items.push_back(make_pair(id, s.value));
+            s.value = Value();
+            s.tag.store(empty_tag, memory_order_release);
+        }
+
+        BOOST_FOREACH(const auto &item, items)
+            f(item.first, item.second);
+
+        overflow_.clear([this, &f](key_t id, const Value &value)
+        {
+            --overflow_size_;
+            f(id, value);
+        });
+        trim_overflow();
+    }
+
+private:
+    static const size_t cache_line = 64;
+    static const key_t locked_bit = key_t(1) << 63;
+    // never a valid id
+    static const key_t empty_tag = ~locked_bit;
+    // smaller overflows keep their memory for the next one
+    static const size_t min_trim = 1024;
+
+    struct slot_t
+    {
+        slot_t()
+            : tag(empty_tag)
+            , value()
+        {}
+
+        atomic<key_t> tag;
+        // guarded by the lock bit
+        Value value;
+    };
+
+    slot_t &slot(key_t id)
+    {
+        return slots_[size_t(id) & mask_];
+    }
+
+    bool try_insert(key_t id, const Value &value)
+    {
+        MY_ASSERT(id < empty_tag);
+
+        slot_t &s = slot(id);
+        key_t expected = empty_tag;
+        if (!s.tag.compare_exchange_strong(expected, id | locked_bit, memory_order_acquire))
+            return false;
+
+        s.value = value;
+        s.tag.store(id, memory_order_release);
+        return true;
+    }
+
+    void overflowed(size_t n)
+    {
+        const size_t size = overflow_size_ += n;
+        size_t peak = overflow_peak_;
+        while (size > peak)
+        {
+            if (overflow_peak_.compare_exchange_weak(peak, size))
+                break;
+        }
+    }
+
+    // the shards refilled meanwhile keep their memory
+    void trim_overflow()
+    {
+        if (overflow_peak_ >= min_trim && overflow_peak_.exchange(0) >= min_trim)
+            overflow_.trim();
+    }
+
+    // false if id isn't in its slot. The lock is only ever held for a few instructions, hence the spinning
+    bool lock(slot_t &s, key_t id)
+    {
+        for (size_t spins = 0; ; ++spins)
+        {
+            key_t tag = id;
+            if (s.tag.compare_exchange_weak(tag, id | locked_bit, memory_order_acquire))
+                return true;
+
+            if ((tag & ~locked_bit) != id)
+                return false;
+
+            if (spins >= 64)
+                boost::this_thread::yield();
+        }
+    }
+
+private:
+    const size_t mask_;
+    boost::scoped_array<char> memory_;
+    slot_t *slots_;
+
+    sharded_map<key_t, Value> overflow_;
+    // lets lookups of ids that aren't in the table skip the map
+    atomic<size_t> overflow_size_;
+    // the most ids the overflow has held since it was last trimmed
+    atomic<size_t> overflow_peak_;
+};
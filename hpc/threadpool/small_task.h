@@ -0,0 +1,189 @@
+#pragma once
+
+// Move-only void() callable.
+// Callables of up to inline_size bytes live right inside the object, bigger ones go to the heap,
+// so a typical lambda is constructed, moved into the pool and run without a single allocation.
+struct small_task
+{
+    static const size_t inline_size = 48;
+
+    small_task()
+        : ops_(0)
+    {}
+
+    template<typename F>
+    small_task(F f)
+        : ops_(0)
+    {
+        typedef typename std::decay<F>::type fn_t;
+        init<fn_t>(std::move(f), boost::integral_constant<bool, fits_inline<fn_t>::value>());
+    }
+
+    small_task(small_task &&other)
+        : ops_(other.ops_)
+    {
+        if (ops_)
+            ops_->move(&storage_, &other.storage_);
+
+        other.ops_ = 0;
+    }
+
+    small_task &operator=(small_task &&other)
+    {
+        if (this != &other)
+        {
+            reset();
+
+            ops_ = other.ops_;
+            if (ops_)
+                ops_->move(&storage_, &other.storage_);
+
+            other.ops_ = 0;
+        }
+        return *this;
+    }
+
+    ~small_task()
+    {
+        reset();
+    }
+
+    void operator()()
+    {
+        MY_ASSERT(ops_);
+        ops_->invoke(&storage_);
+    }
+
+    bool empty() const
+    {
+        return ops_ == 0;
+    }
+
+    // the stored callable if it is an F, 0 otherwise (the vtables are per type, so no RTTI is needed)
+    template<typename F>
+    F *target()
+    {
+        return target<F>(boost::integral_constant<bool, fits_inline<F>::value>());
+    }
+
+    void reset()
+    {
+        if (ops_)
+            ops_->destroy(&storage_);
+
+        ops_ = 0;
+    }
+
+private:
+    small_task(const small_task &);
+    small_task &operator=(const small_task &);
+
+private:
+    typedef std::aligned_storage<inline_size, boost::alignment_of<void *>::value * 2>::type storage_t;
+
+    // hand-made vtable, one static instance per stored type
+    struct ops_t
+    {
+        void (*invoke )(storage_t *self);
+        void (*move   )(storage_t *dst, storage_t *src);
+        void (*destroy)(storage_t *self);
+    };
+
+    template<typename F>
+    struct fits_inline
+    {
+        static const bool value = sizeof(F) <= sizeof(storage_t)
+            && boost::alignment_of<storage_t>::value % boost::alignment_of<F>::value == 0;
+    };
+
+    template<typename F>
+    struct inline_ops
+    {
+        static F &get(storage_t *s)
+        {
+            return *static_cast<F *>(static_cast<void *>(s));
+        }
+
+        static void invoke(storage_t *self)
+        {
+            get(self)();
+        }
+
+        static void move(storage_t *dst, storage_t *src)
+        {
+            new (dst) F(std::move(get(src)));
+            get(src).~F();
+        }
+
+        static void destroy(storage_t *self)
+        {
+            get(self).~F();
+        }
+
+        static const ops_t *table()
+        {
+            static const ops_t ops = { &invoke, &move, &destroy };
+            return &ops;
+        }
+    };
+
+    template<typename F>
+    struct heap_ops
+    {
+        static F *&get(storage_t *s)
+        {
+            return *static_cast<F **>(static_cast<void *>(s));
+        }
+
+        static void invoke(storage_t *self)
+        {
+            (*get(self))();
+        }
+
+        static void move(storage_t *dst, storage_t *src)
+        {
+            new (dst) F *(get(src));
+        }
+
+        static void destroy(storage_t *self)
+        {
+            delete get(self);
+        }
+
+        static const ops_t *table()
+        {
+            static const ops_t ops = { &invoke, &move, &destroy };
+            return &ops;
+        }
+    };
+
+    template<typename F>
+    void init(F &&f, boost::true_type /*inline*/)
+    {
+        new (&storage_) F(std::move(f));
+        ops_ = inline_ops<F>::table();
+    }
+
+    template<typename F>
+    void init(F &&f, boost::false_type /*inline*/)
+    {
+        new (&storage_) F *(new F(std::move(f)));
+        ops_ = heap_ops<F>::table();
+    }
+
+    template<typename F>
+    F *target(boost::true_type /*inline*/)
+    {
+        return ops_ == inline_ops<F>::table() ? &inline_ops<F>::get(&storage_) : 0;
+    }
+
+    template<typename F>
+    F *target(boost::false_type /*inline*/)
+    {
+        return ops_ == heap_ops<F>::table() ? heap_ops<F>::get(&storage_) : 0;
+    }
+
+private:
+    storage_t storage_;
+    const ops_t *ops_;
+};
@@ -6,6 +6,7 @@
 #endif
 
 #include <iostream>
+#include <fstream>
 using std::cout;
 using std::endl;
 
@@ -16,11 +17,17 @@ using std::string;
 using std::vector;
 #include <queue>
 using std::queue;
+#include <map>
+using std::map;
 #include <unordered_map>
 using std::unordered_map;
 #include <unordered_set>
 using std::unordered_set;
 
+#include <initializer_list>
+#include <type_traits>
+#include <iterator>
+
 #include <algorithm>
 using std::pair;
 using std::make_pair;
@@ -30,6 +37,8 @@ using std::make_pair;
 #include <boost/array.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/type_traits.hpp>
 
 using boost::shared_ptr;
 using boost::make_shared;
@@ -38,7 +47,12 @@ using boost::make_shared;
 #include <boost/date_time/time_duration.hpp>
 namespace pt = boost::posix_time;
 
+#include <boost/chrono.hpp>
+
 #include <boost/function.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/utility/result_of.hpp>
+#include <boost/exception_ptr.hpp>
 #include <boost/bind.hpp>
 
 #include <boost/optional.hpp>
@@ -47,17 +61,33 @@ using boost::optional;
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 #include <boost/range/algorithm.hpp>
+#include <boost/range/irange.hpp>
+#include <boost/range/value_type.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/context/continuation.hpp>
+#include <boost/context/protected_fixedsize_stack.hpp>
 
 
 // VS 2010 doesn't have std::atomic while boost < 1.53 doesn't have boost::atomic
 #if defined(USE_BOOST_ATOMIC)
 #include <boost/atomic.hpp>
+using boost::atomic;
 using boost::atomic_bool;
+using boost::atomic_thread_fence;
+using boost::memory_order_relaxed;
+using boost::memory_order_acquire;
+using boost::memory_order_release;
+using boost::memory_order_seq_cst;
 #else
 #include <atomic>
+using std::atomic;
 using std::atomic_bool;
+using std::atomic_thread_fence;
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::memory_order_seq_cst;
 #endif
 
 #include <stdexcept>
@@ -0,0 +1,399 @@
+#pragma once
+
+// Futures for threadpool::submit. Included at the bottom of threadpool.h, don't include directly.
+
+// what get() throws if the task never ran (canceled while queued, pool destroyed)
+// or was interrupted by cancel_task
+struct task_canceled
+    : std::runtime_error
+{
+    task_canceled()
+        : std::runtime_error("task canceled")
+    {}
+};
+
+template<typename R>
+struct future_traits
+{
+    typedef R value_type;
+
+    template<typename F>
+    static value_type invoke(F &f)
+    {
+        return f();
+    }
+
+    static R unwrap(const value_type &value)
+    {
+        return value;
+    }
+};
+
+template<>
+struct future_traits<void>
+{
+    struct value_type {};
+
+    template<typename F>
+    static value_type invoke(F &f)
+    {
+        f();
+        return value_type();
+    }
+
+    static void unwrap(const value_type &)
+    {
+    }
+};
+
+// shared between the future, its promise and the continuations
+template<typename R>
+struct future_state
+    : boost::noncopyable
+{
+    typedef typename future_traits<R>::value_type value_type;
+    typedef boost::function<void()> callback_t;
+
+    // continuations go to pool, run inline if it's null
+    explicit future_state(threadpool *pool)
+        : pool(pool)
+        , ready_(false)
+    {}
+
+    void set_value(const value_type &value)
+    {
+        vector<callback_t> callbacks;
+        {
+            mutex_lock_t lock(mutex_);
+            MY_ASSERT(!ready_);
+            value_ = value;
+            ready_ = true;
+            callbacks.swap(callbacks_);
+        }
+        cond_.notify_all();
+
+        BOOST_FOREACH(const callback_t &c, callbacks)
+            c();
+    }
+
+    void set_exception(boost::exception_ptr error)
+    {
+        vector<callback_t> callbacks;
+        {
+            mutex_lock_t lock(mutex_);
+            MY_ASSERT(!ready_);
+            error_ = error;
+            ready_ = true;
+            callbacks.swap(callbacks_);
+        }
+        cond_.notify_all();
+
+        BOOST_FOREACH(const callback_t &c, callbacks)
+            c();
+    }
+
+    bool is_ready()
+    {
+        mutex_lock_t lock(mutex_);
+        return ready_;
+    }
+
+    void wait()
+    {
+        mutex_lock_t lock(mutex_);
+        while (!ready_)
+            cond_.wait(lock);
+    }
+
+    R get()
+    {
+        wait();
+        if (error_)
+            boost::rethrow_exception(error_);
+
+        return future_traits<R>::unwrap(*value_);
+    }
+
+    // callback runs in the thread that makes the state ready, or right here if it's ready already
+    void on_ready(const callback_t &callback)
+    {
+        {
+            mutex_lock_t lock(mutex_);
+            if (!ready_)
+            {
+                callbacks_.push_back(callback);
+                return;
+            }
+        }
+
+        callback();
+    }
+
+    threadpool *const pool;
+
+private:
+    typedef boost::mutex mutex_t;
+    typedef boost::mutex::scoped_lock mutex_lock_t;
+
+    mutex_t mutex_;
+    boost::condition_variable cond_;
+
+    bool ready_;
+    optional<value_type> value_;
+    boost::exception_ptr error_;
+    vector<callback_t> callbacks_;
+};
+
+// Fulfilled by running the task. If the task is destroyed without running, the promise is broken
+// with task_canceled, so neither the waiters nor the continuations hang.
+template<typename R>
+struct future_promise
+    : boost::noncopyable
+{
+    explicit future_promise(const shared_ptr<future_state<R>> &state)
+        : state_(state)
+        , done_(false)
+    {}
+
+    ~future_promise()
+    {
+        cancel();
+    }
+
+    // breaks the promise now rather than when the last copy of the task goes, unless the task has run
+    void cancel()
+    {
+        if (done_)
+            return;
+
+        done_ = true;
+        state_->set_exception(boost::copy_exception(task_canceled()));
+    }
+
+    template<typename F>
+    void run(F &f)
+    {
+        MY_ASSERT(!done_);
+        done_ = true;
+
+        // the state is made ready outside the try: the continuations run in there, and what they throw
+        // isn't the task's exception, the state would be made ready twice
+        optional<typename future_traits<R>::value_type> value;
+        boost::exception_ptr error;
+        try
+        {
+            value = future_traits<R>::invoke(f);
+        }
+        catch (boost::thread_interrupted const&)
+        {
+            state_->set_exception(boost::copy_exception(task_canceled()));
+            // let the pool see the cancellation
+            throw;
+        }
+        catch (...)
+        {
+            error = boost::current_exception();
+        }
+
+        if (error)
+            state_->set_exception(error);
+        else
+            state_->set_value(*value);
+    }
+
+private:
+    shared_ptr<future_state<R>> state_;
+    bool done_;
+};
+
+// what actually goes to the pool: copies of it share the promise
+template<typename R, typename F>
+struct future_task
+{
+    future_task(const shared_ptr<future_state<R>> &state, const F &f)
+        : promise_(boost::make_shared<future_promise<R>>(state))
+        , f_(f)
+    {}
+
+    void operator()()
+    {
+        promise_->run(f_);
+    }
+
+    void cancel()
+    {
+        promise_->cancel();
+    }
+
+private:
+    shared_ptr<future_promise<R>> promise_;
+    F f_;
+};
+
+template<typename R>
+struct task_future
+{
+    typedef R result_type;
+
+    task_future()
+    {}
+
+    explicit task_future(const shared_ptr<future_state<R>> &state)
+        : state_(state)
+    {}
+
+    bool valid() const
+    {
+        return state_.get() != 0;
+    }
+
+    bool is_ready() const
+    {
+        return state_->is_ready();
+    }
+
+    // blocks the calling thread, prefer then() inside the pool
+    void wait() const
+    {
+        state_->wait();
+    }
+
+    // rethrows whatever the task has thrown
+    R get() const
+    {
+        return state_->get();
+    }
+
+    // Runs f(ready_future) as a new pool task once this one is ready. The continuation is added by
+    // the thread that completes this future, so with WORK_STEALING it lands on the same worker's deque
+    // and is normally the next thing that worker runs.
+    // A pool that is draining takes it only from its own threads: a future completed (or broken, because
+    // drain dropped its task) anywhere else gives a continuation that gets task_canceled.
+    template<typename F>
+    task_future<typename boost::result_of<F(task_future)>::type> then(F f) const
+    {
+        typedef typename boost::result_of<F(task_future)>::type next_t;
+        typedef boost::function<next_t()> next_f;
+
+        auto next = boost::make_shared<future_state<next_t>>(state_->pool);
+        future_task<next_t, next_f> task(next, next_f(boost::bind<next_t>(f, *this)));
+        threadpool *pool = state_->pool;
+
+        // never throws, it may run in the destructor of a dropped task
+        state_->on_ready([pool, task]() mutable
+        {
+            if (!pool)
+            {
+                task();
+                return;
+            }
+
+            try
+            {
+                pool->add_task(task);
+            }
+            catch (...)
+            {
+                // pool_stopped mostly
+                task.cancel();
+            }
+        });
+
+        return task_future<next_t>(next);
+    }
+
+    // low-level hook: callback runs inline in the thread that completes the future
+    void on_ready(const boost::function<void()> &callback) const
+    {
+        state_->on_ready(callback);
+    }
+
+    threadpool *pool() const
+    {
+        return state_->pool;
+    }
+
+private:
+    shared_ptr<future_state<R>> state_;
+};
+
+// Ready when all the futures are. Nobody waits: the last one to complete fulfills it.
+template<typename It>
+task_future<vector<typename std::iterator_traits<It>::value_type>> when_all(It first, It last)
+{
+    typedef typename std::iterator_traits<It>::value_type future_t;
+    typedef vector<future_t> result_t;
+
+    const auto futures = boost::make_shared<result_t>(first, last);
+    const auto state = boost::make_shared<future_state<result_t>>(futures->empty() ? 0 : futures->front().pool());
+
+    if (futures->empty())
+    {
+        state->set_value(result_t());
+        return task_future<result_t>(state);
+    }
+
+    const auto remaining = boost::make_shared<atomic<size_t>>(futures->size());
+    BOOST_FOREACH(const future_t &f, *futures)
+    {
+        f.on_ready([state, futures, remaining]()
+        {
+            if (--*remaining == 0)
+                state->set_value(*futures);
+        });
+    }
+
+    return task_future<result_t>(state);
+}
+
+template<typename Range>
+task_future<vector<typename boost::range_value<Range>::type>> when_all(const Range &futures)
+{
+    return when_all(boost::begin(futures), boost::end(futures));
+}
+
+// Ready as soon as any of the futures is, first is its index (size_t(-1) for an empty range)
+template<typename It>
+task_future<pair<size_t, vector<typename std::iterator_traits<It>::value_type>>> when_any(It first, It last)
+{
+    typedef typename std::iterator_traits<It>::value_type future_t;
+    typedef pair<size_t, vector<future_t>> result_t;
+
+    const auto futures = boost::make_shared<vector<future_t>>(first, last);
+    const auto state = boost::make_shared<future_state<result_t>>(futures->empty() ? 0 : futures->front().pool());
+
+    if (futures->empty())
+    {
+        state->set_value(result_t(size_t(-1), *futures));
+        return task_future<result_t>(state);
+    }
+
+    const auto done = boost::make_shared<atomic_bool>(false);
+    for (size_t i = 0; i < futures->size(); ++i)
+    {
+        futures->at(i).on_ready([state, futures, done, i]()
+        {
+            bool expected = false;
+            if (done->compare_exchange_strong(expected, true))
+                state->set_value(result_t(i, *futures));
+        });
+    }
+
+    return task_future<result_t>(state);
+}
+
+template<typename Range>
+task_future<pair<size_t, vector<typename boost::range_value<Range>::type>>> when_any(const Range &futures)
+{
+    return when_any(boost::begin(futures), boost::end(futures));
+}
+
+template<typename F>
+task_future<typename boost::result_of<F()>::type> threadpool::submit(F f)
+{
+    typedef typename boost::result_of<F()>::type result_t;
+
+    auto state = boost::make_shared<future_state<result_t>>(this);
+    add_task(future_task<result_t, F>(state, f));
+    return task_future<result_t>(state);
+}
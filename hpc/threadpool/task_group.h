@@ -0,0 +1,227 @@
+#pragma once
+
+// Fork/join on top of threadpool. Included at the bottom of threadpool.h, don't include directly.
+
+// Runs tasks on the pool and waits for all of them. The group keeps its own list of the tasks that haven't
+// started, and wait() runs them on the calling thread, most recent first, rather than blocking: whoever gets
+// to a task first (a pool worker or the waiter) runs it, the other one skips it. So a worker that waits for
+// its subtasks never needs another thread for them, and nested groups can't deadlock even on a pool with a
+// single thread.
+// run() may be called from the group's own tasks, wait() returns once these are done as well.
+// The first exception thrown by a task is rethrown by wait(), the rest are lost.
+struct task_group
+    : boost::noncopyable
+{
+    typedef threadpool::task_t task_t;
+
+    explicit task_group(threadpool &pool)
+        : pool_(pool)
+        , token_(cancellation_token::create())
+        , pending_(0)
+        , waiters_(0)
+    {}
+
+    // the tasks reference the group, so it waits for them, but swallows their exceptions
+    ~task_group()
+    {
+        wait_all();
+    }
+
+public:
+    template<typename F>
+    void run(F f)
+    {
+        auto j = boost::make_shared<job_t>(task_t(std::move(f)));
+        {
+            mutex_lock_t lock(mutex_);
+            ++pending_;
+            jobs_.push_back(j);
+            if (waiters_ != 0)
+                cond_.notify_all();
+        }
+
+        // the pool only dereferences the group after winning the job
+        task_group *self = this;
+        pool_.add_task([self, j]() { self->try_run(*j); }, token_);
+    }
+
+    // runs the tasks nobody has started yet, then waits for the rest
+    void wait()
+    {
+        wait_all();
+
+        boost::exception_ptr error;
+        {
+            mutex_lock_t lock(mutex_);
+            error = error_;
+            error_ = boost::exception_ptr();
+        }
+
+        if (error)
+            boost::rethrow_exception(error);
+    }
+
+    // The tasks that haven't started yet never will, the running ones see threadpool::cancellation_requested()
+    // (if the pool runs them) or is_canceled(). wait() still has to be called.
+    void cancel()
+    {
+        pool_.cancel_group(token_);
+    }
+
+    bool is_canceled() const
+    {
+        return token_.is_canceled();
+    }
+
+private:
+    struct job_t
+    {
+        explicit job_t(task_t &&task)
+            : task(std::move(task))
+            , claimed(false)
+        {}
+
+        task_t task;
+        atomic_bool claimed;
+    };
+    typedef shared_ptr<job_t> job_ptr;
+
+    typedef boost::mutex::scoped_lock mutex_lock_t;
+
+    void try_run(job_t &j)
+    {
+        if (j.claimed.exchange(true))
+            return;
+
+        if (!token_.is_canceled())
+        {
+            try
+            {
+                j.task();
+            }
+            catch (...)
+            {
+                mutex_lock_t lock(mutex_);
+                if (!error_)
+                    error_ = boost::current_exception();
+            }
+        }
+
+        // whatever the task holds goes before the group may be gone
+        j.task = task_t();
+
+        mutex_lock_t lock(mutex_);
+        MY_ASSERT(pending_ != 0);
+        if (--pending_ == 0 && waiters_ != 0)
+            cond_.notify_all();
+    }
+
+    void wait_all()
+    {
+        mutex_lock_t lock(mutex_);
+        for (;;)
+        {
+            if (!jobs_.empty())
+            {
+                const job_ptr j = jobs_.back();
+                jobs_.pop_back();
+
+                lock.unlock();
+                try_run(*j);
+                lock.lock();
+                continue;
+            }
+
+            if (pending_ == 0)
+                break;
+
+            // the rest is running elsewhere, and may still add more
+            ++waiters_;
+            cond_.wait(lock);
+            --waiters_;
+        }
+    }
+
+private:
+    threadpool &pool_;
+    // the group's tasks are added with it, cancel() drops the queued ones
+    cancellation_token token_;
+
+    boost::mutex mutex_;
+    boost::condition_variable cond_;
+    // not started yet as far as the group knows, the pool may have claimed some of them already
+    vector<job_ptr> jobs_;
+    // run and not finished
+    size_t pending_;
+    size_t waiters_;
+    boost::exception_ptr error_;
+};
+
+inline size_t parallel_grain(threadpool &pool, size_t n)
+{
+    const size_t parts = std::max<size_t>(pool.hot_threads(), 1) * 8;
+    return std::max<size_t>((n + parts - 1) / parts, 1);
+}
+
+// the right halves go to the group, the caller goes on with the left ones
+template<typename Index, typename F>
+void parallel_for_part(task_group &group, Index first, Index last, const F &f, size_t grain)
+{
+    while (size_t(last - first) > grain)
+    {
+        const Index mid = first + size_t(last - first) / 2;
+        task_group *g = &group;
+        const F *pf = &f;
+        group.run([g, mid, last, pf, grain]() { parallel_for_part(*g, mid, last, *pf, grain); });
+        last = mid;
+    }
+
+    for (; first < last; ++first)
+        f(first);
+}
+
+// Splits [first, last) in halves until a part is at most grain long, then calls f(i) for every i of the part.
+// The halves go to the pool through one task_group, so idle workers pick up the big ones while the caller works
+// through the small ones. grain == 0 picks one that gives every hot thread of the pool about 8 parts.
+template<typename Index, typename F>
+void parallel_for(threadpool &pool, Index first, Index last, F f, size_t grain = 0)
+{
+    if (!(first < last))
+        return;
+
+    const size_t n = size_t(last - first);
+    if (grain == 0)
+        grain = parallel_grain(pool, n);
+
+    task_group group(pool);
+    parallel_for_part(group, first, last, f, grain);
+    group.wait();
+}
+
+// Reduces [first, last) with body(part_first, part_last, identity) for every part and join(left, right) for
+// their results, left to right, so join only has to be associative. Parts are as in parallel_for.
+template<typename Index, typename T, typename Body, typename Join>
+T parallel_reduce(threadpool &pool, Index first, Index last, T identity, Body body, Join join, size_t grain = 0)
+{
+    if (!(first < last))
+        return identity;
+
+    const size_t n = size_t(last - first);
+    if (grain == 0)
+        grain = parallel_grain(pool, n);
+
+    const size_t num_parts = (n + grain - 1) / grain;
+    vector<T> results(num_parts, identity);
+
+    parallel_for(pool, size_t(0), num_parts, [&](size_t part)
+    {
+        const Index part_first = first + part * grain;
+        const Index part_last = part + 1 == num_parts ? last : part_first + grain;
+        results[part] = body(part_first, part_last, identity);
+    }, 1);
+
+    T res = identity;
+    BOOST_FOREACH(const T &r, results)
+        res = join(res, r);
+    return res;
+}
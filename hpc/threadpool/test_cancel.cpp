@@ -0,0 +1,180 @@
+#include "stdafx.h"
+#include "threadpool.h"
+#include "test_check.h"
+
+boost::mutex cout_mutex;
+
+// cancel_task, cancel_tasks and cancel_group, with the tasks they drop destroyed outside of the pool's locks
+namespace
+{
+    using namespace test;
+
+    // enough canceled tasks for a compaction of the shared queue, each with a continuation that the
+    // destruction of its task schedules
+    void compaction_with_continuations()
+    {
+        auto pool = busy_pool();
+        const threadpool::task_id_t first_id = pool->stats().tasks_added;
+
+        vector<task_future<int>> futures;
+        for (size_t i = 0; i < 100; ++i)
+            futures.push_back(pool->submit([]() { return 1; }).then(&plus_one));
+
+        size_t canceled = 0;
+        check_finishes([&pool, &canceled, first_id]()
+        {
+            // the ids of the submits, the continuations come after them
+            canceled = pool->cancel_tasks(boost::irange(first_id, first_id + 100));
+        }, pt::seconds(5), "cancel_tasks of futures with continuations doesn't deadlock");
+        check(canceled == 100, "cancel_tasks cancels all of them");
+
+        bool all_canceled = true;
+        BOOST_FOREACH(const task_future<int> &f, futures)
+            all_canceled = all_canceled && wait_for(f, pt::seconds(5)) && is_canceled(f);
+        check(all_canceled, "their continuations get task_canceled");
+    }
+
+    // a queued task is removed once and never runs, a running one gets interrupted
+    void cancel_by_mode(threadpool::scheduling_t scheduling)
+    {
+        auto pool = busy_pool(scheduling);
+        auto ran = boost::make_shared<atomic_bool>(false);
+        const threadpool::task_id_t queued = pool->add_task([ran]() { *ran = true; });
+
+        check(pool->cancel_task(queued) == threadpool::REMOVED_FROM_QUEUE,
+              name(scheduling) + ": cancel_task of a queued task removes it");
+        check(pool->cancel_task(queued) == threadpool::NOT_FOUND, name(scheduling) + ": only once");
+        check(!pool->is_pending(queued), name(scheduling) + ": it's no longer pending");
+
+        auto started = boost::make_shared<atomic_bool>(false);
+        const threadpool::task_id_t running = pool->add_task([started]()
+        {
+            *started = true;
+            for (;;)
+                boost::this_thread::sleep(pt::milliseconds(1));
+        });
+        wait_until([started]() { return bool(*started); }, pt::seconds(5));
+
+        check(pool->cancel_task(running) == threadpool::TERMINATED,
+              name(scheduling) + ": cancel_task of a running task terminates it");
+        check(wait_until([&pool]() { return pool->stats().tasks_interrupted == 1; }, pt::seconds(5)),
+              name(scheduling) + ": its thread gets interrupted");
+        check(!*ran, name(scheduling) + ": the removed task never ran");
+        check(pool->cancel_task(running) == threadpool::NOT_FOUND, name(scheduling) + ": an ended task isn't found");
+    }
+
+    // cancel half of the queue one by one: the canceled tasks are freed by a compaction before the worker
+    // gets to them, the others still run
+    void tombstone_compaction()
+    {
+        auto pool = busy_pool(threadpool::SINGLE_QUEUE, pt::seconds(1));
+        const size_t n = 1000;
+
+        const auto canceled_tracker = boost::make_shared<int>(0);
+        auto runs = boost::make_shared<vector<atomic<size_t>>>(n);
+        vector<threadpool::task_id_t> ids;
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (i % 2 == 0)
+                ids.push_back(pool->add_task([runs, i, canceled_tracker]() { ++(*runs)[i]; }));
+            else
+                ids.push_back(pool->add_task([runs, i]() { ++(*runs)[i]; }));
+        }
+
+        const uint64_t removed_before = pool->stats().tasks_removed;
+        for (size_t i = 0; i < n; i += 2)
+            pool->cancel_task(ids[i]);
+
+        check(canceled_tracker.use_count() == 1, "the compaction frees the canceled tasks while still queued");
+        check(pool->stats().tasks_removed == removed_before + n / 2, "stats count them as removed");
+
+        check(wait_until([&pool]() { return pool->stats().queue_depth == 0; }, pt::seconds(10)),
+              "the rest of the queue runs");
+        wait_until([&pool, n]() { return pool->stats().tasks_finished == 1 + n / 2; }, pt::seconds(5));
+
+        bool right = true;
+        for (size_t i = 0; i < n; ++i)
+            right = right && (*runs)[i] == (i % 2 == 0 ? 0 : 1);
+        check(right, "the canceled tasks never run, the others once");
+    }
+
+    // the group's tasks in the shared queue are removed and counted, the others of the queue stay
+    void group_in_queue()
+    {
+        auto pool = busy_pool();
+        const auto token = cancellation_token::create();
+        auto group_runs = boost::make_shared<atomic<size_t>>(0);
+        auto other_runs = boost::make_shared<atomic<size_t>>(0);
+
+        for (size_t i = 0; i < 10; ++i)
+        {
+            pool->add_task([group_runs]() { ++*group_runs; }, token);
+            pool->add_task([other_runs]() { ++*other_runs; });
+        }
+
+        check(pool->cancel_group(token) == 10, "cancel_group returns the removed count");
+        check(wait_until([other_runs]() { return *other_runs == 10; }, pt::seconds(5)) && *group_runs == 0,
+              "the group's tasks never run, the others do");
+        check(pool->cancel_group(token) == 0, "a second cancel_group finds nothing");
+    }
+
+    // WORK_STEALING: tasks added from a worker go to its deque, out of cancel_group's reach, and must not start
+    // once popped
+    void group_in_deque()
+    {
+        auto pool = busy_pool(threadpool::WORK_STEALING, pt::milliseconds(0));
+        const auto token = cancellation_token::create();
+        auto group_runs = boost::make_shared<atomic<size_t>>(0);
+        auto other_runs = boost::make_shared<atomic<size_t>>(0);
+        auto canceled = boost::make_shared<atomic_bool>(false);
+
+        threadpool *p = pool.get();
+        pool->add_task([p, token, group_runs, other_runs, canceled]()
+        {
+            for (size_t i = 0; i < 10; ++i)
+            {
+                p->add_task([group_runs]() { ++*group_runs; }, token);
+                p->add_task([other_runs]() { ++*other_runs; });
+            }
+
+            while (!*canceled)
+                boost::this_thread::sleep(pt::milliseconds(1));
+        });
+
+        wait_until([&pool]() { return pool->stats().tasks_added == 22; }, pt::seconds(5));
+        check(pool->cancel_group(token) == 0, "cancel_group doesn't count the tasks in a deque");
+        *canceled = true;
+
+        check(wait_until([other_runs]() { return *other_runs == 10; }, pt::seconds(5)) && *group_runs == 0,
+              "but they never run, the others of the deque do");
+    }
+
+    void group_with_coroutine()
+    {
+        auto pool = busy_pool();
+        const auto token = cancellation_token::create();
+        const auto first = spawn_coroutine(*pool, [](coroutine_context &) { return 1; }, token);
+        const auto second = first.then(&plus_one);
+
+        check_finishes([&pool, &token]() { pool->cancel_group(token); }, pt::seconds(5),
+                       "cancel_group of a coroutine with a continuation doesn't deadlock");
+        check(is_canceled(first), "the coroutine gets task_canceled");
+        check(wait_for(second, pt::seconds(5)) && is_canceled(second), "and so does its continuation");
+    }
+}
+
+int main()
+{
+    const threadpool::scheduling_t modes[] = { threadpool::SINGLE_QUEUE, threadpool::WORK_STEALING,
+                                               threadpool::LOCK_FREE_QUEUE };
+    BOOST_FOREACH(threadpool::scheduling_t scheduling, modes)
+        cancel_by_mode(scheduling);
+
+    tombstone_compaction();
+    group_in_queue();
+    group_in_deque();
+    compaction_with_continuations();
+    group_with_coroutine();
+
+    return test::result();
+}
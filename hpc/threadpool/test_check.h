@@ -0,0 +1,112 @@
+#pragma once
+
+// What the test_* programs share: checks that print a line each and are counted, main returns
+// test_result() and so exits with 1 if any of them failed.
+
+namespace test
+{
+    inline size_t &failures()
+    {
+        static size_t failures = 0;
+        return failures;
+    }
+
+    inline void check(bool ok, const string &what)
+    {
+        cout << (ok ? "ok     " : "FAILED ") << what << endl;
+        if (!ok)
+            ++failures();
+    }
+
+    inline int result()
+    {
+        cout << (failures() == 0 ? "all passed" : "some failed") << endl;
+        return failures() == 0 ? 0 : 1;
+    }
+
+    // runs f on a thread of its own, a deadlock or a hang fails the check and ends the program, as nothing
+    // can be done with the stuck thread
+    template<typename F>
+    void check_finishes(F f, pt::time_duration timeout, const string &what)
+    {
+        boost::thread t(f);
+        if (!t.timed_join(timeout))
+        {
+            check(false, what);
+            cout << "some failed" << endl;
+            std::_Exit(1);
+        }
+
+        check(true, what);
+    }
+
+    template<typename R>
+    bool is_canceled(const task_future<R> &f)
+    {
+        if (!f.is_ready())
+            return false;
+
+        try
+        {
+            f.get();
+        }
+        catch (task_canceled &)
+        {
+            return true;
+        }
+        catch (...)
+        {
+        }
+        return false;
+    }
+
+    // waits for the future up to timeout, true if it's ready
+    template<typename R>
+    bool wait_for(const task_future<R> &f, pt::time_duration timeout)
+    {
+        const uint64_t until_ns = steady_clock_ns() + uint64_t(timeout.total_nanoseconds());
+        while (!f.is_ready() && steady_clock_ns() < until_ns)
+            boost::this_thread::sleep(pt::milliseconds(1));
+        return f.is_ready();
+    }
+
+    // polls pred up to timeout
+    template<typename P>
+    bool wait_until(P pred, pt::time_duration timeout)
+    {
+        const uint64_t until_ns = steady_clock_ns() + uint64_t(timeout.total_nanoseconds());
+        while (!pred() && steady_clock_ns() < until_ns)
+            boost::this_thread::sleep(pt::milliseconds(1));
+        return pred();
+    }
+
+    // one thread, kept busy for a while, so whatever is added after the busy task stays queued
+    inline shared_ptr<threadpool> busy_pool(threadpool::scheduling_t scheduling = threadpool::SINGLE_QUEUE,
+                                            pt::time_duration busy = pt::milliseconds(300))
+    {
+        auto pool = boost::make_shared<threadpool>(1, make_shared<spawn_on_demand_policy>(pt::seconds(1), 1),
+                                                   scheduling, event_log::LOG_NONE);
+        pool->add_task([busy]() { boost::this_thread::sleep(busy); });
+        boost::this_thread::sleep(pt::milliseconds(20));
+        return pool;
+    }
+
+    // for the messages of the checks run in every mode
+    inline string name(threadpool::scheduling_t scheduling)
+    {
+        switch (scheduling)
+        {
+        case threadpool::WORK_STEALING:
+            return "stealing";
+        case threadpool::LOCK_FREE_QUEUE:
+            return "lockfree";
+        default:
+            return "single";
+        }
+    }
+
+    inline int plus_one(const task_future<int> &f)
+    {
+        return f.get() + 1;
+    }
+}
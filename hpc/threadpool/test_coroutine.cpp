@@ -0,0 +1,204 @@
+#include "stdafx.h"
+#include "threadpool.h"
+#include "test_check.h"
+
+#include <unistd.h>
+
+boost::mutex cout_mutex;
+
+// spawn_coroutine: every wait gives the worker back, so one thread is enough for many waiting coroutines
+namespace
+{
+    using namespace test;
+
+    shared_ptr<threadpool> one_thread_pool()
+    {
+        return boost::make_shared<threadpool>(1, make_shared<spawn_on_demand_policy>(pt::seconds(1), 1),
+                                              threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+    }
+
+    void results()
+    {
+        auto pool = one_thread_pool();
+
+        const auto value = spawn_coroutine(*pool, [](coroutine_context &) { return 42; });
+        check(wait_for(value, pt::seconds(5)) && value.get() == 42, "a coroutine's value comes through its future");
+
+        const auto error = spawn_coroutine(*pool, [](coroutine_context &self) -> int
+        {
+            self.yield();
+            throw std::runtime_error("coroutine test");
+        });
+        bool thrown = false;
+        try
+        {
+            wait_for(error, pt::seconds(5));
+            error.get();
+        }
+        catch (std::runtime_error &e)
+        {
+            thrown = string(e.what()) == "coroutine test";
+        }
+        check(thrown, "and so does its exception");
+    }
+
+    // a sleeping coroutine takes up no thread
+    void many_sleeping()
+    {
+        auto pool = one_thread_pool();
+
+        vector<task_future<int>> futures;
+        for (int i = 0; i < 200; ++i)
+        {
+            futures.push_back(spawn_coroutine(*pool, [i](coroutine_context &self)
+            {
+                self.sleep(pt::milliseconds(100));
+                self.sleep(pt::milliseconds(100));
+                return i;
+            }));
+        }
+
+        const auto all = when_all(futures);
+        check(wait_for(all, pt::seconds(3)), "200 coroutines sleeping 200ms finish together on one thread");
+
+        bool values = true;
+        for (int i = 0; values && i < 200; ++i)
+            values = futures[i].get() == i;
+        check(values, "each with its own value");
+    }
+
+    // the awaited task needs the only thread the coroutine runs on
+    void await_future()
+    {
+        auto pool = one_thread_pool();
+        threadpool *p = pool.get();
+
+        const auto sum = spawn_coroutine(*pool, [p](coroutine_context &self)
+        {
+            int sum = 0;
+            for (int i = 1; i <= 3; ++i)
+                sum += self.await(p->submit([i]() { return i; }));
+            return sum;
+        });
+        check(wait_for(sum, pt::seconds(5)) && sum.get() == 6, "await gets the values of tasks on the same thread");
+
+        const auto recovered = spawn_coroutine(*pool, [p](coroutine_context &self)
+        {
+            try
+            {
+                return self.await(p->submit([]() -> int { throw std::runtime_error("coroutine test"); }));
+            }
+            catch (std::runtime_error &)
+            {
+                return -1;
+            }
+        });
+        check(wait_for(recovered, pt::seconds(5)) && recovered.get() == -1, "await rethrows the task's exception");
+    }
+
+    // two coroutines yielding to each other on one thread take turns
+    void yields()
+    {
+        auto pool = busy_pool(threadpool::SINGLE_QUEUE, pt::milliseconds(50));
+
+        boost::mutex mutex;
+        string order;
+        vector<task_future<int>> futures;
+        for (char c = 'a'; c <= 'b'; ++c)
+        {
+            futures.push_back(spawn_coroutine(*pool, [c, &mutex, &order](coroutine_context &self)
+            {
+                for (int i = 0; i < 3; ++i)
+                {
+                    {
+                        boost::mutex::scoped_lock lock(mutex);
+                        order += c;
+                    }
+                    self.yield();
+                }
+                return 0;
+            }));
+        }
+
+        const bool finished = wait_for(when_all(futures), pt::seconds(5));
+        check(finished && order == "ababab", "yield lets the other coroutine run, got " + order);
+    }
+
+    void readable()
+    {
+        auto pool = one_thread_pool();
+
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            check(false, "pipe");
+            return;
+        }
+
+        const int read_fd = fds[0];
+        const auto byte = spawn_coroutine(*pool, [read_fd](coroutine_context &self)
+        {
+            self.await_readable(read_fd);
+            char c = 0;
+            return read(read_fd, &c, 1) == 1 ? int(c) : -1;
+        });
+
+        // the thread is free while the coroutine waits for the pipe
+        const auto other = pool->submit([]() { return 1; });
+        check(wait_for(other, pt::seconds(5)) && !byte.is_ready(), "a coroutine waiting for a fd takes up no thread");
+
+        const char c = 'x';
+        check(write(fds[1], &c, 1) == 1 && wait_for(byte, pt::seconds(5)) && byte.get() == 'x',
+              "await_readable resumes once there's something to read");
+
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    void canceled()
+    {
+        auto pool = one_thread_pool();
+
+        const auto token = cancellation_token::create();
+        auto steps = boost::make_shared<atomic<size_t>>(0);
+        const auto sleeper = spawn_coroutine(*pool, [steps](coroutine_context &self)
+        {
+            for (int i = 0; i < 1000; ++i)
+            {
+                ++*steps;
+                self.sleep(pt::milliseconds(10));
+            }
+            return 0;
+        }, token);
+
+        wait_until([steps]() { return *steps >= 3; }, pt::seconds(5));
+        token.cancel();
+        check(wait_for(sleeper, pt::seconds(2)) && is_canceled(sleeper),
+              "canceling the token drops the coroutine at its next wait");
+
+        const size_t after_cancel = *steps;
+        boost::this_thread::sleep(pt::milliseconds(50));
+        check(*steps == after_cancel, "it doesn't go on");
+
+        auto ran = boost::make_shared<atomic_bool>(false);
+        const auto never = spawn_coroutine(*pool, [ran](coroutine_context &)
+        {
+            *ran = true;
+            return 0;
+        }, token);
+        check(wait_for(never, pt::seconds(2)) && is_canceled(never) && !*ran,
+              "a coroutine of a canceled token never starts");
+    }
+}
+
+int main()
+{
+    results();
+    many_sleeping();
+    await_future();
+    yields();
+    readable();
+    canceled();
+
+    return test::result();
+}
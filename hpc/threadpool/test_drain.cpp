@@ -0,0 +1,91 @@
+#include "stdafx.h"
+#include "threadpool.h"
+#include "test_check.h"
+
+boost::mutex cout_mutex;
+
+// drain() with futures and continuations the drain never lets run: they have to come out canceled,
+// nothing may throw out of a destructor
+namespace
+{
+    using namespace test;
+
+    // the dropped tasks go to the caller and are destroyed there, after the drain
+    void dropped_to_caller()
+    {
+        auto pool = busy_pool();
+        const auto first = pool->submit([]() { return 1; });
+        const auto second = first.then(&plus_one);
+        const auto third = second.then(&plus_one);
+
+        vector<threadpool::dropped_task_t> dropped;
+        pool->drain(pt::milliseconds(10), &dropped);
+        check(dropped.size() == 1, "drain hands the queued future task over");
+        check(!second.is_ready(), "its continuation waits while the caller holds it");
+
+        dropped.clear();
+        check(is_canceled(first), "a dropped future task gets task_canceled");
+        check(is_canceled(second) && is_canceled(third), "and so do its continuations");
+
+        bool stopped = false;
+        try
+        {
+            pool->submit([]() { return 1; });
+        }
+        catch (pool_stopped &)
+        {
+            stopped = true;
+        }
+        check(stopped, "submit after the drain throws pool_stopped");
+    }
+
+    // nobody takes the dropped tasks, drain destroys them
+    void dropped_by_drain()
+    {
+        auto pool = busy_pool();
+        const auto first = pool->submit([]() { return 1; });
+        const auto second = first.then(&plus_one);
+
+        pool->drain(pt::milliseconds(10));
+        check(is_canceled(first) && is_canceled(second), "drain without a dropped list cancels the continuations");
+    }
+
+    // a continuation of a task that finished before the drain, but chained after it
+    void chained_after_drain()
+    {
+        auto pool = busy_pool();
+        pool->drain(pt::milliseconds(500));
+
+        const auto state = boost::make_shared<future_state<int>>(pool.get());
+        const task_future<int> first(state);
+        const auto second = first.then(&plus_one);
+        state->set_value(1);
+        check(is_canceled(second), "a continuation of a drained pool gets task_canceled");
+    }
+
+    // a sleeping coroutine is dropped with the timers and destroyed on the draining thread
+    void coroutine_dropped()
+    {
+        auto pool = boost::make_shared<threadpool>(1, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+        const auto first = spawn_coroutine(*pool, [](coroutine_context &self)
+        {
+            self.sleep(pt::seconds(10));
+            return 1;
+        });
+        const auto second = first.then(&plus_one);
+        boost::this_thread::sleep(pt::milliseconds(50));
+
+        pool->drain(pt::milliseconds(10));
+        check(is_canceled(first) && is_canceled(second), "a drained coroutine cancels its continuations");
+    }
+}
+
+int main()
+{
+    dropped_to_caller();
+    dropped_by_drain();
+    chained_after_drain();
+    coroutine_dropped();
+
+    return test::result();
+}
@@ -0,0 +1,130 @@
+#include "stdafx.h"
+#include "threadpool.h"
+#include "test_check.h"
+
+boost::mutex cout_mutex;
+
+// submit, then, when_all and when_any: values and exceptions get through, nothing waits on a worker
+namespace
+{
+    using namespace test;
+
+    int throw_error()
+    {
+        throw std::runtime_error("futures test");
+    }
+
+    template<typename R>
+    bool has_error(const task_future<R> &f)
+    {
+        try
+        {
+            f.get();
+        }
+        catch (std::runtime_error &e)
+        {
+            return string(e.what()) == "futures test";
+        }
+        return false;
+    }
+
+    void values_and_exceptions()
+    {
+        threadpool pool(2, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+
+        const auto value = pool.submit([]() { return 41; });
+        check(value.get() == 41, "submit returns the task's value");
+
+        bool ran = false;
+        const auto nothing = pool.submit([&ran]() { ran = true; });
+        nothing.wait();
+        check(ran && nothing.is_ready(), "a void task's future is ready once it has run");
+
+        const auto error = pool.submit(&throw_error);
+        check(wait_for(error, pt::seconds(5)) && has_error(error), "get() rethrows the task's exception");
+    }
+
+    void continuations()
+    {
+        threadpool pool(2, pt::seconds(1), threadpool::WORK_STEALING, event_log::LOG_NONE);
+
+        const auto chain = pool.submit([]() { return 1; }).then(&plus_one).then(&plus_one).then(&plus_one);
+        check(chain.get() == 4, "a chain of continuations passes the value along");
+
+        const auto error = pool.submit(&throw_error).then(&plus_one).then(&plus_one);
+        check(wait_for(error, pt::seconds(5)) && has_error(error), "and the exception");
+
+        const auto recovered = pool.submit(&throw_error).then([](const task_future<int> &f) -> int
+        {
+            return has_error(f) ? 0 : -1;
+        });
+        check(recovered.get() == 0, "a continuation sees the exception and may recover");
+
+        // the future is already ready when then() is called
+        const auto ready = pool.submit([]() { return 1; });
+        ready.wait();
+        check(ready.then(&plus_one).get() == 2, "then() of a ready future runs");
+    }
+
+    void all()
+    {
+        threadpool pool(4, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+
+        vector<task_future<int>> futures;
+        for (int i = 0; i < 10; ++i)
+        {
+            futures.push_back(pool.submit([i]()
+            {
+                boost::this_thread::sleep(pt::milliseconds(10 - i));
+                return i;
+            }));
+        }
+
+        const auto ready = when_all(futures).get();
+        bool values = ready.size() == 10;
+        for (size_t i = 0; values && i < ready.size(); ++i)
+            values = ready[i].is_ready() && ready[i].get() == int(i);
+        check(values, "when_all is ready with all the futures, in their order");
+
+        const vector<task_future<int>> none;
+        check(when_all(none).is_ready() && when_all(none).get().empty(), "when_all of nothing is ready at once");
+
+        const task_future<int> mixed[] = { pool.submit([]() { return 1; }), pool.submit(&throw_error) };
+        const auto with_error = when_all(mixed).get();
+        check(with_error[0].get() == 1 && has_error(with_error[1]), "when_all passes an exception in its future");
+    }
+
+    void any()
+    {
+        threadpool pool(4, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+
+        vector<task_future<int>> futures;
+        for (int i = 0; i < 4; ++i)
+        {
+            futures.push_back(pool.submit([i]()
+            {
+                boost::this_thread::sleep(pt::milliseconds(i == 2 ? 0 : 300));
+                return i;
+            }));
+        }
+
+        const auto first = when_any(futures).get();
+        check(first.first == 2 && first.second[2].get() == 2, "when_any gives the index of the first one ready");
+
+        const vector<task_future<int>> none;
+        check(when_any(none).is_ready() && when_any(none).get().first == size_t(-1),
+              "when_any of nothing is ready at once, without an index");
+
+        when_all(futures).wait();
+    }
+}
+
+int main()
+{
+    values_and_exceptions();
+    continuations();
+    all();
+    any();
+
+    return test::result();
+}
@@ -0,0 +1,197 @@
+#include "stdafx.h"
+#include "threadpool.h"
+#include "test_check.h"
+
+boost::mutex cout_mutex;
+
+// every task runs exactly once in every scheduling mode, wherever it's added from
+namespace
+{
+    using namespace test;
+
+    // from outside of the pool, one by one and as a batch
+    void added_from_outside(threadpool::scheduling_t scheduling)
+    {
+        threadpool pool(4, pt::seconds(1), scheduling, event_log::LOG_NONE);
+
+        const size_t n = 10000;
+        auto runs = boost::make_shared<vector<atomic<size_t>>>(2 * n);
+        for (size_t i = 0; i < n; ++i)
+            pool.add_task([runs, i]() { ++(*runs)[i]; });
+
+        vector<boost::function<void()>> batch;
+        for (size_t i = n; i < 2 * n; ++i)
+            batch.push_back([runs, i]() { ++(*runs)[i]; });
+        pool.add_tasks(batch);
+
+        check(wait_until([&pool]() { return pool.stats().tasks_finished == 2 * n; }, pt::seconds(20)),
+              name(scheduling) + ": the tasks added from outside finish");
+
+        bool once = true;
+        for (size_t i = 0; i < 2 * n; ++i)
+            once = once && (*runs)[i] == 1;
+        check(once, name(scheduling) + ": each of them runs once");
+    }
+
+    // a tree of tasks, every one adds its children from the worker running it
+    void spawn(threadpool *pool, size_t depth, atomic<size_t> *done)
+    {
+        ++*done;
+        if (depth == 0)
+            return;
+
+        for (size_t i = 0; i < 4; ++i)
+            pool->add_task([pool, depth, done]() { spawn(pool, depth - 1, done); });
+    }
+
+    void added_from_tasks(threadpool::scheduling_t scheduling)
+    {
+        threadpool pool(4, pt::seconds(1), scheduling, event_log::LOG_NONE);
+        atomic<size_t> done(0);
+
+        // 1 + 4 + ... + 4^6
+        const size_t n = (4 * 4 * 4 * 4 * 4 * 4 * 4 - 1) / 3;
+        threadpool *p = &pool;
+        pool.add_task([p, &done]() { spawn(p, 6, &done); });
+
+        check(wait_until([&done, n]() { return done == n; }, pt::seconds(20)) && pool.stats().tasks_added == n,
+              name(scheduling) + ": the tasks added from tasks run once each");
+        wait_until([&pool, n]() { return pool.stats().tasks_finished == n; }, pt::seconds(5));
+    }
+
+    // LOCK_FREE_QUEUE: more tasks than the ring holds while the only worker is busy, the rest go to the
+    // shared queue
+    void ring_overflow()
+    {
+        auto pool = busy_pool(threadpool::LOCK_FREE_QUEUE);
+
+        const size_t n = (size_t(1) << threadpool::lock_free_queue_log_capacity) + 5000;
+        auto runs = boost::make_shared<vector<atomic<size_t>>>(n);
+        for (size_t i = 0; i < n; ++i)
+            pool->add_task([runs, i]() { ++(*runs)[i]; });
+
+        check(wait_until([&pool]() { return pool->stats().tasks_finished == pool->stats().tasks_added; },
+                         pt::seconds(20)), "lockfree: the tasks beyond the ring's capacity run too");
+
+        bool once = true;
+        for (size_t i = 0; i < n; ++i)
+            once = once && (*runs)[i] == 1;
+        check(once, "lockfree: each of them once");
+    }
+
+    // more tasks alive at once than the task table has slots, the rest go to its overflow map: they can still
+    // be canceled and run once otherwise, twice over so the second spike goes to the trimmed map
+    void table_overflow()
+    {
+        threadpool pool(1, make_shared<spawn_on_demand_policy>(pt::seconds(1), 1), threadpool::SINGLE_QUEUE,
+                        event_log::LOG_NONE);
+
+        bool canceled = true;
+        bool once = true;
+        for (size_t spike = 0; spike < 2; ++spike)
+        {
+            pool.add_task([]() { boost::this_thread::sleep(pt::seconds(1)); });
+            boost::this_thread::sleep(pt::milliseconds(20));
+            const threadpool::task_id_t first_id = pool.stats().tasks_added;
+            const uint64_t finished = pool.stats().tasks_finished;
+
+            const size_t n = (size_t(1) << threadpool::task_table_log_capacity) + 5000;
+            auto runs = boost::make_shared<vector<atomic<size_t>>>(n);
+            for (size_t i = 0; i < n; ++i)
+                pool.add_task([runs, i]() { ++(*runs)[i]; });
+
+            for (size_t i = n - 10; i < n; ++i)
+                canceled = canceled && pool.cancel_task(first_id + i) == threadpool::REMOVED_FROM_QUEUE;
+
+            // the busy task and the ones not canceled
+            wait_until([&pool, finished, n]() { return pool.stats().tasks_finished == finished + 1 + n - 10; },
+                       pt::seconds(20));
+            for (size_t i = 0; i < n; ++i)
+                once = once && (*runs)[i] == (i < n - 10 ? 1 : 0);
+        }
+
+        check(canceled, "the tasks in the task table's overflow can be canceled");
+        check(once, "the others run once");
+    }
+
+    // LOCK_FREE_QUEUE: several producers at once against the consumers
+    void concurrent_producers()
+    {
+        threadpool pool(4, pt::seconds(1), threadpool::LOCK_FREE_QUEUE, event_log::LOG_NONE);
+
+        const size_t producers = 4;
+        const size_t n = 20000;
+        auto runs = boost::make_shared<vector<atomic<size_t>>>(producers * n);
+
+        boost::thread_group threads;
+        for (size_t p = 0; p < producers; ++p)
+        {
+            threads.create_thread([&pool, runs, p, n]()
+            {
+                for (size_t i = p * n; i < (p + 1) * n; ++i)
+                    pool.add_task([runs, i]() { ++(*runs)[i]; });
+            });
+        }
+        threads.join_all();
+
+        check(wait_until([&pool, producers, n]() { return pool.stats().tasks_finished == producers * n; },
+                         pt::seconds(20)), "lockfree: the tasks of concurrent producers finish");
+
+        bool once = true;
+        for (size_t i = 0; i < producers * n; ++i)
+            once = once && (*runs)[i] == 1;
+        check(once, "lockfree: each of them once");
+    }
+
+    // one task adds the others to its own deque and then blocks its worker, the rest have to steal them
+    void stolen()
+    {
+        threadpool pool(4, make_shared<spawn_on_demand_policy>(pt::seconds(1), 4), threadpool::WORK_STEALING,
+                        event_log::LOG_NONE);
+
+        boost::mutex mutex;
+        std::set<boost::thread::id> threads;
+        atomic<size_t> done(0);
+
+        threadpool *p = &pool;
+        pool.add_task([p, &mutex, &threads, &done]()
+        {
+            for (size_t i = 0; i < 32; ++i)
+            {
+                p->add_task([&mutex, &threads, &done]()
+                {
+                    {
+                        boost::mutex::scoped_lock lock(mutex);
+                        threads.insert(boost::this_thread::get_id());
+                    }
+                    boost::this_thread::sleep(pt::milliseconds(5));
+                    ++done;
+                });
+            }
+
+            boost::this_thread::sleep(pt::milliseconds(300));
+        });
+
+        check(wait_until([&done]() { return done == 32; }, pt::seconds(10)), "stealing: a busy worker's tasks run");
+        check(threads.size() > 1, "stealing: by the other workers");
+        wait_until([&pool]() { return pool.stats().tasks_finished == 33; }, pt::seconds(5));
+    }
+}
+
+int main()
+{
+    const threadpool::scheduling_t modes[] = { threadpool::SINGLE_QUEUE, threadpool::WORK_STEALING,
+                                               threadpool::LOCK_FREE_QUEUE };
+    BOOST_FOREACH(threadpool::scheduling_t scheduling, modes)
+    {
+        added_from_outside(scheduling);
+        added_from_tasks(scheduling);
+    }
+
+    stolen();
+    ring_overflow();
+    table_overflow();
+    concurrent_producers();
+
+    return test::result();
+}
@@ -0,0 +1,193 @@
+#include "stdafx.h"
+#include "threadpool.h"
+#include "test_check.h"
+
+boost::mutex cout_mutex;
+
+// task_group, parallel_for and parallel_reduce: every task runs once, waits never deadlock
+namespace
+{
+    using namespace test;
+
+    void run_and_wait()
+    {
+        threadpool pool(4, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+        atomic<size_t> done(0);
+
+        task_group group(pool);
+        for (size_t i = 0; i < 100; ++i)
+        {
+            group.run([&group, &done]()
+            {
+                // run() from the group's own tasks counts too
+                group.run([&done]() { ++done; });
+                ++done;
+            });
+        }
+        group.wait();
+
+        check(done == 200, "wait() returns after all the group's tasks, the nested runs included");
+    }
+
+    size_t fib(threadpool &pool, size_t n)
+    {
+        if (n < 2)
+            return n;
+
+        size_t a = 0;
+        size_t b = 0;
+        task_group group(pool);
+        group.run([&pool, &a, n]() { a = fib(pool, n - 1); });
+        group.run([&pool, &b, n]() { b = fib(pool, n - 2); });
+        group.wait();
+        return a + b;
+    }
+
+    // nested groups and parallel_fors waited for from the only worker
+    void nested_on_one_thread()
+    {
+        threadpool pool(1, make_shared<spawn_on_demand_policy>(pt::seconds(1), 1), threadpool::SINGLE_QUEUE,
+                        event_log::LOG_NONE);
+
+        size_t res = 0;
+        check_finishes([&pool, &res]()
+        {
+            task_group group(pool);
+            group.run([&pool, &res]() { res = fib(pool, 15); });
+            group.wait();
+        }, pt::seconds(10), "nested groups on a pool of one thread don't deadlock");
+        check(res == 610, "and get the right result");
+
+        atomic<size_t> done(0);
+        check_finishes([&pool, &done]()
+        {
+            parallel_for(pool, 0, 8, [&pool, &done](int)
+            {
+                parallel_for(pool, 0, 8, [&done](int) { ++done; }, 1);
+            }, 1);
+        }, pt::seconds(10), "nested parallel_fors on a pool of one thread don't deadlock");
+        check(done == 64, "and run every inner index");
+    }
+
+    void exceptions()
+    {
+        threadpool pool(2, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+        atomic<size_t> done(0);
+
+        task_group group(pool);
+        group.run([]() { throw std::runtime_error("task_group test"); });
+        for (size_t i = 0; i < 10; ++i)
+            group.run([&done]() { ++done; });
+
+        bool thrown = false;
+        try
+        {
+            group.wait();
+        }
+        catch (std::runtime_error &e)
+        {
+            thrown = string(e.what()) == "task_group test";
+        }
+        check(thrown, "wait() rethrows the exception of a task");
+        check(done == 10, "after the others have run");
+
+        bool thrown_again = false;
+        try
+        {
+            group.wait();
+        }
+        catch (...)
+        {
+            thrown_again = true;
+        }
+        check(!thrown_again, "only once");
+    }
+
+    // the canceled group's tasks are skipped by the pool and by wait() alike
+    void canceled()
+    {
+        auto pool = busy_pool();
+        atomic<size_t> done(0);
+
+        task_group group(*pool);
+        for (size_t i = 0; i < 10; ++i)
+            group.run([&done]() { ++done; });
+
+        group.cancel();
+        group.wait();
+        check(group.is_canceled() && done == 0, "a canceled group's tasks never run");
+    }
+
+    void parallel_for_indices()
+    {
+        threadpool pool(4, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+
+        const size_t grains[] = { 0, 1, 7, 100000 };
+        BOOST_FOREACH(size_t grain, grains)
+        {
+            const size_t n = 10007;
+            vector<atomic<size_t>> visits(n);
+            parallel_for(pool, size_t(0), n, [&visits](size_t i) { ++visits[i]; }, grain);
+
+            bool once = true;
+            for (size_t i = 0; i < n; ++i)
+                once = once && visits[i] == 1;
+            check(once, "parallel_for visits every index once, grain " + boost::lexical_cast<string>(grain));
+        }
+
+        bool called = false;
+        parallel_for(pool, 5, 5, [&called](int) { called = true; });
+        check(!called, "parallel_for of an empty range calls nothing");
+    }
+
+    void parallel_reduce_results()
+    {
+        threadpool pool(4, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+
+        const uint64_t n = 100003;
+        const uint64_t sum = parallel_reduce(pool, uint64_t(0), n, uint64_t(0),
+            [](uint64_t first, uint64_t last, uint64_t res)
+            {
+                for (; first < last; ++first)
+                    res += first;
+                return res;
+            },
+            [](uint64_t a, uint64_t b) { return a + b; });
+        check(sum == n * (n - 1) / 2, "parallel_reduce sums a range");
+
+        // join isn't commutative here, the parts have to be joined in order
+        typedef vector<size_t> indices_t;
+        const indices_t indices = parallel_reduce(pool, size_t(0), size_t(1000), indices_t(),
+            [](size_t first, size_t last, indices_t res)
+            {
+                for (; first < last; ++first)
+                    res.push_back(first);
+                return res;
+            },
+            [](indices_t a, const indices_t &b)
+            {
+                a.insert(a.end(), b.begin(), b.end());
+                return a;
+            }, 13);
+
+        bool in_order = indices.size() == 1000;
+        for (size_t i = 0; in_order && i < indices.size(); ++i)
+            in_order = indices[i] == i;
+        check(in_order, "parallel_reduce joins the parts left to right");
+
+        check(parallel_reduce(pool, 3, 3, 42, [](int, int, int res) { return res; }, std::plus<int>()) == 42,
+              "parallel_reduce of an empty range returns the identity");
+    }
+}
+
+int main()
+{
+    run_and_wait();
+    nested_on_one_thread();
+    exceptions();
+    canceled();
+    parallel_for_indices();
+    parallel_reduce_results();
+
+    return test::result();
+}
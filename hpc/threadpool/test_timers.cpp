@@ -0,0 +1,103 @@
+#include "stdafx.h"
+#include "threadpool.h"
+#include "test_check.h"
+
+boost::mutex cout_mutex;
+
+// schedule_after and schedule_every: not early, not lost, and cancel_task stops them
+namespace
+{
+    using namespace test;
+
+    void after_not_early()
+    {
+        threadpool pool(2, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+
+        const uint64_t start_ns = steady_clock_ns();
+        auto fired_ns = boost::make_shared<atomic<uint64_t>>(0);
+        auto runs = boost::make_shared<atomic<size_t>>(0);
+        pool.schedule_after(pt::milliseconds(50), [fired_ns, runs]()
+        {
+            *fired_ns = steady_clock_ns();
+            ++*runs;
+        });
+
+        check(wait_until([runs]() { return *runs != 0; }, pt::seconds(5)), "schedule_after runs the task");
+        check(*fired_ns >= start_ns + 50000000, "not before the delay");
+
+        boost::this_thread::sleep(pt::milliseconds(100));
+        check(*runs == 1 && pool.stats().timers == 0, "once");
+    }
+
+    // shorter delays fire first, whatever the order they were scheduled in
+    void after_in_order()
+    {
+        threadpool pool(1, make_shared<spawn_on_demand_policy>(pt::seconds(1), 1), threadpool::SINGLE_QUEUE,
+                        event_log::LOG_NONE);
+
+        boost::mutex mutex;
+        vector<int> order;
+        const int delays[] = { 120, 40, 80, 0 };
+        BOOST_FOREACH(int delay, delays)
+        {
+            pool.schedule_after(pt::milliseconds(delay), [&mutex, &order, delay]()
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                order.push_back(delay);
+            });
+        }
+
+        const bool all = wait_until([&mutex, &order]()
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            return order.size() == 4;
+        }, pt::seconds(5));
+
+        const int expected[] = { 0, 40, 80, 120 };
+        check(all && std::equal(order.begin(), order.end(), expected), "timers fire in the order of their delays");
+    }
+
+    void after_canceled()
+    {
+        threadpool pool(2, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+
+        auto runs = boost::make_shared<atomic<size_t>>(0);
+        const threadpool::task_id_t id = pool.schedule_after(pt::milliseconds(50), [runs]() { ++*runs; });
+        check(pool.is_pending(id), "a scheduled timer is pending");
+        check(pool.cancel_task(id) == threadpool::REMOVED_FROM_QUEUE, "cancel_task removes a waiting timer");
+        check(!pool.is_pending(id), "and it's no longer pending");
+
+        boost::this_thread::sleep(pt::milliseconds(150));
+        check(*runs == 0, "a canceled timer never runs");
+    }
+
+    void every_until_canceled()
+    {
+        threadpool pool(2, pt::seconds(1), threadpool::SINGLE_QUEUE, event_log::LOG_NONE);
+
+        auto runs = boost::make_shared<atomic<size_t>>(0);
+        const uint64_t start_ns = steady_clock_ns();
+        const threadpool::task_id_t id = pool.schedule_every(pt::milliseconds(10), [runs]() { ++*runs; });
+
+        check(wait_until([runs]() { return *runs >= 5; }, pt::seconds(5)), "schedule_every runs the task repeatedly");
+        check(steady_clock_ns() - start_ns >= 50000000, "once a period");
+
+        check(pool.cancel_task(id) != threadpool::NOT_FOUND, "cancel_task finds a periodic task");
+
+        // one run may have been on its way to a worker
+        boost::this_thread::sleep(pt::milliseconds(30));
+        const size_t after_cancel = *runs;
+        boost::this_thread::sleep(pt::milliseconds(100));
+        check(*runs == after_cancel && !pool.is_pending(id), "and it stops");
+    }
+}
+
+int main()
+{
+    after_not_early();
+    after_in_order();
+    after_canceled();
+    every_until_canceled();
+
+    return test::result();
+}
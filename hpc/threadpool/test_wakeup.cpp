@@ -0,0 +1,118 @@
+#include "stdafx.h"
+#include "threadpool.h"
+#include "test_check.h"
+
+boost::mutex cout_mutex;
+
+// Parked and spinning workers: a task added while they are idle never waits for a timeout. The idle
+// timeout is long and the thread count fixed, so a lost wakeup shows up as a task that doesn't start.
+namespace
+{
+    using namespace test;
+
+    shared_ptr<threadpool> idle_pool(threadpool::scheduling_t scheduling, bool spin)
+    {
+        auto pool = boost::make_shared<threadpool>(4, make_shared<spawn_on_demand_policy>(pt::seconds(30), 4),
+                                                   scheduling, event_log::LOG_NONE);
+        if (spin)
+            pool->set_spin(pt::microseconds(50), 10);
+        return pool;
+    }
+
+    string name(threadpool::scheduling_t scheduling, bool spin)
+    {
+        return test::name(scheduling) + (spin ? ", spinning" : ", parking");
+    }
+
+    // one at a time with gaps, so the workers are parked (or spinning) every time
+    void one_by_one(threadpool::scheduling_t scheduling, bool spin)
+    {
+        auto pool = idle_pool(scheduling, spin);
+        auto done = boost::make_shared<atomic<size_t>>(0);
+
+        bool started = true;
+        for (size_t i = 0; started && i < 100; ++i)
+        {
+            pool->add_task([done]() { ++*done; });
+            started = wait_until([done, i]() { return *done == i + 1; }, pt::seconds(2));
+            boost::this_thread::sleep(pt::microseconds(i % 3 == 0 ? 0 : 500));
+        }
+        check(started, name(scheduling, spin) + ": every task added to an idle pool starts");
+    }
+
+    // as many blocking tasks as there are workers, at once: each worker has to get one, a spinning worker
+    // taking the first must not swallow the wakeups of the others
+    void burst(threadpool::scheduling_t scheduling, bool spin)
+    {
+        auto pool = idle_pool(scheduling, spin);
+        auto running = boost::make_shared<atomic<size_t>>(0);
+        auto release = boost::make_shared<atomic_bool>(false);
+
+        for (size_t round = 0; round < 10; ++round)
+        {
+            *running = 0;
+            *release = false;
+            for (size_t i = 0; i < 4; ++i)
+            {
+                pool->add_task([running, release]()
+                {
+                    ++*running;
+                    while (!*release)
+                        boost::this_thread::sleep(pt::microseconds(100));
+                });
+            }
+
+            const bool all = wait_until([running]() { return *running == 4; }, pt::seconds(2));
+            *release = true;
+            if (!all)
+            {
+                check(false, name(scheduling, spin) + ": a burst wakes a worker for every task");
+                return;
+            }
+
+            wait_until([&pool, round]() { return pool->stats().tasks_finished == 4 * (round + 1); }, pt::seconds(2));
+            boost::this_thread::sleep(pt::milliseconds(1));
+        }
+        check(true, name(scheduling, spin) + ": a burst wakes a worker for every task");
+    }
+
+    // tasks added by tasks, a ping-pong between workers that go idle in between
+    void chain(threadpool::scheduling_t scheduling, bool spin)
+    {
+        auto pool = idle_pool(scheduling, spin);
+        auto done = boost::make_shared<atomic<size_t>>(0);
+
+        threadpool *p = pool.get();
+        boost::function<void(size_t)> step;
+        step = [p, done, &step](size_t left)
+        {
+            ++*done;
+            if (left != 0)
+                p->add_task([&step, left]() { step(left - 1); });
+        };
+        pool->add_task([&step]() { step(999); });
+
+        check(wait_until([done]() { return *done == 1000; }, pt::seconds(5)),
+              name(scheduling, spin) + ": a chain of tasks adding tasks runs through");
+
+        // step has to outlive the tasks running it
+        wait_until([&pool]() { return pool->stats().tasks_finished == 1000; }, pt::seconds(5));
+    }
+}
+
+int main()
+{
+    const threadpool::scheduling_t modes[] = { threadpool::SINGLE_QUEUE, threadpool::WORK_STEALING,
+                                               threadpool::LOCK_FREE_QUEUE };
+    BOOST_FOREACH(threadpool::scheduling_t scheduling, modes)
+    {
+        for (int spin = 0; spin < 2; ++spin)
+        {
+            one_by_one(scheduling, spin != 0);
+            burst(scheduling, spin != 0);
+            chain(scheduling, spin != 0);
+        }
+    }
+
+    return test::result();
+}
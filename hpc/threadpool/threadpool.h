@@ -1,7 +1,27 @@
 #pragma once
 
+#include "work_stealing_deque.h"
+#include "mpmc_queue.h"
+#include "slot_table.h"
+#include "small_task.h"
+#include "node_pool.h"
+#include "latency_histogram.h"
+#include "event_log.h"
+#include "sizing_policy.h"
+#include "topology.h"
+#include "cancellation_token.h"
+#include "timer_wheel.h"
+#include "io_reactor.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
+
 extern boost::mutex cout_mutex;
 
+template<typename R>
+struct task_future;
+
 struct sleep_task
 {
     sleep_task(int seconds)
@@ -13,16 +33,31 @@ struct sleep_task
         boost::this_thread::sleep(dur_);
     }
 
+    pt::time_duration duration() const
+    {
+        return dur_;
+    }
+
 private:
     pt::time_duration dur_;
 };
 
+// what add_task and the like throw once drain() has stopped the intake
+struct pool_stopped
+    : std::runtime_error
+{
+    pool_stopped()
+        : std::runtime_error("threadpool is draining")
+    {}
+};
+
 struct threadpool
     : boost::noncopyable
 {
-    typedef boost::function<void()> task_t;
+    typedef small_task task_t;
     typedef uint64_t task_id_t;
-    
+    typedef boost::integer_range<task_id_t> task_id_range_t;
+
     enum cancel_result_t
     {
         NOT_FOUND,
@@ -30,6 +65,144 @@ struct threadpool
         TERMINATED
     };
 
+    enum scheduling_t
+    {
+        // all workers share one mutex-guarded FIFO
+        SINGLE_QUEUE,
+        // every worker owns a Chase-Lev deque: tasks added from a worker go to its own deque (LIFO for the owner),
+        // tasks added from outside go to the shared FIFO, workers with nothing to do steal from the others
+        WORK_STEALING,
+        // bounded lock-free MPMC ring shared by all workers, the mutex-guarded FIFO only takes the overflow
+        LOCK_FREE_QUEUE
+    };
+
+    // LOCK_FREE_QUEUE ring size
+    static const size_t lock_free_queue_log_capacity = 14;
+    // task table slots, 16 bytes each; tasks beyond that many alive at once go to its overflow map, which
+    // grows with the queue (add_task never waits) and gives its memory back once it empties again
+    static const size_t task_table_log_capacity = 16;
+    // the shared queue isn't compacted for fewer tombstones than that
+    static const size_t min_compaction = 64;
+    static const task_id_t no_task = task_id_t(-1);
+    // timer wheel resolution, schedule_after and schedule_every run up to that late
+    static const uint64_t timer_tick_ns = 1000000;
+
+    // Priorities are strict: a task is only taken while no higher priority one is queued. Within a priority
+    // tasks go by due time, earliest first (EDF): a task with a deadline is due at the deadline, one without is
+    // due priority_slack_ns after it was added. A task still queued past its due time is overdue, and every
+    // aging_share-th pick goes to an overdue lower priority task, so low priority work slows down under
+    // high priority load but never starves.
+    // NORMAL tasks without a deadline take the fast paths of the scheduling mode (own deque, ring), the rest
+    // waits in the shared queue, and workers look there first while it has HIGH, deadline or overdue LOW tasks.
+    enum priority_t
+    {
+        PRIORITY_LOW,
+        PRIORITY_NORMAL,
+        PRIORITY_HIGH
+    };
+    static const size_t num_priorities = 3;
+    static const size_t aging_share = 4;
+
+    static uint64_t priority_slack_ns(priority_t priority)
+    {
+        static const uint64_t slack_ms[num_priorities] = { 100, 10, 1 };
+        return slack_ms[priority] * 1000000;
+    }
+
+    // what goes to the event log, see format_event for the text form
+    enum event_type_t
+    {
+        EVENT_THREAD_CREATED,  // a = thread id, flags = 1 for an elastic worker
+        EVENT_THREAD_FINISHED, // a = thread id
+        EVENT_TASK_ASSIGNED,   // a = task id, b = thread id
+        EVENT_TASK_FINISHED,   // a = task id, b = thread id
+        EVENT_TASK_CANCELED,   // a = task id, b = thread id
+        EVENT_CLEANUP,
+        EVENT_DRAINED          // a = tasks dropped, b = tasks interrupted
+    };
+
+    // see stats()
+    struct stats_t
+    {
+        // alive now
+        size_t hot_threads;
+        size_t worker_threads;
+        // elastic worker threads, since the pool was created
+        uint64_t workers_created;
+        uint64_t workers_expired;
+
+        uint64_t tasks_added;
+        uint64_t tasks_started;
+        uint64_t tasks_finished;
+        // canceled while running
+        uint64_t tasks_interrupted;
+        // canceled while queued
+        uint64_t tasks_removed;
+        uint64_t tasks_on_hot_threads;
+        uint64_t tasks_on_worker_threads;
+        // added and neither started nor canceled yet
+        uint64_t queue_depth;
+        // schedule_after/schedule_every tasks waiting for their time, canceled ones until they'd be due
+        uint64_t timers;
+
+        // add -> assigned to a thread, ns
+        latency_histogram::snapshot_t queue_latency;
+        // assigned -> finished or interrupted, ns
+        latency_histogram::snapshot_t service_time;
+    };
+
+    // a task drain() took out of the pool before it started, to be added again (or not) by the caller
+    struct dropped_task_t
+    {
+        dropped_task_t(task_id_t id, task_t &&task, priority_t priority)
+            : id(id)
+            , task(std::move(task))
+            , priority(priority)
+        {}
+
+        dropped_task_t(dropped_task_t &&other)
+            : id(other.id)
+            , task(std::move(other.task))
+            , priority(other.priority)
+            , delay(other.delay)
+            , period(other.period)
+        {}
+
+        dropped_task_t &operator=(dropped_task_t &&other)
+        {
+            id = other.id;
+            task = std::move(other.task);
+            priority = other.priority;
+            delay = other.delay;
+            period = other.period;
+            return *this;
+        }
+
+        task_id_t id;
+        task_t task;
+        priority_t priority;
+        // schedule_after/schedule_every that hadn't fired: the time left and the period (zero if it doesn't repeat)
+        pt::time_duration delay;
+        pt::time_duration period;
+
+    private:
+        dropped_task_t(const dropped_task_t &);
+        dropped_task_t &operator=(const dropped_task_t &);
+    };
+
+    // see drain()
+    struct drain_result_t
+    {
+        // nothing was dropped or interrupted
+        bool complete;
+        // run to completion since the drain started
+        uint64_t tasks_finished;
+        // still running at the deadline, see cancel_task
+        uint64_t tasks_interrupted;
+        // queued or waiting for their timer at the deadline, they never started
+        uint64_t tasks_dropped;
+    };
+
 private:
     typedef boost::thread thread_t;
     typedef shared_ptr<boost::thread> thread_ptr;
@@ -39,238 +212,1804 @@ private:
 
     typedef uint64_t thread_id_t;
 
-public:
-    threadpool(size_t num_threads, pt::time_duration timeout)
-        : next_task_id_(0)
-        , next_thread_id_(0)
-        , time_to_die_(false)
-        , timeout_(timeout)
+    enum task_state_t
     {
-        mutex_lock_t lock(tasks_mutex_);
-        
-        for (size_t i = 0; i < num_threads; ++i)
-        {
-            create_thread();
-        }
-    }
+        TASK_QUEUED,
+        TASK_RUNNING,
+        TASK_CANCELED
+    };
 
-    ~threadpool()
-    {
-        cleanup();
-    }
+    struct worker_t;
 
-public:
-    task_id_t add_task(task_t task)
+    struct task_entry_t
     {
-        mutex_lock_t lock(tasks_mutex_);
-        const task_id_t task_id = next_task_id_++;
-        tasks_threads_.insert(make_pair(task_id, boost::none));
-        tasks_queue_.push(make_pair(task_id, task));
-
-        if (idle_threads_.empty())
-            create_thread(timeout_);
-
-        MY_ASSERT(!idle_threads_.empty());
-        
-        tasks_cond_.notify_one();
-        return task_id;
-    }
+        task_entry_t(task_id_t id, task_t &&task, uint64_t submit_ns)
+            : id(id)
+            , task(std::move(task))
+            , submit_ns(submit_ns)
+            , due_ns(submit_ns + priority_slack_ns(PRIORITY_NORMAL))
+            , priority(PRIORITY_NORMAL)
+            , has_deadline(false)
+            , timer_ns(0)
+            , period_ns(0)
+            , state(TASK_QUEUED)
+            , cancel_requested(false)
+            , worker(0)
+            , next(0)
+        {}
 
-    void create_thread(optional<pt::time_duration> timeout = boost::none)
-    {
-        thread_id_t id = next_thread_id_++;
-        auto t = make_shared<boost::thread>(boost::bind(&threadpool::thread_run, this, id, timeout));
-        threads_.insert(make_pair(id, t));
-        idle_threads_.insert(id);
-    }
+        task_id_t id;
+        task_t task;
+        // steady_clock_ns() when added
+        uint64_t submit_ns;
+        // see priority_t
+        uint64_t due_ns;
+        int priority;
+        bool has_deadline;
+        // schedule_after/schedule_every: when the timer is due, and the period if it repeats
+        uint64_t timer_ns;
+        uint64_t period_ns;
+        cancellation_token token;
+        atomic<int> state;
+        // cancel_task while running, see cancellation_requested
+        atomic_bool cancel_requested;
+        // valid once state is TASK_RUNNING
+        worker_t *worker;
+        // entry_queue_t link
+        task_entry_t *next;
+    };
 
-    cancel_result_t cancel_task(task_id_t task_id)
+    // intrusive FIFO of entries, doesn't allocate
+    struct entry_queue_t
     {
-        mutex_lock_t threads_lock(tasks_mutex_);
-        if (!tasks_threads_.count(task_id) || tasks_to_cancel_.count(task_id))
-            return NOT_FOUND;
+        entry_queue_t()
+            : head(0)
+            , tail(0)
+        {}
 
-        if (auto thread_id = tasks_threads_.at(task_id))
+        bool empty() const
         {
-            threads_.at(*thread_id)->interrupt();
-            return TERMINATED;
+            return head == 0;
         }
-        else
+
+        void push(task_entry_t *entry)
         {
-            MY_ASSERT(!tasks_to_cancel_.count(task_id));
-            tasks_to_cancel_.insert(task_id);
-            return REMOVED_FROM_QUEUE;
+            entry->next = 0;
+            if (tail)
+                tail->next = entry;
+            else
+                head = entry;
+            tail = entry;
         }
-    }
 
-private:
-    void thread_run(thread_id_t thread_id, optional<pt::time_duration> timeout)
-    {
+        task_entry_t *pop()
         {
-            mutex_lock_t l(cout_mutex);
-            cout << (timeout ? "Worker" : "Hot");
-            cout << " thread " << thread_id << " created" << endl;
+            MY_ASSERT(head);
+            task_entry_t *entry = head;
+            head = entry->next;
+            if (!head)
+                tail = 0;
+            return entry;
         }
-        while (!time_to_die_)
+
+        task_entry_t *head, *tail;
+    };
+
+    // The shared queue. Every priority has a FIFO, which is already in due order, and a heap for the tasks
+    // with deadlines. pop() takes the earliest due head of the highest priority, except that every
+    // aging_share-th pop goes to an overdue head of a lower priority if there is one.
+    struct task_queue_t
+    {
+        struct level_t
         {
-            // late interruption handling
-            try
+            bool empty() const
             {
-                boost::this_thread::interruption_point();
+                return fifo.empty() && deadlines.empty();
             }
-            catch (boost::thread_interrupted const&)
+
+            task_entry_t *head() const
             {
+                if (deadlines.empty())
+                    return fifo.head;
+
+                if (fifo.empty() || later(fifo.head, deadlines.front()))
+                    return deadlines.front();
+
+                return fifo.head;
             }
 
-            const auto task = assign_task(thread_id, timeout);
-            if (!task)
+            task_entry_t *pop()
             {
-                MY_ASSERT(timeout || time_to_die_);
-                break;
+                if (head() == fifo.head)
+                    return fifo.pop();
+
+                task_entry_t *entry = deadlines.front();
+                std::pop_heap(deadlines.begin(), deadlines.end(), &later);
+                deadlines.pop_back();
+                return entry;
+            }
+
+            entry_queue_t fifo;
+            vector<task_entry_t *> deadlines;
+        };
+
+        task_queue_t()
+            : starving_pops(0)
+        {}
+
+        bool empty() const
+        {
+            BOOST_FOREACH(const level_t &l, levels)
+            {
+                if (!l.empty())
+                    return false;
             }
+            return true;
+        }
 
+        void push(task_entry_t *entry)
+        {
+            level_t &l = levels[entry->priority];
+            if (entry->has_deadline)
             {
-                mutex_lock_t l(cout_mutex);
-                cout << "Task " << task->first << " assigned on thread " << thread_id << endl;
+                l.deadlines.push_back(entry);
+                std::push_heap(l.deadlines.begin(), l.deadlines.end(), &later);
             }
+            else
+                l.fifo.push(entry);
+        }
+
+        task_entry_t *pop(uint64_t now_ns)
+        {
+            level_t *top = 0;
+            level_t *overdue = 0;
+            for (size_t p = num_priorities; p-- > 0; )
+            {
+                level_t &l = levels[p];
+                if (l.empty())
+                    continue;
 
-            const bool task_finished = run_task(thread_id, task->second);
+                if (!top)
+                    top = &l;
+                else if (l.head()->due_ns <= now_ns && (!overdue || later(overdue->head(), l.head())))
+                    overdue = &l;
+            }
 
-            unassign_task(thread_id, task->first);
+            MY_ASSERT(top);
+            if (overdue && ++starving_pops >= aging_share)
+            {
+                starving_pops = 0;
+                return overdue->pop();
+            }
 
-            mutex_lock_t l(cout_mutex);
-            cout << "Task " << task->first << " ";
-            cout << (task_finished ? "finished" : "canceled");
-            cout << " on thread " << thread_id << endl;
+            return top->pop();
         }
 
+        // when a head should go before the fast paths of the scheduling mode, no_urgent_ns if never
+        uint64_t urgent_ns() const
         {
-            mutex_lock_t l(cout_mutex);
-            cout << "Thread " << thread_id << " finished" << endl;
+            if (!levels[PRIORITY_HIGH].empty())
+                return 0;
+
+            BOOST_FOREACH(const level_t &l, levels)
+            {
+                if (!l.deadlines.empty())
+                    return 0;
+            }
+
+            if (!levels[PRIORITY_LOW].empty())
+                return levels[PRIORITY_LOW].head()->due_ns;
+
+            return no_urgent_ns;
         }
 
+        static bool later(const task_entry_t *e1, const task_entry_t *e2)
         {
-            mutex_lock_t lock(tasks_mutex_);
-            MY_ASSERT(idle_threads_.count(thread_id));
-            idle_threads_.erase(thread_id);
+            return e1->due_ns != e2->due_ns ? e1->due_ns > e2->due_ns : e1->id > e2->id;
         }
+
+        level_t levels[num_priorities];
+        size_t starving_pops;
+    };
+
+    static const uint64_t no_urgent_ns = uint64_t(-1);
+
+    typedef work_stealing_deque<task_entry_t *> deque_t;
+    typedef mpmc_queue<task_entry_t *> ring_t;
+
+    // written by the worker only, read by stats()
+    struct worker_stats_t
+    {
+        worker_stats_t()
+            : tasks_started(0)
+            , tasks_finished(0)
+            , tasks_interrupted(0)
+            , finished(false)
+        {}
+
+        latency_histogram queue_latency;
+        latency_histogram service_time;
+
+        atomic<uint64_t> tasks_started;
+        atomic<uint64_t> tasks_finished;
+        atomic<uint64_t> tasks_interrupted;
+        // the thread has exited
+        atomic_bool finished;
+    };
+
+    struct worker_t
+    {
+        worker_t(thread_id_t id, optional<pt::time_duration> timeout)
+            : id(id)
+            , timeout(timeout)
+            , deque_slot(0)
+            , deque(0)
+            , seed(uint32_t(id) * 2654435761u + 1)
+            , running_task(no_task)
+        {}
+
+        thread_id_t id;
+        optional<pt::time_duration> timeout;
+        thread_ptr thread;
+
+        // WORK_STEALING only, deque may be null if all the slots are taken
+        size_t deque_slot;
+        deque_t *deque;
+        // victim selection
+        uint32_t seed;
+        // for drain(), no_task between tasks
+        atomic<task_id_t> running_task;
+
+        worker_stats_t stats;
+    };
+    typedef shared_ptr<worker_t> worker_ptr;
+
+public:
+    // num_threads hot threads, plus elastic ones started on demand that exit after being idle for the timeout
+    threadpool(size_t num_threads, pt::time_duration timeout, scheduling_t scheduling = SINGLE_QUEUE,
+               event_log::log_level_t log_level = event_log::LOG_TASKS)
+        : threadpool(num_threads, make_shared<spawn_on_demand_policy>(timeout), scheduling, log_level)
+    {}
+
+    // num_threads hot threads, the policy decides on the elastic ones
+    threadpool(size_t num_threads, shared_ptr<sizing_policy> policy, scheduling_t scheduling = SINGLE_QUEUE,
+               event_log::log_level_t log_level = event_log::LOG_TASKS)
+        : scheduling_(scheduling)
+        , log_(log_level, cout, &threadpool::format_event)
+        , policy_(policy)
+        , hot_threads_(num_threads)
+        , tasks_(task_table_log_capacity)
+        , threads_alive_(0)
+        , affinity_one_each_(false)
+        , workers_created_(0)
+        , workers_expired_(0)
+        , retired_()
+        , next_task_id_(0)
+        , next_thread_id_(0)
+        , time_to_die_(false)
+        , idle_count_(0)
+        , sleepers_count_(0)
+        , spinning_count_(0)
+        , spin_ns_(0)
+        , spin_yields_(0)
+        , queued_count_(0)
+        , urgent_ns_(no_urgent_ns)
+        , tasks_removed_(0)
+        , cancels_since_compaction_(0)
+        , pending_count_(0)
+        , queue_latency_ns_(0)
+        , deques_used_(0)
+        , current_worker_(&threadpool::forget_worker)
+        , timers_(steady_clock_ns() / timer_tick_ns)
+        , timers_added_(0)
+        , timers_fired_(0)
+        , timers_discarded_(0)
+        , accepting_(true)
+    {
+        init();
     }
 
-    bool run_task(thread_id_t thread_id, task_t task)
+    ~threadpool()
     {
-        try
+        cleanup();
+    }
+
+private:
+    void init()
+    {
+        MY_ASSERT(policy_);
+        mutex_lock_t lock(tasks_mutex_);
+
+        if (scheduling_ == LOCK_FREE_QUEUE)
+            ring_.reset(new ring_t(lock_free_queue_log_capacity));
+
+        if (scheduling_ == WORK_STEALING)
         {
-            // run the task
-            task();
-            return true;
+            deques_.resize(std::max<size_t>(hot_threads_ * 2, 64));
+            BOOST_FOREACH(auto &d, deques_)
+                d = make_shared<deque_t>();
+
+            for (size_t i = deques_.size(); i > 0; --i)
+                free_deques_.push_back(i - 1);
         }
-        catch (boost::thread_interrupted const&) 
+
+        for (size_t i = 0; i < hot_threads_; ++i)
         {
-            return false;
+            create_thread();
         }
+
+        if (policy_->tick() > pt::time_duration())
+            sizing_thread_ = boost::thread(boost::bind(&threadpool::sizing_run, this));
     }
 
-    optional<pair<task_id_t, task_t>> assign_task(thread_id_t thread_id, optional<pt::time_duration> timeout)
+public:
+    // deadline counts from now, see priority_t
+    task_id_t add_task(task_t task, priority_t priority = PRIORITY_NORMAL,
+                       optional<pt::time_duration> deadline = boost::none)
     {
-        mutex_lock_t lock(tasks_mutex_);
+        return add_task(std::move(task), cancellation_token(), priority, deadline);
+    }
+
+    // the task belongs to the token's group, see cancel_group
+    task_id_t add_task(task_t task, const cancellation_token &token, priority_t priority = PRIORITY_NORMAL,
+                       optional<pt::time_duration> deadline = boost::none)
+    {
+        check_intake();
+
+        const task_id_t task_id = next_task_id_++;
+        task_entry_t *entry = new_entry(task_id, std::move(task), steady_clock_ns());
+        entry->token = token;
+        const bool fast_path = set_priority(*entry, priority, deadline);
+        tasks_.insert(task_id, entry);
+        ++pending_count_;
+
+        enqueue(entry, fast_path);
+        return task_id;
+    }
+
+    // Runs the task once the delay has passed (schedule_after), or every period from then on (schedule_every),
+    // up to a timer tick late. Until then the task waits in a timer wheel serviced by one timer thread, so the
+    // pending timers take up no worker threads. A periodic run late by more than a period skips the missed ones.
+    // The id works with cancel_task like any other: a canceled timer never fires (its wheel slot is only freed
+    // when it would have), and a periodic task canceled while running isn't scheduled again.
+    task_id_t schedule_after(pt::time_duration delay, task_t task, priority_t priority = PRIORITY_NORMAL)
+    {
+        return schedule(std::max<int64_t>(delay.total_nanoseconds(), 0), 0, std::move(task), priority);
+    }
+
+    task_id_t schedule_every(pt::time_duration period, task_t task, priority_t priority = PRIORITY_NORMAL)
+    {
+        const uint64_t period_ns = uint64_t(std::max<int64_t>(period.total_nanoseconds(), timer_tick_ns));
+        return schedule(period_ns, period_ns, std::move(task), priority);
+    }
+
+    // Adds the whole batch at once: the tasks get consecutive ids, so consecutive task table slots, the overflow
+    // (if any) takes every shard lock at most once, the shared queue is locked once and at most min(n, parked workers) workers are woken up.
+    // Like add_task, it creates a worker thread if none is idle, but only one per batch.
+    // Every *it is converted to task_t, use move iterators for a range of task_t.
+    template<typename It>
+    task_id_range_t add_tasks(It first, It last, priority_t priority = PRIORITY_NORMAL,
+                              const cancellation_token &token = cancellation_token())
+    {
+        check_intake();
+
+        const size_t n = std::distance(first, last);
+        const task_id_t first_id = next_task_id_.fetch_add(n);
 
-        MY_ASSERT(idle_threads_.count(thread_id));
+        const uint64_t submit_ns = steady_clock_ns();
 
-        optional<pair<task_id_t, task_t>> res;
-        
-        while (!res)
+        vector<pair<task_id_t, task_entry_t *>> entries;
+        entries.reserve(n);
+        bool fast_path = true;
+        for (task_id_t id = first_id; first != last; ++first, ++id)
         {
-            const auto pred = [this]() -> bool 
-            {
-                if (time_to_die_)
-                    return true;
-                
-                if (!tasks_queue_.empty())
-                    return true;
+            task_entry_t *entry = new_entry(id, task_t(*first), submit_ns);
+            entry->token = token;
+            fast_path = set_priority(*entry, priority, boost::none);
+            entries.push_back(make_pair(id, entry));
+        }
 
-                return false;
-            };
-            
-            if (timeout)
-                tasks_cond_.timed_wait(lock, *timeout, pred);
-            else
-                tasks_cond_.wait(lock, pred);
+        tasks_.insert(entries.begin(), entries.end());
+        pending_count_ += n;
 
-            if (time_to_die_)
-                return boost::none;
-            
-            if (tasks_queue_.empty())
+        worker_t *self = current_worker_.get();
+        if (fast_path && self && self->deque)
+        {
+            BOOST_FOREACH(const auto &e, entries)
+                self->deque->push(e.second);
+
+            wake_sleepers(n);
+        }
+        else if (n != 0)
+        {
+            size_t in_ring = 0;
+            if (fast_path && ring_)
             {
-                MY_ASSERT(timeout);
-                return boost::none;
+                while (in_ring < n && ring_->try_push(entries[in_ring].second))
+                    ++in_ring;
             }
 
-            MY_ASSERT(!tasks_queue_.empty());
-            res = tasks_queue_.front();
-            tasks_queue_.pop();
+            mutex_lock_t lock(tasks_mutex_);
+            for (size_t i = in_ring; i < n; ++i)
+                tasks_queue_.push(entries[i].second);
+            queued_count_ += n - in_ring;
+            urgent_ns_ = tasks_queue_.urgent_ns();
 
-            if (tasks_to_cancel_.count(res->first))
-            {
-                tasks_to_cancel_.erase(res->first);
-                res = boost::none;
-            }
+            ensure_idle_thread();
+
+            const size_t to_wake = std::min<size_t>(n - std::min<size_t>(n, spinning_count_), sleepers_count_);
+            for (size_t i = 0; i < to_wake; ++i)
+                tasks_cond_.notify_one();
         }
 
-        MY_ASSERT(!tasks_threads_.at(res->first));
-        tasks_threads_.at(res->first) = thread_id;
+        return boost::irange(first_id, first_id + n);
+    }
+
+    template<typename Range>
+    task_id_range_t add_tasks(const Range &tasks, priority_t priority = PRIORITY_NORMAL,
+                              const cancellation_token &token = cancellation_token())
+    {
+        return add_tasks(boost::begin(tasks), boost::end(tasks), priority, token);
+    }
+
+    // initializer_list items can't be moved from, hence boost::function
+    task_id_range_t add_tasks(std::initializer_list<boost::function<void()>> tasks)
+    {
+        return add_tasks(tasks.begin(), tasks.end());
+    }
+
+    // Like add_task, but the result (or the exception) of f comes back through the future.
+    // Chain the next stage with then() or when_all/when_any rather than blocking a thread in get().
+    template<typename F>
+    task_future<typename boost::result_of<F()>::type> submit(F f);
 
-        idle_threads_.erase(thread_id);
+    // The outcome is decided by a single CAS on the task state, the same way in every scheduling mode:
+    //  REMOVED_FROM_QUEUE - the task was still queued and will never start. The entry stays in its queue as
+    //                       a tombstone that whoever pops it throws away; the shared queue is compacted once
+    //                       the tombstones may make up half of it, the ring and the deques are not.
+    //  TERMINATED         - the task was running: cancellation_requested() turns true for it and its thread
+    //                       got interrupted. The interruption takes effect at the next boost interruption point,
+    //                       a task that neither has one nor polls runs to completion anyway.
+    //  NOT_FOUND          - no such task, the task has already finished, or it was canceled while queued.
+    // cancel_task never waits for a worker, it only holds the lock of one task table slot
+    // (and the shared queue lock when it's the one to compact).
+    cancel_result_t cancel_task(task_id_t task_id)
+    {
+        const cancel_result_t res = cancel_one(task_id);
+        if (res == REMOVED_FROM_QUEUE)
+            tombstones_added(1);
 
         return res;
     }
 
-    void unassign_task(thread_id_t thread_id, task_id_t task_id)
+    // cancel_task for every id in the range, with at most one compaction at the end.
+    // Returns how many of the tasks were found queued or running.
+    size_t cancel_tasks(task_id_range_t task_ids)
     {
-        mutex_lock_t lock(tasks_mutex_);
+        size_t removed = 0;
+        size_t terminated = 0;
+        BOOST_FOREACH(task_id_t task_id, task_ids)
+        {
+            switch (cancel_one(task_id))
+            {
+            case REMOVED_FROM_QUEUE:
+                ++removed;
+                break;
+            case TERMINATED:
+                ++terminated;
+                break;
+            case NOT_FOUND:
+                break;
+            }
+        }
 
-        MY_ASSERT(!idle_threads_.count(thread_id));
-        idle_threads_.insert(thread_id);
+        tombstones_added(removed);
+        return removed + terminated;
+    }
+
+    // Cancels the token and with it every task added with a copy of it. The group's tasks in the shared queue
+    // are removed right away, the ones in the ring or the deques never start once popped, and the running
+    // ones see cancellation_requested() (there is no interrupt, the pool doesn't track which threads run them).
+    // Returns how many of the group's tasks were removed from the shared queue.
+    size_t cancel_group(const cancellation_token &token)
+    {
+        token.cancel();
+
+        vector<task_entry_t *> unlinked;
+        size_t by_token;
+        {
+            mutex_lock_t lock(tasks_mutex_);
+            by_token = compact_queue(unlinked);
+        }
 
-        MY_ASSERT(tasks_threads_.at(task_id) == thread_id);
-        tasks_threads_.erase(task_id);
+        drop_tasks(unlinked);
+        return by_token;
     }
 
-    void clear_queue()
+    // True while the task is queued, waits for its timer or runs; false once it has finished, has been canceled
+    // while queued, or for an unknown id. Only holds the lock of one task table slot.
+    bool is_pending(task_id_t task_id)
     {
-        mutex_lock_t lock(tasks_mutex_);
-        tasks_queue_ = queue<pair<task_id_t, task_t>>();
+        bool pending = false;
+        tasks_.visit(task_id, [&pending](task_entry_t *entry) { pending = entry->state != TASK_CANCELED; });
+        return pending;
     }
 
-    void cleanup()
+    // For the task running on the calling thread: true once it has been canceled, either by id or through its
+    // token. A thread-specific pointer and two relaxed loads, cheap enough to poll in a loop; false outside
+    // of a pool task.
+    static bool cancellation_requested()
+    {
+        const task_entry_t *entry = running_entry().get();
+        return entry && (entry->cancel_requested.load(memory_order_relaxed) || entry->token.is_canceled());
+    }
+
+    // Graceful shutdown: stops the intake, lets the queued tasks run until the deadline, then takes the ones
+    // that haven't started out of the pool and cancels the running ones the way cancel_task does.
+    // From the start of the drain add_task, add_tasks, schedule_after/schedule_every and submit throw
+    // pool_stopped, unless called from the pool's own tasks: these may still add work, and it runs if there's
+    // time left. The pending timers are dropped right away, and a periodic task isn't scheduled again after
+    // its current run.
+    // The tasks that never started are moved to *dropped (if given), so the caller can save what they stand
+    // for and add them to another pool, otherwise they're destroyed. The pool accepts no tasks afterwards.
+    // The reactor's waits are dropped along with the timers, so are the coroutines waiting there.
+    // Don't call it from a pool task, that one can't finish before the deadline.
+    drain_result_t drain(pt::time_duration deadline, vector<dropped_task_t> *dropped = 0)
+    {
+        const uint64_t deadline_ns = steady_clock_ns() + uint64_t(std::max<int64_t>(deadline.total_nanoseconds(), 0));
+        const uint64_t finished_before = stats().tasks_finished;
+
+        accepting_ = false;
+
+        drain_result_t res = drain_result_t();
+        drop_timers(res, dropped);
+        drop_io_waits();
+
+        while (!(res.complete = is_idle()) && steady_clock_ns() < deadline_ns)
+            boost::this_thread::sleep(pt::milliseconds(1));
+
+        // and the timers rearmed by tasks that started before the drain
+        drop_timers(res, dropped);
+        drop_queued(res, dropped);
+        res.tasks_interrupted = cancel_running();
+        res.complete = res.complete && res.tasks_dropped == 0;
+        res.tasks_finished = stats().tasks_finished - finished_before;
+
+        log_.record(event_log::LOG_THREADS, EVENT_DRAINED, res.tasks_dropped, res.tasks_interrupted);
+        return res;
+    }
+
+    // Counters and latency histograms as of now. The hot path only bumps per-worker counters,
+    // stats() adds them up under the pool lock, so the numbers are consistent to within the tasks in flight.
+    stats_t stats()
     {
+        stats_t res = stats_t();
+        res.tasks_added = next_task_id_;
+        res.tasks_removed = tasks_removed_;
+
+        mutex_lock_t lock(tasks_mutex_);
+
+        res.workers_created = workers_created_;
+        res.workers_expired = workers_expired_;
+
+        res.tasks_started = retired_.tasks_started;
+        res.tasks_finished = retired_.tasks_finished;
+        res.tasks_interrupted = retired_.tasks_interrupted;
+        res.tasks_on_hot_threads = retired_.tasks_on_hot_threads;
+        res.tasks_on_worker_threads = retired_.tasks_on_worker_threads;
+        res.queue_latency = retired_.queue_latency;
+        res.service_time = retired_.service_time;
+
+        BOOST_FOREACH(const auto &t, threads_)
         {
-            mutex_lock_t l(cout_mutex);
-            cout << "Cleanup..." << endl;
+            const worker_t &w = *t.second;
+            const worker_stats_t &ws = w.stats;
+
+            const uint64_t started = ws.tasks_started;
+            res.tasks_started += started;
+            res.tasks_finished += ws.tasks_finished;
+            res.tasks_interrupted += ws.tasks_interrupted;
+            (w.timeout ? res.tasks_on_worker_threads : res.tasks_on_hot_threads) += started;
+
+            if (!ws.finished)
+                ++(w.timeout ? res.worker_threads : res.hot_threads);
+
+            ws.queue_latency.add_to(res.queue_latency);
+            ws.service_time.add_to(res.service_time);
         }
 
-        clear_queue();
+        {
+            mutex_lock_t timer_lock(timer_mutex_);
+            res.timers = timers_.size();
+        }
 
-        time_to_die_ = true;
-        tasks_cond_.notify_all();
+        // the counters are read one after another, don't let a task show up as started but not added.
+        // A timer gets to a queue every time it fires, and a canceled one may never get there.
+        const uint64_t queued = res.tasks_added - timers_added_ + timers_fired_;
+        const uint64_t gone = res.tasks_started + res.tasks_removed - timers_discarded_;
+        res.queue_depth = queued > gone ? queued - gone : 0;
+
+        return res;
+    }
+
+    // Restricts the threads to the given CPUs. With one_cpu_each, hot thread i gets cpus[i % cpus.size()] to itself
+    // and the elastic threads float over all of them, otherwise every thread floats over all of them.
+    // Applies to the running threads right away and to the ones started later. An empty list stops
+    // pinning the new threads, the running ones keep their CPUs. False if the OS refused to pin some thread.
+    bool set_affinity(const cpu_list_t &cpus, bool one_cpu_each)
+    {
+        mutex_lock_t lock(tasks_mutex_);
+        affinity_cpus_ = cpus;
+        affinity_one_each_ = one_cpu_each;
+
+        if (cpus.empty())
+            return true;
 
+        bool res = true;
         BOOST_FOREACH(const auto &t, threads_)
-            t.second->join();
+        {
+            const worker_t &w = *t.second;
+            if (!w.stats.finished && !pin_thread(w.thread->native_handle(), cpus_for(w)))
+                res = false;
+        }
+        return res;
     }
 
-private:
-    unordered_map<task_id_t, optional<thread_id_t>> tasks_threads_;
-    queue<pair<task_id_t, task_t>> tasks_queue_;
-    unordered_set<task_id_t> tasks_to_cancel_;
-    unordered_set<thread_id_t> idle_threads_;
+    // the threads that are always there, elastic ones come and go
+    size_t hot_threads() const
+    {
+        return hot_threads_;
+    }
 
-    mutex_t tasks_mutex_;
-    boost::condition_variable tasks_cond_;
-    
-    unordered_map<thread_id_t, thread_ptr> threads_;
-    
-    task_id_t next_task_id_;
-    thread_id_t next_thread_id_;
+    // A worker that runs out of tasks spins for up to spin, then yields up to yields times, before it parks on
+    // the condition variable. A task added meanwhile starts without a wakeup (no futex syscall on either side),
+    // at the price of the CPU burnt spinning. Zero for both (the default) parks right away.
+    // A single CPU machine only yields: spinning there just holds up whoever would add the task.
+    void set_spin(pt::time_duration spin, size_t yields)
+    {
+        const bool can_spin = boost::thread::hardware_concurrency() > 1;
+        spin_ns_ = can_spin ? uint64_t(std::max<int64_t>(spin.total_nanoseconds(), 0)) : 0;
+        spin_yields_ = yields;
+    }
 
-    atomic_bool time_to_die_;
-    pt::time_duration timeout_;
-};
\ No newline at end of file
+#if !defined(_WIN32)
+    // Waits for file descriptors on one more thread, started on first use. The callbacks run on that thread,
+    // they should add a task rather than do the work (see coroutine_context::await_readable).
+    io_reactor &reactor()
+    {
+        mutex_lock_t lock(timer_mutex_);
+        if (!reactor_)
+            reactor_.reset(new io_reactor());
+        return *reactor_;
+    }
+#endif
+
+    // verbosity and output (text to cout or a binary dump) can be changed at any time
+    event_log &log()
+    {
+        return log_;
+    }
+
+    static void format_event(std::ostream &out, const log_event_t &e)
+    {
+        switch (e.type)
+        {
+        case EVENT_THREAD_CREATED:
+            out << (e.flags ? "Worker" : "Hot") << " thread " << e.a << " created" << endl;
+            break;
+        case EVENT_THREAD_FINISHED:
+            out << "Thread " << e.a << " finished" << endl;
+            break;
+        case EVENT_TASK_ASSIGNED:
+            out << "Task " << e.a << " assigned on thread " << e.b << endl;
+            break;
+        case EVENT_TASK_FINISHED:
+            out << "Task " << e.a << " finished on thread " << e.b << endl;
+            break;
+        case EVENT_TASK_CANCELED:
+            out << "Task " << e.a << " canceled on thread " << e.b << endl;
+            break;
+        case EVENT_CLEANUP:
+            out << "Cleanup..." << endl;
+            break;
+        case EVENT_DRAINED:
+            out << "Drained, " << e.a << " tasks dropped, " << e.b << " interrupted" << endl;
+            break;
+        }
+    }
+
+private:
+    // requires tasks_mutex_
+    void create_thread(optional<pt::time_duration> timeout = boost::none)
+    {
+        reap_threads();
+
+        const thread_id_t id = next_thread_id_++;
+        auto w = make_shared<worker_t>(id, timeout);
+
+        if (scheduling_ == WORK_STEALING && !free_deques_.empty())
+        {
+            w->deque_slot = free_deques_.back();
+            w->deque = deques_.at(w->deque_slot).get();
+            free_deques_.pop_back();
+
+            if (w->deque_slot >= deques_used_)
+                deques_used_ = w->deque_slot + 1;
+        }
+
+        if (timeout)
+            ++workers_created_;
+
+        ++threads_alive_;
+        ++idle_count_;
+        w->thread = make_shared<boost::thread>(boost::bind(&threadpool::thread_run, this, w.get()));
+        threads_.insert(make_pair(id, w));
+    }
+
+    // Joins the elastic threads that have exited and keeps their counters. Their worker_t and its histograms
+    // would pile up in threads_ otherwise.
+    // requires tasks_mutex_, the threads only have to return from thread_run once they're finished
+    void reap_threads()
+    {
+        for (auto it = threads_.begin(); it != threads_.end(); )
+        {
+            const worker_t &w = *it->second;
+            if (!w.stats.finished)
+            {
+                ++it;
+                continue;
+            }
+
+            w.thread->join();
+
+            const worker_stats_t &ws = w.stats;
+            retired_.tasks_started += ws.tasks_started;
+            retired_.tasks_finished += ws.tasks_finished;
+            retired_.tasks_interrupted += ws.tasks_interrupted;
+            (w.timeout ? retired_.tasks_on_worker_threads : retired_.tasks_on_hot_threads) += ws.tasks_started;
+            ws.queue_latency.add_to(retired_.queue_latency);
+            ws.service_time.add_to(retired_.service_time);
+
+            it = threads_.erase(it);
+        }
+    }
+
+    // see set_affinity, hot threads are numbered from 0 in the constructor
+    // requires tasks_mutex_
+    cpu_list_t cpus_for(const worker_t &w) const
+    {
+        if (affinity_cpus_.empty() || w.timeout || !affinity_one_each_)
+            return affinity_cpus_;
+
+        return cpu_list_t(1, affinity_cpus_[w.id % affinity_cpus_.size()]);
+    }
+
+    // requires tasks_mutex_
+    pool_load_t load() const
+    {
+        pool_load_t res;
+        res.threads = threads_alive_;
+        res.hot_threads = hot_threads_;
+        res.idle_threads = idle_count_;
+        res.pending_tasks = pending_count_;
+        res.queue_latency_ns = queue_latency_ns_;
+        return res;
+    }
+
+    // asks the policy for more threads if none is idle. With a thread limit that may well be none,
+    // the task then waits for a busy thread
+    // requires tasks_mutex_
+    void ensure_idle_thread()
+    {
+        // tasks added while the pool is dying (e.g. continuations of the dropped ones) are freed by cleanup
+        if (time_to_die_)
+            return;
+
+        if (idle_count_ == 0)
+        {
+            for (size_t n = policy_->grow_by(load()); n != 0; --n)
+                create_thread(policy_->idle_check());
+        }
+    }
+
+    // Measures the queue latency with Little's law, pending tasks / recent throughput (or, if nothing got
+    // started since the last tick, the time since something did), and gives the policy a chance to grow
+    // even if no task is added.
+    void sizing_run()
+    {
+        const pt::time_duration tick = policy_->tick();
+
+        uint64_t last_done = 0;
+        uint64_t last_tick_ns = steady_clock_ns();
+        uint64_t last_progress_ns = last_tick_ns;
+
+        mutex_lock_t lock(tasks_mutex_);
+        while (!time_to_die_)
+        {
+            sizing_cond_.timed_wait(lock, tick);
+            if (time_to_die_)
+                break;
+
+            const uint64_t now_ns = steady_clock_ns();
+            const uint64_t added = next_task_id_;
+            const size_t pending = pending_count_;
+            const uint64_t done = added > pending ? added - pending : 0;
+
+            if (done > last_done)
+            {
+                const uint64_t per_task_ns = (now_ns - last_tick_ns) / (done - last_done);
+                queue_latency_ns_ = pending * per_task_ns;
+                last_progress_ns = now_ns;
+                last_done = done;
+            }
+            else
+                queue_latency_ns_ = pending != 0 ? now_ns - last_progress_ns : 0;
+
+            last_tick_ns = now_ns;
+
+            ensure_idle_thread();
+        }
+    }
+
+    // from the pool's own tasks, the work being drained may add more
+    void check_intake() const
+    {
+        if (!accepting_ && !current_worker_.get())
+            throw pool_stopped();
+    }
+
+    void enqueue(task_entry_t *entry, bool fast_path)
+    {
+        worker_t *self = current_worker_.get();
+        if (fast_path && self && self->deque)
+            push_local(*self, entry);
+        else if (fast_path && ring_ && ring_->try_push(entry))
+            push_ring();
+        else
+            push_shared(entry);
+    }
+
+    task_id_t schedule(uint64_t delay_ns, uint64_t period_ns, task_t &&task, priority_t priority)
+    {
+        check_intake();
+
+        const task_id_t task_id = next_task_id_++;
+        const uint64_t now_ns = steady_clock_ns();
+        task_entry_t *entry = new_entry(task_id, std::move(task), now_ns);
+        set_priority(*entry, priority, boost::none);
+        entry->timer_ns = now_ns + delay_ns;
+        entry->period_ns = period_ns;
+        tasks_.insert(task_id, entry);
+        ++timers_added_;
+
+        add_timer(entry);
+        return task_id;
+    }
+
+    // the timer thread starts with the first timer
+    void add_timer(task_entry_t *entry)
+    {
+        mutex_lock_t lock(timer_mutex_);
+
+        // cleanup frees the entry along with the rest
+        if (time_to_die_)
+            return;
+
+        if (!timer_thread_.joinable())
+            timer_thread_ = boost::thread(boost::bind(&threadpool::timer_run, this));
+
+        const uint64_t next_tick = timers_.next_tick();
+        const uint64_t due_tick = (entry->timer_ns + timer_tick_ns - 1) / timer_tick_ns;
+        timers_.add(due_tick, entry);
+
+        if (due_tick < next_tick)
+            timer_cond_.notify_one();
+    }
+
+    // sleeps until the wheel has something to do, the due entries go to the queues outside of the timer lock
+    void timer_run()
+    {
+        vector<task_entry_t *> fired;
+
+        mutex_lock_t lock(timer_mutex_);
+        while (!time_to_die_)
+        {
+            const uint64_t now_ns = steady_clock_ns();
+            const uint64_t next_tick = timers_.next_tick();
+
+            if (next_tick == timers_.no_tick)
+            {
+                timer_cond_.wait(lock);
+                continue;
+            }
+
+            if (next_tick * timer_tick_ns > now_ns)
+            {
+                timer_cond_.timed_wait(lock, pt::microseconds(int64_t((next_tick * timer_tick_ns - now_ns + 999) / 1000)));
+                continue;
+            }
+
+            timers_.advance(now_ns / timer_tick_ns, [&fired](task_entry_t *entry) { fired.push_back(entry); });
+
+            lock.unlock();
+            BOOST_FOREACH(task_entry_t *entry, fired)
+                fire_timer(entry);
+            fired.clear();
+            lock.lock();
+        }
+
+        lock.unlock();
+        entries_.flush_thread_cache();
+    }
+
+    void fire_timer(task_entry_t *entry)
+    {
+        // canceled in the wheel, nobody else knows about it any more. If the cancel comes right after this check
+        // the entry goes to a queue as a tombstone, as any other canceled task
+        if (entry->state == TASK_CANCELED)
+        {
+            ++timers_discarded_;
+            tasks_.erase(entry->id);
+            free_entry(entry);
+            return;
+        }
+
+        entry->submit_ns = steady_clock_ns();
+        const bool fast_path = set_priority(*entry, priority_t(entry->priority), boost::none);
+        ++timers_fired_;
+        ++pending_count_;
+
+        enqueue(entry, fast_path);
+    }
+
+    // schedule_every, after a run: the entry goes back to the wheel unless the task got canceled meanwhile
+    // or the pool is draining.
+    // The state changes under the slot lock, so cancel_task sees either the running task or the queued timer
+    bool rearm_timer(task_entry_t *entry)
+    {
+        // a draining pool runs what it has, the next period is new work
+        if (!accepting_)
+            return false;
+
+        bool rearmed = false;
+        tasks_.visit(entry->id, [&rearmed](task_entry_t *e)
+        {
+            if (!e->cancel_requested)
+            {
+                e->state = TASK_QUEUED;
+                rearmed = true;
+            }
+        });
+
+        if (!rearmed)
+            return false;
+
+        const uint64_t now_ns = steady_clock_ns();
+        entry->timer_ns += entry->period_ns;
+        if (entry->timer_ns <= now_ns)
+            entry->timer_ns += ((now_ns - entry->timer_ns) / entry->period_ns + 1) * entry->period_ns;
+
+        ++idle_count_;
+        add_timer(entry);
+        return true;
+    }
+
+    void push_shared(task_entry_t *entry)
+    {
+        mutex_lock_t lock(tasks_mutex_);
+        tasks_queue_.push(entry);
+        ++queued_count_;
+        urgent_ns_ = tasks_queue_.urgent_ns();
+
+        ensure_idle_thread();
+
+        // sleepers_count_ only changes under the lock, a spinning worker will see the task by itself
+        if (sleepers_count_ != 0 && spinning_count_ == 0)
+            tasks_cond_.notify_one();
+    }
+
+    // WORK_STEALING: no new threads here, the owner itself will get to the task after the current one
+    void push_local(worker_t &self, task_entry_t *entry)
+    {
+        self.deque->push(entry);
+        wake_sleepers(1);
+    }
+
+    // LOCK_FREE_QUEUE: the entry is already in the ring
+    void push_ring()
+    {
+        if (idle_count_ == 0)
+        {
+            mutex_lock_t lock(tasks_mutex_);
+            ensure_idle_thread();
+        }
+
+        wake_sleepers(1);
+    }
+
+    // Eventcount-style: pairs with the spinning_count_ decrement and the sleepers_count_ increment in
+    // assign_task, the lock (and the futex syscall) is only taken if someone sleeps and the spinning workers
+    // won't take all the tasks anyway
+    void wake_sleepers(size_t n)
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+
+        const size_t spinning = spinning_count_;
+        if (sleepers_count_ != 0 && spinning < n)
+        {
+            mutex_lock_t lock(tasks_mutex_);
+
+            const size_t to_wake = std::min<size_t>(n - spinning, sleepers_count_);
+            for (size_t i = 0; i < to_wake; ++i)
+                tasks_cond_.notify_one();
+        }
+    }
+
+    // Looks for tasks for up to spin_ns_, then yields spin_yields_ times, true once there's one to take.
+    // A spinning worker counts in spinning_count_, so the tasks added meanwhile don't wake a sleeping one.
+    bool spin_for_task()
+    {
+        const uint64_t spin_ns = spin_ns_;
+        const size_t spin_yields = spin_yields_;
+        if (spin_ns == 0 && spin_yields == 0)
+            return false;
+
+        ++spinning_count_;
+
+        bool found = false;
+        const uint64_t start_ns = steady_clock_ns();
+        for (size_t yields = 0; ; )
+        {
+            found = queued_count_ != 0 || has_lock_free_task();
+            if (found || time_to_die_)
+                break;
+
+            if (steady_clock_ns() - start_ns < spin_ns)
+            {
+                cpu_relax();
+                continue;
+            }
+
+            if (yields++ == spin_yields)
+                break;
+            boost::this_thread::yield();
+        }
+
+        --spinning_count_;
+        return found;
+    }
+
+    static void cpu_relax()
+    {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#endif
+    }
+
+    void thread_run(worker_t *w)
+    {
+        cpu_list_t cpus;
+        {
+            // wait for create_thread to finish with the worker
+            mutex_lock_t lock(tasks_mutex_);
+            cpus = cpus_for(*w);
+        }
+
+        if (!cpus.empty())
+            pin_current_thread(cpus);
+        current_worker_.reset(w);
+
+        log_.record(event_log::LOG_THREADS, EVENT_THREAD_CREATED, w->id, 0, w->timeout ? 1 : 0);
+
+        while (!time_to_die_)
+        {
+            // late interruption handling
+            try
+            {
+                boost::this_thread::interruption_point();
+            }
+            catch (boost::thread_interrupted const&)
+            {
+            }
+
+            task_entry_t *const entry = assign_task(*w);
+            if (!entry)
+            {
+                MY_ASSERT(w->timeout || time_to_die_);
+                break;
+            }
+
+            log_.record(event_log::LOG_TASKS, EVENT_TASK_ASSIGNED, entry->id, w->id);
+
+            worker_stats_t &ws = w->stats;
+            const uint64_t assign_ns = steady_clock_ns();
+            ws.queue_latency.record(assign_ns - std::min(entry->submit_ns, assign_ns));
+            ws.tasks_started.fetch_add(1, memory_order_relaxed);
+
+            const task_id_t task_id = entry->id;
+            w->running_task = task_id;
+            running_entry().reset(entry);
+            const bool task_finished = run_task(entry->task);
+            running_entry().reset();
+            w->running_task = no_task;
+
+            if (!task_finished || !entry->period_ns || !rearm_timer(entry))
+                unassign_task(entry);
+
+            ws.service_time.record(steady_clock_ns() - assign_ns);
+            (task_finished ? ws.tasks_finished : ws.tasks_interrupted).fetch_add(1, memory_order_relaxed);
+
+            log_.record(event_log::LOG_TASKS, task_finished ? EVENT_TASK_FINISHED : EVENT_TASK_CANCELED, task_id, w->id);
+        }
+
+        log_.record(event_log::LOG_THREADS, EVENT_THREAD_FINISHED, w->id);
+        log_.retire_thread();
+
+        entries_.flush_thread_cache();
+
+        {
+            mutex_lock_t lock(tasks_mutex_);
+            MY_ASSERT(idle_count_ != 0);
+            --idle_count_;
+
+            --threads_alive_;
+            w->stats.finished = true;
+            if (w->timeout && !time_to_die_)
+                ++workers_expired_;
+
+            // Nobody else pushes to our deque, so it's empty by now, unless the pool is dying and our last task
+            // added more (a task_group does). cleanup frees these entries with the rest.
+            if (w->deque)
+            {
+                while (time_to_die_ && w->deque->pop())
+                {
+                }
+                MY_ASSERT(w->deque->empty());
+                free_deques_.push_back(w->deque_slot);
+            }
+        }
+    }
+
+    bool run_task(task_t &task)
+    {
+        try
+        {
+            // run the task
+            task();
+            return true;
+        }
+        catch (boost::thread_interrupted const&)
+        {
+            return false;
+        }
+    }
+
+    task_entry_t *assign_task(worker_t &w)
+    {
+        const uint64_t idle_since_ns = w.timeout ? steady_clock_ns() : 0;
+
+        for (;;)
+        {
+            task_entry_t *entry = scheduling_ != SINGLE_QUEUE ? find_task(w) : 0;
+
+            if (!entry && spin_for_task() && scheduling_ != SINGLE_QUEUE)
+                entry = find_task(w);
+
+            if (!entry)
+            {
+                mutex_lock_t lock(tasks_mutex_);
+
+                const auto pred = [this]() -> bool
+                {
+                    if (time_to_die_)
+                        return true;
+
+                    if (!tasks_queue_.empty())
+                        return true;
+
+                    return has_lock_free_task();
+                };
+
+                bool woken = true;
+                ++sleepers_count_;
+                if (w.timeout)
+                    woken = tasks_cond_.timed_wait(lock, *w.timeout, pred);
+                else
+                    tasks_cond_.wait(lock, pred);
+                --sleepers_count_;
+
+                if (time_to_die_)
+                    return 0;
+
+                if (!tasks_queue_.empty())
+                {
+                    entry = pop_shared();
+                }
+                else if (has_lock_free_task() || woken)
+                {
+                    // woken: the ring and the deques are popped without the lock, another worker may have
+                    // taken the task that woke this one
+                    continue;
+                }
+                else
+                {
+                    MY_ASSERT(w.timeout);
+                    const pt::time_duration idle_time = pt::microseconds(int64_t((steady_clock_ns() - idle_since_ns) / 1000));
+                    if (policy_->shrink(load(), idle_time))
+                        return 0;
+
+                    continue;
+                }
+            }
+
+            if (claim_task(w, entry))
+            {
+                // the tasks added while someone spins wake nobody, and the one spinner (or the one sleeper it
+                // woke) takes only one of them: whoever takes a task passes the wakeup on if there's more
+                if (queued_count_ != 0 || has_lock_free_task())
+                    wake_sleepers(1);
+
+                return entry;
+            }
+
+            drop_task(entry);
+        }
+    }
+
+    // Urgent tasks of the shared queue first (see priority_t), then
+    // WORK_STEALING:   own deque, then the shared queue, then the others' deques
+    // LOCK_FREE_QUEUE: the ring, then the overflow in the shared queue
+    task_entry_t *find_task(worker_t &w)
+    {
+        const uint64_t urgent_ns = urgent_ns_;
+        if (urgent_ns != no_urgent_ns && urgent_ns <= steady_clock_ns())
+        {
+            mutex_lock_t lock(tasks_mutex_);
+            if (!tasks_queue_.empty())
+                return pop_shared();
+        }
+
+        if (w.deque)
+        {
+            if (auto entry = w.deque->pop())
+                return *entry;
+        }
+
+        if (ring_)
+        {
+            if (auto entry = ring_->try_pop())
+                return *entry;
+        }
+
+        if (queued_count_ != 0)
+        {
+            mutex_lock_t lock(tasks_mutex_);
+            if (!tasks_queue_.empty())
+                return pop_shared();
+        }
+
+        const size_t num_victims = deques_used_;
+        if (num_victims == 0)
+            return 0;
+
+        w.seed ^= w.seed << 13;
+        w.seed ^= w.seed >> 17;
+        w.seed ^= w.seed << 5;
+
+        const size_t start = w.seed % num_victims;
+        for (size_t i = 0; i < num_victims; ++i)
+        {
+            deque_t &victim = *deques_[(start + i) % num_victims];
+            if (&victim == w.deque)
+                continue;
+
+            if (auto entry = victim.steal())
+                return *entry;
+        }
+
+        return 0;
+    }
+
+    // requires tasks_mutex_
+    task_entry_t *pop_shared()
+    {
+        task_entry_t *entry = tasks_queue_.pop(steady_clock_ns());
+        --queued_count_;
+        urgent_ns_ = tasks_queue_.urgent_ns();
+        return entry;
+    }
+
+    bool has_lock_free_task() const
+    {
+        if (ring_ && !ring_->empty())
+            return true;
+
+        const size_t num_victims = deques_used_;
+        for (size_t i = 0; i < num_victims; ++i)
+        {
+            if (!deques_[i]->empty())
+                return true;
+        }
+
+        return false;
+    }
+
+    bool claim_task(worker_t &w, task_entry_t *entry)
+    {
+        entry->worker = &w;
+
+        if (cancel_by_token(entry))
+            return false;
+
+        int state = TASK_QUEUED;
+        if (!entry->state.compare_exchange_strong(state, TASK_RUNNING))
+        {
+            MY_ASSERT(state == TASK_CANCELED);
+            return false;
+        }
+
+        MY_ASSERT(idle_count_ != 0);
+        --idle_count_;
+        --pending_count_;
+        return true;
+    }
+
+    task_entry_t *new_entry(task_id_t task_id, task_t &&task, uint64_t submit_ns)
+    {
+        return new (entries_.allocate()) task_entry_t(task_id, std::move(task), submit_ns);
+    }
+
+    // false if the task has to go to the shared queue
+    static bool set_priority(task_entry_t &entry, priority_t priority, optional<pt::time_duration> deadline)
+    {
+        MY_ASSERT(size_t(priority) < num_priorities);
+
+        entry.priority = priority;
+        entry.due_ns = entry.submit_ns + priority_slack_ns(priority);
+
+        if (deadline)
+        {
+            const int64_t deadline_ns = std::max<int64_t>(0, deadline->total_nanoseconds());
+            entry.due_ns = std::min(entry.due_ns, entry.submit_ns + uint64_t(deadline_ns));
+            entry.has_deadline = true;
+        }
+
+        return priority == PRIORITY_NORMAL && !deadline;
+    }
+
+    void free_entry(task_entry_t *entry)
+    {
+        entry->~task_entry_t();
+        entries_.deallocate(entry);
+    }
+
+    // drain(): nothing queued, nothing running.
+    // claim_task takes a worker off idle_count_ before the task off pending_count_, so read in the opposite
+    // order they can't both miss a task on its way to a worker
+    bool is_idle()
+    {
+        mutex_lock_t lock(tasks_mutex_);
+        return pending_count_ == 0 && idle_count_ == threads_alive_;
+    }
+
+    // drain(): the task of a queued entry goes to the caller, or is destroyed along with the entry
+    void drop_entry(task_entry_t *entry, drain_result_t &res, vector<dropped_task_t> *dropped)
+    {
+        ++res.tasks_dropped;
+        ++tasks_removed_;
+
+        if (!dropped)
+            return;
+
+        dropped->push_back(dropped_task_t(entry->id, std::move(entry->task), priority_t(entry->priority)));
+        if (entry->period_ns == 0 && entry->timer_ns == 0)
+            return;
+
+        const uint64_t now_ns = steady_clock_ns();
+        dropped->back().delay = pt::microseconds(int64_t(entry->timer_ns > now_ns ? (entry->timer_ns - now_ns) / 1000 : 0));
+        dropped->back().period = pt::microseconds(int64_t(entry->period_ns / 1000));
+    }
+
+    // drain(): empties the timer wheel, the way fire_timer discards a canceled entry
+    void drop_timers(drain_result_t &res, vector<dropped_task_t> *dropped)
+    {
+        vector<task_entry_t *> entries;
+        {
+            mutex_lock_t lock(timer_mutex_);
+            timers_.clear([&entries](task_entry_t *entry) { entries.push_back(entry); });
+        }
+
+        BOOST_FOREACH(task_entry_t *entry, entries)
+        {
+            int state = TASK_QUEUED;
+            if (entry->state.compare_exchange_strong(state, TASK_CANCELED))
+                drop_entry(entry, res, dropped);
+
+            ++timers_discarded_;
+            tasks_.erase(entry->id);
+            free_entry(entry);
+        }
+    }
+
+    // drain(): the reactor's callbacks are destroyed, and with them whatever waited
+    void drop_io_waits()
+    {
+#if !defined(_WIN32)
+        io_reactor *reactor = 0;
+        {
+            mutex_lock_t lock(timer_mutex_);
+            reactor = reactor_.get();
+        }
+
+        if (reactor)
+            reactor->clear();
+#endif
+    }
+
+    // drain(): pops every queue empty, a worker popping at the same time only ever gets an entry we don't
+    void drop_queued(drain_result_t &res, vector<dropped_task_t> *dropped)
+    {
+        vector<task_entry_t *> entries;
+        {
+            mutex_lock_t lock(tasks_mutex_);
+            while (!tasks_queue_.empty())
+                entries.push_back(pop_shared());
+        }
+
+        if (ring_)
+        {
+            while (auto entry = ring_->try_pop())
+                entries.push_back(*entry);
+        }
+
+        const size_t num_victims = deques_used_;
+        for (size_t i = 0; i < num_victims; ++i)
+        {
+            while (!deques_[i]->empty())
+            {
+                if (auto entry = deques_[i]->steal())
+                    entries.push_back(*entry);
+            }
+        }
+
+        size_t by_token = 0;
+        BOOST_FOREACH(task_entry_t *entry, entries)
+        {
+            int state = TASK_QUEUED;
+            if (!is_tombstone(entry, by_token) && entry->state.compare_exchange_strong(state, TASK_CANCELED))
+                drop_entry(entry, res, dropped);
+
+            drop_task(entry);
+        }
+    }
+
+    // drain(): cancel_task for whatever the workers are running, returns how many got interrupted
+    size_t cancel_running()
+    {
+        vector<task_id_t> running;
+        {
+            mutex_lock_t lock(tasks_mutex_);
+            BOOST_FOREACH(const auto &t, threads_)
+            {
+                const task_id_t task_id = t.second->running_task;
+                if (task_id != no_task)
+                    running.push_back(task_id);
+            }
+        }
+
+        size_t interrupted = 0;
+        BOOST_FOREACH(task_id_t task_id, running)
+        {
+            if (cancel_one(task_id) == TERMINATED)
+                ++interrupted;
+        }
+        return interrupted;
+    }
+
+    // canceled before it was assigned
+    void drop_task(task_entry_t *entry)
+    {
+        --pending_count_;
+        tasks_.erase(entry->id);
+        free_entry(entry);
+    }
+
+    // not under tasks_mutex_
+    void drop_tasks(const vector<task_entry_t *> &entries)
+    {
+        BOOST_FOREACH(task_entry_t *entry, entries)
+            drop_task(entry);
+    }
+
+    void unassign_task(task_entry_t *entry)
+    {
+        MY_ASSERT(entry->state == TASK_RUNNING);
+        tasks_.erase(entry->id);
+        free_entry(entry);
+
+        ++idle_count_;
+    }
+
+    cancel_result_t cancel_one(task_id_t task_id)
+    {
+        cancel_result_t res = NOT_FOUND;
+
+        tasks_.visit(task_id, [&res](task_entry_t *entry)
+        {
+            int state = TASK_QUEUED;
+
+            if (entry->state.compare_exchange_strong(state, TASK_CANCELED))
+            {
+                res = REMOVED_FROM_QUEUE;
+            }
+            else if (state == TASK_RUNNING)
+            {
+                // the entry can't go away while we hold its slot
+                entry->cancel_requested = true;
+                entry->worker->thread->interrupt();
+                res = TERMINATED;
+            }
+            else
+                MY_ASSERT(state == TASK_CANCELED);
+        });
+
+        return res;
+    }
+
+    // Compacts the shared queue once the tasks canceled since the last compaction could be half of it,
+    // so a canceled task costs O(1) amortized and the queue never fills up with tombstones.
+    void tombstones_added(size_t n)
+    {
+        if (n == 0)
+            return;
+
+        tasks_removed_ += n;
+
+        const size_t tombstones = cancels_since_compaction_ += n;
+        if (tombstones < min_compaction || tombstones * 2 < queued_count_)
+            return;
+
+        vector<task_entry_t *> unlinked;
+        {
+            mutex_lock_t lock(tasks_mutex_);
+            compact_queue(unlinked);
+        }
+
+        drop_tasks(unlinked);
+    }
+
+    // a queued entry of a canceled token gets canceled the way cancel_task would do it, true if it was
+    bool cancel_by_token(task_entry_t *entry)
+    {
+        int state = TASK_QUEUED;
+        if (!entry->token.is_canceled() || !entry->state.compare_exchange_strong(state, TASK_CANCELED))
+            return false;
+
+        ++tasks_removed_;
+        return true;
+    }
+
+    // the queued entry must not start
+    bool is_tombstone(task_entry_t *entry, size_t &by_token)
+    {
+        if (cancel_by_token(entry))
+        {
+            ++by_token;
+            return true;
+        }
+
+        return entry->state == TASK_CANCELED;
+    }
+
+    // Unlinks the canceled entries of the shared queue into unlinked, returns how many of them got canceled
+    // here because of their token. The caller frees them with drop_tasks once the lock is released: destroying
+    // a task may add new ones (a broken future schedules its continuations).
+    // requires tasks_mutex_
+    size_t compact_queue(vector<task_entry_t *> &unlinked)
+    {
+        size_t by_token = 0;
+        size_t dropped = 0;
+
+        BOOST_FOREACH(task_queue_t::level_t &l, tasks_queue_.levels)
+        {
+            entry_queue_t fifo;
+            while (!l.fifo.empty())
+            {
+                task_entry_t *entry = l.fifo.pop();
+                if (is_tombstone(entry, by_token))
+                {
+                    unlinked.push_back(entry);
+                    ++dropped;
+                }
+                else
+                    fifo.push(entry);
+            }
+            l.fifo = fifo;
+
+            size_t kept = 0;
+            BOOST_FOREACH(task_entry_t *entry, l.deadlines)
+            {
+                if (is_tombstone(entry, by_token))
+                {
+                    unlinked.push_back(entry);
+                    ++dropped;
+                }
+                else
+                    l.deadlines[kept++] = entry;
+            }
+            l.deadlines.resize(kept);
+            std::make_heap(l.deadlines.begin(), l.deadlines.end(), &task_queue_t::later);
+        }
+
+        queued_count_ -= dropped;
+        urgent_ns_ = tasks_queue_.urgent_ns();
+        cancels_since_compaction_ = 0;
+
+        return by_token;
+    }
+
+    void clear_queue()
+    {
+        mutex_lock_t lock(tasks_mutex_);
+        tasks_queue_ = task_queue_t();
+        queued_count_ = 0;
+        urgent_ns_ = no_urgent_ns;
+    }
+
+    void cleanup()
+    {
+        log_.record(event_log::LOG_THREADS, EVENT_CLEANUP, 0);
+
+        clear_queue();
+
+        time_to_die_ = true;
+        {
+            mutex_lock_t lock(tasks_mutex_);
+            tasks_cond_.notify_all();
+            sizing_cond_.notify_all();
+        }
+        {
+            mutex_lock_t lock(timer_mutex_);
+            timer_cond_.notify_all();
+        }
+
+        if (sizing_thread_.joinable())
+            sizing_thread_.join();
+
+        // the wheel only holds pointers, tasks_ below has all of them
+        if (timer_thread_.joinable())
+            timer_thread_.join();
+        timers_.clear([](task_entry_t *) {});
+
+#if !defined(_WIN32)
+        // its callbacks may add tasks, before the workers are gone
+        reactor_.reset();
+#endif
+
+        BOOST_FOREACH(const auto &t, threads_)
+            t.second->thread->join();
+
+        // whatever is left was never run, the queues only hold pointers to these.
+        // Destroying a task may add new ones (broken futures schedule their continuations), hence the loop
+        for (bool cleared = true; cleared; )
+        {
+            cleared = false;
+            tasks_.clear([this, &cleared](task_id_t, task_entry_t *entry)
+            {
+                free_entry(entry);
+                cleared = true;
+            });
+        }
+
+        // everything the workers had to say is out before the pool is gone
+        log_.stop();
+    }
+
+    static void forget_worker(worker_t *)
+    {
+    }
+
+    static void forget_entry(task_entry_t *)
+    {
+    }
+
+    // the task the calling thread is running, of any pool
+    static boost::thread_specific_ptr<task_entry_t> &running_entry()
+    {
+        static boost::thread_specific_ptr<task_entry_t> entry(&threadpool::forget_entry);
+        return entry;
+    }
+
+private:
+    const scheduling_t scheduling_;
+
+    // constructed before and destroyed after the threads that write to it
+    event_log log_;
+
+    shared_ptr<sizing_policy> policy_;
+    const size_t hot_threads_;
+
+    node_pool<task_entry_t> entries_;
+    // every task that's queued or running
+    slot_table<task_entry_t *> tasks_;
+
+    // guarded by tasks_mutex_
+    task_queue_t tasks_queue_;
+    unordered_map<thread_id_t, worker_ptr> threads_;
+    vector<size_t> free_deques_;
+    size_t threads_alive_;
+    cpu_list_t affinity_cpus_;
+    bool affinity_one_each_;
+    uint64_t workers_created_;
+    uint64_t workers_expired_;
+    // the counters of the reaped threads
+    stats_t retired_;
+
+    mutex_t tasks_mutex_;
+    boost::condition_variable tasks_cond_;
+
+    // only if the policy has a tick
+    boost::thread sizing_thread_;
+    boost::condition_variable sizing_cond_;
+
+    atomic<task_id_t> next_task_id_;
+    thread_id_t next_thread_id_;
+
+    atomic_bool time_to_die_;
+
+    // workers not running a task
+    atomic<size_t> idle_count_;
+    // workers blocked on tasks_cond_
+    atomic<size_t> sleepers_count_;
+    // workers in spin_for_task
+    atomic<size_t> spinning_count_;
+    // see set_spin
+    atomic<uint64_t> spin_ns_;
+    atomic<size_t> spin_yields_;
+    // tasks_queue_.size() for the lock-free paths
+    atomic<size_t> queued_count_;
+    // tasks_queue_.urgent_ns() for the lock-free paths
+    atomic<uint64_t> urgent_ns_;
+    // canceled while queued
+    atomic<uint64_t> tasks_removed_;
+    // cancel_task hits since the shared queue was last compacted, some may have been popped since
+    atomic<size_t> cancels_since_compaction_;
+    // in a queue and not taken by a thread yet, canceled ones included
+    atomic<size_t> pending_count_;
+    // sizing_run's estimate
+    atomic<uint64_t> queue_latency_ns_;
+
+    // LOCK_FREE_QUEUE only
+    boost::scoped_ptr<ring_t> ring_;
+
+    // WORK_STEALING: fixed at construction so thieves can read it without locking
+    vector<shared_ptr<deque_t>> deques_;
+    atomic<size_t> deques_used_;
+
+    boost::thread_specific_ptr<worker_t> current_worker_;
+
+    // schedule_after/schedule_every, the thread starts with the first timer
+    mutex_t timer_mutex_;
+    boost::condition_variable timer_cond_;
+    boost::thread timer_thread_;
+    // guarded by timer_mutex_
+    timer_wheel<task_entry_t *> timers_;
+    // for stats().queue_depth
+    atomic<uint64_t> timers_added_;
+    atomic<uint64_t> timers_fired_;
+    // canceled and freed without firing
+    atomic<uint64_t> timers_discarded_;
+
+#if !defined(_WIN32)
+    // created by reactor() under timer_mutex_
+    boost::scoped_ptr<io_reactor> reactor_;
+#endif
+
+    // cleared by drain()
+    atomic_bool accepting_;
+};
+
+#include "task_future.h"
+#include "task_group.h"
+#include "coroutine.h"
+#include "numa_threadpool.h"
@@ -0,0 +1,159 @@
+#pragma once
+
+// Hierarchical timing wheel: num_levels wheels of 256 slots, level L slots are 256^L ticks wide.
+// An item goes to the lowest level whose span covers its delay, and moves one level down each time time reaches
+// its slot, so add is O(1) and advancing by one tick is O(1) plus the items it fires or moves.
+// With 4 levels the wheel spans 2^32 ticks, items due even later wait in an overflow list that is looked at
+// once per 2^32 ticks. Not thread-safe.
+template<typename T>
+struct timer_wheel
+{
+    static const size_t level_bits = 8;
+    static const size_t num_slots = size_t(1) << level_bits;
+    static const size_t num_levels = 4;
+    static const uint64_t no_tick = uint64_t(-1);
+
+    explicit timer_wheel(uint64_t now_tick)
+        : now_(now_tick)
+        , size_(0)
+    {}
+
+public:
+    // fires at the first advance past due_tick, the next one if it's due already
+    void add(uint64_t due_tick, const T &value)
+    {
+        place(item_t(std::max(due_tick, now_ + 1), value));
+        ++size_;
+    }
+
+    // moves time forward to tick, f(value) for every item due by then, in due order
+    template<typename F>
+    void advance(uint64_t tick, F f)
+    {
+        while (now_ < tick && size_ != 0)
+        {
+            ++now_;
+
+            // the higher slots whose turn has come move down first, some of their items may be due right now
+            for (size_t level = num_levels; level-- > 1; )
+            {
+                if ((now_ & ((uint64_t(1) << (level * level_bits)) - 1)) == 0)
+                    cascade(slots_[level][slot_of(now_, level)]);
+            }
+
+            if ((now_ & ((uint64_t(1) << (num_levels * level_bits)) - 1)) == 0)
+                cascade(overflow_);
+
+            vector<item_t> &due = slots_[0][slot_of(now_, 0)];
+            if (due.empty())
+                continue;
+
+            vector<item_t> fired;
+            fired.swap(due);
+            size_ -= fired.size();
+            BOOST_FOREACH(const item_t &it, fired)
+                f(it.value);
+        }
+
+        // nothing left to fire, skip the idle ticks
+        now_ = std::max(now_, tick);
+    }
+
+    // the first tick advance has something to do at (fire or move items down), no_tick if empty
+    uint64_t next_tick() const
+    {
+        if (size_ == 0)
+            return no_tick;
+
+        const uint64_t wrap = (now_ | (num_slots - 1)) + 1;
+        for (uint64_t t = now_ + 1; t < wrap; ++t)
+        {
+            if (!slots_[0][slot_of(t, 0)].empty())
+                return t;
+        }
+        return wrap;
+    }
+
+    uint64_t now() const
+    {
+        return now_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    // every item, in no particular order, the wheel is empty afterwards
+    template<typename F>
+    void clear(F f)
+    {
+        BOOST_FOREACH(auto &level, slots_)
+        {
+            BOOST_FOREACH(vector<item_t> &slot, level)
+            {
+                BOOST_FOREACH(const item_t &it, slot)
+                    f(it.value);
+                slot.clear();
+            }
+        }
+
+        BOOST_FOREACH(const item_t &it, overflow_)
+            f(it.value);
+        overflow_.clear();
+
+        size_ = 0;
+    }
+
+private:
+    struct item_t
+    {
+        item_t(uint64_t due, const T &value)
+            : due(due)
+            , value(value)
+        {}
+
+        uint64_t due;
+        T value;
+    };
+
+    static size_t slot_of(uint64_t tick, size_t level)
+    {
+        return size_t(tick >> (level * level_bits)) & (num_slots - 1);
+    }
+
+    // requires it.due >= now_
+    void place(const item_t &it)
+    {
+        const uint64_t delay = it.due - now_;
+        for (size_t level = 0; level < num_levels; ++level)
+        {
+            if (delay < (uint64_t(1) << ((level + 1) * level_bits)))
+            {
+                slots_[level][slot_of(it.due, level)].push_back(it);
+                return;
+            }
+        }
+
+        overflow_.push_back(it);
+    }
+
+    void cascade(vector<item_t> &slot)
+    {
+        vector<item_t> items;
+        items.swap(slot);
+        BOOST_FOREACH(const item_t &it, items)
+            place(it);
+    }
+
+private:
+    uint64_t now_;
+    size_t size_;
+    vector<item_t> slots_[num_levels][num_slots];
+    vector<item_t> overflow_;
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// CPU and NUMA node numbering as the OS sees it.
+// Linux reads the nodes from sysfs, elsewhere (or without sysfs) the machine is one node with all the CPUs.
+typedef vector<size_t> cpu_list_t;
+
+struct numa_node_t
+{
+    size_t id;
+    cpu_list_t cpus;
+};
+
+// "0-3,8,10-11" as in /sys/devices/system/node/node*/cpulist
+inline cpu_list_t parse_cpu_list(const string &s)
+{
+    cpu_list_t res;
+
+    vector<string> parts;
+    boost::split(parts, s, boost::is_any_of(","));
+    BOOST_FOREACH(string part, parts)
+    {
+        boost::trim(part);
+        if (part.empty())
+            continue;
+
+        vector<string> range;
+        boost::split(range, part, boost::is_any_of("-"));
+
+        const size_t first = boost::lexical_cast<size_t>(range.front());
+        const size_t last = boost::lexical_cast<size_t>(range.back());
+        for (size_t cpu = first; cpu <= last; ++cpu)
+            res.push_back(cpu);
+    }
+    return res;
+}
+
+inline vector<numa_node_t> numa_nodes()
+{
+    vector<numa_node_t> res;
+
+#if !defined(_WIN32)
+    for (size_t id = 0; ; ++id)
+    {
+        std::ifstream in(("/sys/devices/system/node/node" + boost::lexical_cast<string>(id) + "/cpulist").c_str());
+        if (!in)
+            break;
+
+        string line;
+        std::getline(in, line);
+
+        numa_node_t node;
+        node.id = id;
+        try
+        {
+            node.cpus = parse_cpu_list(line);
+        }
+        catch (boost::bad_lexical_cast &)
+        {
+            break;
+        }
+
+        // memory-only nodes have no CPUs
+        if (!node.cpus.empty())
+            res.push_back(node);
+    }
+#endif
+
+    if (res.empty())
+    {
+        numa_node_t node;
+        node.id = 0;
+        for (size_t cpu = 0; cpu < std::max(1u, boost::thread::hardware_concurrency()); ++cpu)
+            node.cpus.push_back(cpu);
+
+        res.push_back(node);
+    }
+
+    return res;
+}
+
+// the CPU the calling thread runs on right now, 0 if unknown
+inline size_t current_cpu()
+{
+#if defined(_WIN32)
+    return GetCurrentProcessorNumber();
+#else
+    const int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : size_t(cpu);
+#endif
+}
+
+// lets the thread run on the given CPUs only, false if the OS refuses
+inline bool pin_thread(boost::thread::native_handle_type thread, const cpu_list_t &cpus)
+{
+    if (cpus.empty())
+        return false;
+
+#if defined(_WIN32)
+    DWORD_PTR mask = 0;
+    BOOST_FOREACH(size_t cpu, cpus)
+    {
+        if (cpu < sizeof(mask) * 8)
+            mask |= DWORD_PTR(1) << cpu;
+    }
+    return mask != 0 && SetThreadAffinityMask(thread, mask) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    BOOST_FOREACH(size_t cpu, cpus)
+    {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#endif
+}
+
+inline bool pin_current_thread(const cpu_list_t &cpus)
+{
+#if defined(_WIN32)
+    return pin_thread(GetCurrentThread(), cpus);
+#else
+    return pin_thread(pthread_self(), cpus);
+#endif
+}
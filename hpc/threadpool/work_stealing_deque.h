@@ -0,0 +1,150 @@
+#pragma once
+
+// Chase-Lev work-stealing deque, with the memory orderings from
+// Le, Pop, Cohen, Zappa Nardelli "Correct and Efficient Work-Stealing for Weak Memory Models".
+// The owner thread pushes and pops at the bottom, any other thread steals from the top.
+// T is copied with plain loads/stores, so it should be something small like a pointer.
+template<typename T>
+struct work_stealing_deque
+    : boost::noncopyable
+{
+    explicit work_stealing_deque(size_t log_capacity = 6)
+        : top_(0)
+        , bottom_(0)
+        , array_(new array_t(log_capacity))
+    {
+    }
+
+    ~work_stealing_deque()
+    {
+        delete array_.load(memory_order_relaxed);
+        BOOST_FOREACH(array_t *a, garbage_)
+            delete a;
+    }
+
+public:
+    // owner only
+    void push(T item)
+    {
+        const int64_t b = bottom_.load(memory_order_relaxed);
+        const int64_t t = top_.load(memory_order_acquire);
+        array_t *a = array_.load(memory_order_relaxed);
+
+        if (b - t > int64_t(a->size()) - 1)
+            a = grow(a, t, b);
+
+        a->put(b, item);
+        bottom_.store(b + 1, memory_order_release);
+    }
+
+    // owner only
+    optional<T> pop()
+    {
+        const int64_t b = bottom_.load(memory_order_relaxed) - 1;
+        array_t *a = array_.load(memory_order_relaxed);
+        bottom_.store(b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t t = top_.load(memory_order_relaxed);
+
+        optional<T> res;
+        if (t <= b)
+        {
+            res = a->get(b);
+            if (t == b)
+            {
+                // the last item, race against thieves
+                if (!top_.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+                    res = boost::none;
+
+                bottom_.store(b + 1, memory_order_relaxed);
+            }
+        }
+        else
+            bottom_.store(b + 1, memory_order_relaxed);
+
+        return res;
+    }
+
+    // any thread, boost::none if empty or if we lost the race for the top item
+    optional<T> steal()
+    {
+        int64_t t = top_.load(memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        const int64_t b = bottom_.load(memory_order_acquire);
+
+        if (t >= b)
+            return boost::none;
+
+        const array_t *a = array_.load(memory_order_acquire);
+        const T item = a->get(t);
+        if (!top_.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+            return boost::none;
+
+        return item;
+    }
+
+    // approximate if called concurrently with push/pop/steal
+    bool empty() const
+    {
+        const int64_t b = bottom_.load(memory_order_seq_cst);
+        const int64_t t = top_.load(memory_order_seq_cst);
+        return b <= t;
+    }
+
+private:
+    struct array_t
+        : boost::noncopyable
+    {
+        explicit array_t(size_t log_capacity)
+            : mask_((size_t(1) << log_capacity) - 1)
+            , items_(new atomic<T>[size_t(1) << log_capacity])
+        {}
+
+        size_t size() const
+        {
+            return mask_ + 1;
+        }
+
+        T get(int64_t i) const
+        {
+            return items_[size_t(i) & mask_].load(memory_order_relaxed);
+        }
+
+        void put(int64_t i, T item)
+        {
+            items_[size_t(i) & mask_].store(item, memory_order_relaxed);
+        }
+
+        size_t log_capacity() const
+        {
+            size_t res = 0;
+            while ((size_t(1) << res) < size())
+                ++res;
+            return res;
+        }
+
+    private:
+        size_t mask_;
+        boost::scoped_array<atomic<T>> items_;
+    };
+
+    array_t *grow(array_t *old, int64_t t, int64_t b)
+    {
+        array_t *a = new array_t(old->log_capacity() + 1);
+        for (int64_t i = t; i < b; ++i)
+            a->put(i, old->get(i));
+
+        // thieves may still be reading the old array, it dies with the deque
+        garbage_.push_back(old);
+        array_.store(a, memory_order_release);
+        return a;
+    }
+
+private:
+    atomic<int64_t> top_;
+    atomic<int64_t> bottom_;
+    atomic<array_t *> array_;
+
+    // owner only
+    vector<array_t *> garbage_;
+};